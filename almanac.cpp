@@ -20,6 +20,7 @@
 #include <ctime>
 
 #include "sma_mysql.h"
+#include "sma_queries.h"
 #include "sma_struct.h"
 
 char *sunrise(ConfType *conf, int debug)
@@ -192,16 +193,13 @@ char *sunset(ConfType *conf)
     return returntime;
 }
 
-int todays_almanac(ConfType *conf, int debug)
+int todays_almanac(MySQLConnection &mysql_connection, int debug)
 /*  Check if sunset and sunrise have been set today */
 {
     int found = 0;
-    char SQLQUERY[200];
 
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
     //Get Start of day value
-    sprintf(SQLQUERY, "SELECT sunrise FROM Almanac WHERE date=DATE_FORMAT( NOW(), \"%%Y-%%m-%%d\" ) ");
-    auto result = mysql_connection.ExecuteQuery(SQLQUERY, debug);
+    auto result = mysql_connection.ExecuteQuery(QUERY_TODAYS_ALMANAC, debug);
     if (mysql_fetch_row(result.res))  //if there is a result, update the row
     {
         found = 1;
@@ -210,11 +208,10 @@ int todays_almanac(ConfType *conf, int debug)
     return found;
 }
 
-void update_almanac(ConfType *conf, char *sunrise, char *sunset, int debug)
+void update_almanac(MySQLConnection &mysql_connection, const char *sunrise, const char *sunset, int debug)
 {
     char SQLQUERY[200];
 
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
     //Get Start of day value
     sprintf(SQLQUERY, R"(INSERT INTO Almanac SET sunrise=CONCAT(DATE_FORMAT( NOW(), "%%Y-%%m-%%d "),"%s"), sunset=CONCAT(DATE_FORMAT( NOW(), "%%Y-%%m-%%d "),"%s" ), date=NOW() )", sunrise, sunset);
     mysql_connection.ExecuteQuery(SQLQUERY, debug);
@@ -5,11 +5,12 @@
 #ifndef SMA_BLUETOOTH_ALMANAC_H
 #define SMA_BLUETOOTH_ALMANAC_H
 
+#include "sma_mysql.h"
 #include "sma_struct.h"
 
 char *sunrise(ConfType *conf, int debug);
 char *sunset(ConfType *conf);
-int todays_almanac(ConfType *conf, int debug);
-void update_almanac(ConfType *conf, char *sunrise, char *sunset, int debug);
+int todays_almanac(MySQLConnection &mysql_connection, int debug);
+void update_almanac(MySQLConnection &mysql_connection, const char *sunrise, const char *sunset, int debug);
 
 #endif  //SMA_BLUETOOTH_ALMANAC_H
@@ -0,0 +1,61 @@
+#include "archive_decoder.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "stream_handling.h"
+
+static constexpr std::size_t MIN_RECORDS_PER_THREAD = 4096;
+
+float ArchivePower(const ArchiveRecord &previous, const ArchiveRecord &current)
+{
+    if (previous.total_wh == 0 || current.total_wh == 0 || current.date <= previous.date)
+        return 0;
+
+    const auto energy = static_cast<double>(current.total_wh) - static_cast<double>(previous.total_wh);
+    return static_cast<float>(energy * 3600 / static_cast<double>(current.date - previous.date));
+}
+
+static void DecodeRange(const unsigned char *data, ArchiveRecord *records, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        const auto *record = data + i * ARCHIVE_RECORD_SIZE;
+        records[i].date = ConvertStreamTo<time_t>(record, 4);
+        records[i].total_wh = ConvertStreamTo<unsigned long long>(record + 4, 8);
+        records[i].power = i > 0 ? ArchivePower(records[i - 1], records[i]) : 0;
+    }
+}
+
+std::vector<ArchiveRecord> DecodeArchiveRecords(const unsigned char *data, std::size_t length)
+{
+    std::vector<ArchiveRecord> records(length / ARCHIVE_RECORD_SIZE);
+    DecodeRange(data, records.data(), records.size());
+    return records;
+}
+
+std::vector<ArchiveRecord> DecodeArchiveRecordsParallel(const unsigned char *data, std::size_t length, unsigned int threads)
+{
+    const std::size_t count = length / ARCHIVE_RECORD_SIZE;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned int>(std::min<std::size_t>(threads, count / MIN_RECORDS_PER_THREAD));
+    if (threads < 2)
+        return DecodeArchiveRecords(data, length);
+
+    std::vector<ArchiveRecord> records(count);
+    const std::size_t chunk = (count + threads - 1) / threads;
+
+    std::vector<std::thread> workers;
+    for (std::size_t start = 0; start < count; start += chunk) {
+        const auto size = std::min(chunk, count - start);
+        workers.emplace_back(DecodeRange, data + start * ARCHIVE_RECORD_SIZE, records.data() + start, size);
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    // the first record of each chunk had no predecessor while decoding
+    for (std::size_t start = chunk; start < count; start += chunk)
+        records[start].power = ArchivePower(records[start - 1], records[start]);
+
+    return records;
+}
@@ -0,0 +1,32 @@
+#ifndef SMA_BLUETOOTH_ARCHIVE_DECODER_H
+#define SMA_BLUETOOTH_ARCHIVE_DECODER_H
+
+#include <cstddef>
+#include <ctime>
+#include <vector>
+
+constexpr std::size_t ARCHIVE_RECORD_SIZE = 12;  // 4 byte timestamp, 8 byte energy counter in Wh
+
+struct ArchiveRecord {
+    time_t date;
+    unsigned long long total_wh;  // 0 if the inverter has no value for this slot
+    float power;                  // average Watts since the previous record, 0 for the first one
+};
+
+// average power between two records, works for any record interval
+float ArchivePower(const ArchiveRecord &previous, const ArchiveRecord &current);
+
+/*
+ * Decode a buffer of archive records. Trailing bytes that do not form a
+ * complete record are ignored.
+ */
+std::vector<ArchiveRecord> DecodeArchiveRecords(const unsigned char *data, std::size_t length);
+
+/*
+ * Same as DecodeArchiveRecords but splits large buffers into chunks which
+ * are decoded on separate threads. The power of the first record of every
+ * chunk is fixed up afterwards. threads = 0 uses all cores.
+ */
+std::vector<ArchiveRecord> DecodeArchiveRecordsParallel(const unsigned char *data, std::size_t length, unsigned int threads = 0);
+
+#endif  //SMA_BLUETOOTH_ARCHIVE_DECODER_H
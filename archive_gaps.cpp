@@ -0,0 +1,62 @@
+#include "archive_gaps.h"
+
+#include <fmt/format.h>
+#if __has_include(<fmt/chrono.h>)
+#include <fmt/chrono.h>
+#else
+#include <fmt/time.h>
+#endif
+
+#include <algorithm>
+
+static bool SameLocalDay(time_t first, time_t second)
+{
+    tm first_tm{};
+    tm second_tm{};
+    localtime_r(&first, &first_tm);
+    localtime_r(&second, &second_tm);
+
+    return first_tm.tm_year == second_tm.tm_year && first_tm.tm_yday == second_tm.tm_yday;
+}
+
+void AddArchiveGap(TimeRangeList &gaps, time_t previous, time_t current, time_t interval)
+{
+    if (current <= previous + interval)
+        return;
+
+    if (!SameLocalDay(previous, current))
+        return;
+
+    gaps.push_back({previous + interval, current - interval});
+}
+
+TimeRangeList FindArchiveGaps(const std::vector<time_t> &timestamps, time_t interval)
+{
+    TimeRangeList gaps;
+    for (std::size_t i = 1; i < timestamps.size(); ++i)
+        AddArchiveGap(gaps, timestamps[i - 1], timestamps[i], interval);
+
+    return gaps;
+}
+
+TimeRangeList MergeArchiveGaps(TimeRangeList gaps, time_t interval)
+{
+    std::sort(gaps.begin(), gaps.end(), [](const TimeRange &a, const TimeRange &b) { return a.from < b.from; });
+
+    TimeRangeList merged;
+    for (const auto &gap : gaps) {
+        if (!merged.empty() && gap.from <= merged.back().to + interval)
+            merged.back().to = std::max(merged.back().to, gap.to);
+        else
+            merged.push_back(gap);
+    }
+
+    return merged;
+}
+
+std::string FormatArchiveTime(time_t time)
+{
+    tm local{};
+    localtime_r(&time, &local);
+    return fmt::format("{:%Y-%m-%d %H:%M:%S}", local);
+}
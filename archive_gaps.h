@@ -0,0 +1,36 @@
+#ifndef SMA_BLUETOOTH_ARCHIVE_GAPS_H
+#define SMA_BLUETOOTH_ARCHIVE_GAPS_H
+
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+
+constexpr time_t ARCHIVE_INTERVAL = 300;     // inverter day archive stores one record every 5 minutes
+constexpr std::size_t MAX_GAP_REFETCH = 24;  // upper limit of getrangedata requests to repair gaps per run
+
+// missing archive slots, both ends inclusive
+struct TimeRange {
+    time_t from;
+    time_t to;
+};
+
+using TimeRangeList = std::vector<TimeRange>;
+
+/*
+ * Record the slots missing between two consecutive archive records. Gaps
+ * spanning midnight are the inverter being switched off for the night and
+ * are not recorded.
+ */
+void AddArchiveGap(TimeRangeList &gaps, time_t previous, time_t current, time_t interval = ARCHIVE_INTERVAL);
+
+// gaps between the records of a sorted list of archive timestamps
+TimeRangeList FindArchiveGaps(const std::vector<time_t> &timestamps, time_t interval = ARCHIVE_INTERVAL);
+
+// sort and join overlapping or adjacent ranges
+TimeRangeList MergeArchiveGaps(TimeRangeList gaps, time_t interval = ARCHIVE_INTERVAL);
+
+// format as used by conf->datefrom / conf->dateto
+std::string FormatArchiveTime(time_t time);
+
+#endif  //SMA_BLUETOOTH_ARCHIVE_GAPS_H
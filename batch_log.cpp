@@ -0,0 +1,498 @@
+#include "batch_log.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+// a new segment is started once the current one has grown this large
+static constexpr std::uint64_t LOG_SEGMENT_BYTES = 4 << 20;
+// a larger size in an entry header means the header is garbage
+static constexpr std::uint32_t LOG_MAX_ENTRY = 64 << 20;
+static constexpr std::uint32_t LOG_MAGIC = 0x4c415753;
+
+struct LogEntryHeader {
+    std::uint32_t magic;
+    std::uint32_t size;  // payload bytes
+    std::uint32_t crc;   // of the payload
+    std::uint32_t kind;  // StorageBatch::Kind
+};
+
+static std::uint32_t Crc32(std::string_view data)
+{
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> table{};
+        for (std::uint32_t i = 0; i < table.size(); ++i) {
+            auto crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+            table[i] = crc;
+        }
+        return table;
+    }();
+
+    std::uint32_t crc = 0xFFFFFFFF;
+    for (const auto c : data)
+        crc = table[(crc ^ static_cast<unsigned char>(c)) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+static bool WriteAll(int fd, const char *data, std::size_t size, off_t offset)
+{
+    while (size > 0) {
+        const auto written = pwrite(fd, data, size, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static bool ReadAll(int fd, char *data, std::size_t size, off_t offset)
+{
+    while (size > 0) {
+        const auto read = pread(fd, data, size, offset);
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0)
+            return false;
+        data += read;
+        size -= read;
+        offset += read;
+    }
+    return true;
+}
+
+// entries are in host byte order, the log never leaves the machine
+class LogEncoder
+{
+public:
+    template <typename T>
+    void Put(T value) { m_data.append(reinterpret_cast<const char *>(&value), sizeof(value)); }
+    void PutString(std::string_view text)
+    {
+        Put(static_cast<std::uint32_t>(text.size()));
+        m_data.append(text);
+    }
+    [[nodiscard]] const std::string &data() const { return m_data; }
+
+private:
+    std::string m_data;
+};
+
+class LogDecoder
+{
+public:
+    explicit LogDecoder(std::string_view data) : m_data(data) {}
+    template <typename T>
+    bool Get(T &value)
+    {
+        if (m_data.size() < sizeof(T))
+            return false;
+        memcpy(&value, m_data.data(), sizeof(T));
+        m_data.remove_prefix(sizeof(T));
+        return true;
+    }
+    bool GetString(std::string &text)
+    {
+        std::uint32_t size = 0;
+        if (!Get(size) || m_data.size() < size)
+            return false;
+        text.assign(m_data.substr(0, size));
+        m_data.remove_prefix(size);
+        return true;
+    }
+    [[nodiscard]] bool empty() const { return m_data.empty(); }
+
+private:
+    std::string_view m_data;
+};
+
+static std::string EncodeBatch(const StorageBatch &batch, const SampleCatalog &catalog)
+/* The batch with the catalog entries it uses, numbered from 0 in order of appearance */
+{
+    std::unordered_map<SourceId, std::uint16_t> source_ids;
+    std::unordered_map<MetricId, std::uint16_t> metric_ids;
+    std::unordered_map<StringId, std::uint32_t> text_ids;
+    std::vector<SourceId> sources;
+    std::vector<MetricId> metrics;
+    std::vector<StringId> texts;
+    const auto source_id = [&](SourceId id) {
+        const auto [found, added] = source_ids.try_emplace(id, static_cast<std::uint16_t>(sources.size()));
+        if (added)
+            sources.push_back(id);
+        return found->second;
+    };
+    const auto metric_id = [&](MetricId id) {
+        const auto [found, added] = metric_ids.try_emplace(id, static_cast<std::uint16_t>(metrics.size()));
+        if (added)
+            metrics.push_back(id);
+        return found->second;
+    };
+
+    LogEncoder records;
+    if (batch.kind == StorageBatch::Kind::Live) {
+        records.Put(static_cast<std::uint32_t>(batch.live.size()));
+        for (std::size_t i = 0; i < batch.live.size(); ++i) {
+            auto value = batch.live.values[i];
+            if (catalog.GetMetric(batch.live.metrics[i]).kind == MetricKind::Text) {
+                const auto [found, added] = text_ids.try_emplace(static_cast<StringId>(value), static_cast<std::uint32_t>(texts.size()));
+                if (added)
+                    texts.push_back(static_cast<StringId>(value));
+                value = found->second;
+            }
+            records.Put(batch.live.times[i]);
+            records.Put(source_id(batch.live.sources[i]));
+            records.Put(metric_id(batch.live.metrics[i]));
+            records.Put(value);
+        }
+        // window summaries follow the records, most entries are single samples
+        std::vector<std::uint32_t> windows;
+        for (std::size_t i = 0; i < batch.live.size(); ++i) {
+            if (batch.live.Windowed(i))
+                windows.push_back(static_cast<std::uint32_t>(i));
+        }
+        if (!windows.empty()) {
+            records.Put(static_cast<std::uint32_t>(windows.size()));
+            for (const auto i : windows) {
+                records.Put(i);
+                records.Put(batch.live.means[i]);
+                records.Put(batch.live.minimums[i]);
+                records.Put(batch.live.maximums[i]);
+            }
+        }
+    } else {
+        records.Put(static_cast<std::uint32_t>(batch.archive.size()));
+        for (std::size_t i = 0; i < batch.archive.size(); ++i) {
+            records.Put(batch.archive.times[i]);
+            records.Put(source_id(batch.archive.sources[i]));
+            records.Put(batch.archive.energy[i]);
+            records.Put(batch.archive.current[i]);
+        }
+    }
+
+    LogEncoder payload;
+    payload.Put(static_cast<std::uint32_t>(sources.size()));
+    for (const auto id : sources) {
+        const auto source = catalog.GetSource(id);
+        payload.PutString(catalog.GetString(source.inverter));
+        payload.Put(static_cast<std::uint64_t>(source.serial));
+    }
+    payload.Put(static_cast<std::uint32_t>(metrics.size()));
+    for (const auto id : metrics) {
+        const auto metric = catalog.GetMetric(id);
+        payload.PutString(catalog.GetString(metric.description));
+        payload.PutString(catalog.GetString(metric.units));
+        payload.Put(static_cast<std::int32_t>(metric.decimals));
+        payload.Put(static_cast<std::uint8_t>(metric.persistent));
+        payload.Put(static_cast<std::uint8_t>(metric.kind));
+    }
+    payload.Put(static_cast<std::uint32_t>(texts.size()));
+    for (const auto id : texts)
+        payload.PutString(catalog.GetString(id));
+
+    return payload.data() + records.data();
+}
+
+static bool DecodeBatch(std::uint32_t kind, std::string_view payload, SampleCatalog &catalog, StorageBatch &batch)
+/* Add the catalog entries of an encoded batch to catalog and the records to batch */
+{
+    if (kind < static_cast<std::uint32_t>(StorageBatch::Kind::DayArchive) || kind > static_cast<std::uint32_t>(StorageBatch::Kind::Live))
+        return false;
+    batch.kind = static_cast<StorageBatch::Kind>(kind);
+
+    LogDecoder decoder(payload);
+    std::uint32_t count = 0;
+    std::string text;
+    std::string units;
+
+    std::vector<SourceId> sources;
+    if (!decoder.Get(count))
+        return false;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        std::uint64_t serial = 0;
+        if (!decoder.GetString(text) || !decoder.Get(serial))
+            return false;
+        sources.push_back(catalog.AddSource(text.c_str(), serial));
+    }
+
+    std::vector<MetricId> metrics;
+    if (!decoder.Get(count))
+        return false;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        std::int32_t decimals = 0;
+        std::uint8_t persistent = 0;
+        std::uint8_t metric_kind = 0;
+        if (!decoder.GetString(text) || !decoder.GetString(units) || !decoder.Get(decimals) || !decoder.Get(persistent) || !decoder.Get(metric_kind))
+            return false;
+        metrics.push_back(catalog.AddMetric(text.c_str(), units.c_str(), decimals, persistent != 0, static_cast<MetricKind>(metric_kind)));
+    }
+
+    std::vector<StringId> texts;
+    if (!decoder.Get(count))
+        return false;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        if (!decoder.GetString(text))
+            return false;
+        texts.push_back(catalog.Intern(text));
+    }
+
+    if (!decoder.Get(count))
+        return false;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        std::uint32_t time = 0;
+        std::uint16_t source = 0;
+        if (!decoder.Get(time) || !decoder.Get(source) || source >= sources.size())
+            return false;
+
+        if (batch.kind == StorageBatch::Kind::Live) {
+            std::uint16_t metric = 0;
+            double value = 0;
+            if (!decoder.Get(metric) || !decoder.Get(value) || metric >= metrics.size())
+                return false;
+            if (catalog.GetMetric(metrics[metric]).kind == MetricKind::Text) {
+                if (value < 0 || value >= texts.size())
+                    return false;
+                value = texts[static_cast<std::size_t>(value)];
+            }
+            batch.live.Add(time, sources[source], metrics[metric], value);
+        } else {
+            double energy = 0;
+            float current = 0;
+            if (!decoder.Get(energy) || !decoder.Get(current))
+                return false;
+            batch.archive.Add(time, sources[source], energy, current);
+        }
+    }
+
+    if (batch.kind == StorageBatch::Kind::Live && !decoder.empty()) {
+        if (!decoder.Get(count))
+            return false;
+        for (std::uint32_t i = 0; i < count; ++i) {
+            std::uint32_t index = 0;
+            double mean = 0;
+            double minimum = 0;
+            double maximum = 0;
+            if (!decoder.Get(index) || !decoder.Get(mean) || !decoder.Get(minimum) || !decoder.Get(maximum) || index >= batch.live.size())
+                return false;
+            batch.live.means[index] = mean;
+            batch.live.minimums[index] = minimum;
+            batch.live.maximums[index] = maximum;
+        }
+    }
+
+    return true;
+}
+
+BatchLog::BatchLog(std::string directory) : m_directory(std::move(directory))
+{
+    if (mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST)
+        throw std::runtime_error(fmt::format("{}: {}", m_directory, strerror(errno)));
+
+    DIR *dir = opendir(m_directory.c_str());
+    if (!dir)
+        throw std::runtime_error(fmt::format("{}: {}", m_directory, strerror(errno)));
+    while (const auto *entry = readdir(dir)) {
+        unsigned long long segment = 0;
+        char extra = 0;
+        if (sscanf(entry->d_name, "%llu.log%c", &segment, &extra) == 1)
+            m_segments.push_back(segment);
+    }
+    closedir(dir);
+    std::sort(m_segments.begin(), m_segments.end());
+
+    std::ifstream checkpoint(m_directory + "/checkpoint");
+    if (!(checkpoint >> m_acknowledged.segment >> m_acknowledged.offset))
+        m_acknowledged = {m_segments.empty() ? 1 : m_segments.front(), 0};
+
+    if (!OpenSegment(m_segments.empty() ? m_acknowledged.segment : m_segments.back()))
+        throw std::runtime_error(fmt::format("{}: {}", SegmentPath(m_end.segment), strerror(errno)));
+}
+
+BatchLog::~BatchLog()
+{
+    Sync();
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+std::string BatchLog::SegmentPath(std::uint64_t segment) const
+{
+    return fmt::format("{}/{:08d}.log", m_directory, segment);
+}
+
+bool BatchLog::OpenSegment(std::uint64_t segment)
+/* Continue writing at the end of the last whole entry of segment */
+{
+    const auto path = SegmentPath(segment);
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    // find the end of the last entry with a good checksum
+    std::uint64_t end = 0;
+    LogEntryHeader header{};
+    std::string payload;
+    while (end + sizeof(header) <= static_cast<std::uint64_t>(st.st_size) && ReadAll(fd, reinterpret_cast<char *>(&header), sizeof(header), end)) {
+        if (header.magic != LOG_MAGIC || header.size > LOG_MAX_ENTRY || end + sizeof(header) + header.size > static_cast<std::uint64_t>(st.st_size))
+            break;
+        payload.resize(header.size);
+        if (!ReadAll(fd, payload.data(), payload.size(), end + sizeof(header)) || Crc32(payload) != header.crc)
+            break;
+        end += sizeof(header) + header.size;
+    }
+    if (end < static_cast<std::uint64_t>(st.st_size)) {
+        fmt::print(stderr, "Cutting {} bytes of a torn entry off {}\n", st.st_size - end, path);
+        if (ftruncate(fd, end) != 0) {
+            close(fd);
+            return false;
+        }
+    }
+
+    if (std::find(m_segments.begin(), m_segments.end(), segment) == m_segments.end()) {
+        m_segments.push_back(segment);
+        // make the new file itself survive a crash
+        const int dir = open(m_directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (dir >= 0) {
+            fsync(dir);
+            close(dir);
+        }
+    }
+
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = fd;
+    m_end = {segment, end};
+    m_dirty = false;
+    return true;
+}
+
+bool BatchLog::Append(const StorageBatch &batch, const SampleCatalog &catalog)
+{
+    // the full segment is synced before it is left behind
+    if (m_end.offset >= LOG_SEGMENT_BYTES && (!Sync() || !OpenSegment(m_end.segment + 1)))
+        return false;
+
+    const auto payload = EncodeBatch(batch, catalog);
+    const LogEntryHeader header{LOG_MAGIC, static_cast<std::uint32_t>(payload.size()), Crc32(payload), static_cast<std::uint32_t>(batch.kind)};
+    std::string entry(reinterpret_cast<const char *>(&header), sizeof(header));
+    entry.append(payload);
+    if (!WriteAll(m_fd, entry.data(), entry.size(), m_end.offset))
+        return false;
+
+    m_end.offset += entry.size();
+    m_dirty = true;
+    return true;
+}
+
+bool BatchLog::Sync()
+{
+    if (!m_dirty)
+        return true;
+    if (fdatasync(m_fd) != 0)
+        return false;
+
+    m_dirty = false;
+    return true;
+}
+
+void BatchLog::Replay(LogPosition from, SampleCatalog &catalog, const std::function<bool(StorageBatch &, LogPosition)> &visit)
+{
+    // Acknowledge may delete segments on the way
+    const auto segments = m_segments;
+    LogEntryHeader header{};
+    std::string payload;
+    for (const auto segment : segments) {
+        if (segment < from.segment)
+            continue;
+
+        const auto path = SegmentPath(segment);
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        struct stat st {};
+        auto end = segment == m_end.segment ? m_end.offset : (fstat(fd, &st) == 0 ? st.st_size : 0);
+        auto offset = segment == from.segment ? from.offset : 0;
+
+        while (offset + sizeof(header) <= end) {
+            StorageBatch batch;
+            if (!ReadAll(fd, reinterpret_cast<char *>(&header), sizeof(header), offset) || header.magic != LOG_MAGIC || header.size > LOG_MAX_ENTRY ||
+                offset + sizeof(header) + header.size > end) {
+                fmt::print(stderr, "Error! Damaged entry in {} at {}, skipping the rest of it\n", path, offset);
+                break;
+            }
+            payload.resize(header.size);
+            if (!ReadAll(fd, payload.data(), payload.size(), offset + sizeof(header)) || Crc32(payload) != header.crc || !DecodeBatch(header.kind, payload, catalog, batch)) {
+                fmt::print(stderr, "Error! Damaged entry in {} at {}, skipping the rest of it\n", path, offset);
+                break;
+            }
+
+            offset += sizeof(header) + header.size;
+            if (!visit(batch, {segment, offset})) {
+                close(fd);
+                return;
+            }
+        }
+        close(fd);
+    }
+}
+
+void BatchLog::Acknowledge(LogPosition position)
+{
+    m_acknowledged = position;
+
+    // not synced, an acknowledgement lost in a crash only stores some batches twice
+    const auto path = m_directory + "/checkpoint";
+    {
+        std::ofstream file(path + ".tmp", std::ios::trunc);
+        file << position.segment << ' ' << position.offset << '\n';
+        if (!file.flush()) {
+            fmt::print(stderr, "Error! Could not write {}.tmp\n", path);
+            return;
+        }
+    }
+    if (std::rename((path + ".tmp").c_str(), path.c_str()) != 0)
+        fmt::print(stderr, "Error! Could not write {}\n", path);
+
+    while (m_segments.size() > 1 && m_segments.front() < position.segment) {
+        unlink(SegmentPath(m_segments.front()).c_str());
+        m_segments.erase(m_segments.begin());
+    }
+}
+
+std::uint64_t BatchLog::pending() const
+{
+    std::uint64_t bytes = 0;
+    for (const auto segment : m_segments) {
+        if (segment < m_acknowledged.segment)
+            continue;
+
+        struct stat st {};
+        auto end = segment == m_end.segment ? m_end.offset : (stat(SegmentPath(segment).c_str(), &st) == 0 ? st.st_size : 0);
+        const auto start = segment == m_acknowledged.segment ? m_acknowledged.offset : 0;
+        bytes += end > start ? end - start : 0;
+    }
+
+    return bytes;
+}
@@ -0,0 +1,61 @@
+#ifndef SMA_BLUETOOTH_BATCH_LOG_H
+#define SMA_BLUETOOTH_BATCH_LOG_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "sample_batch.h"
+
+// place right after an entry of the log
+struct LogPosition {
+    std::uint64_t segment{1};
+    std::uint64_t offset{0};
+};
+
+/*
+ * Write-ahead log of storage batches, so a database outage costs no data.
+ * Every batch is appended before it is stored and acknowledged once the
+ * database has it. Replay hands out everything after the last
+ * acknowledgement, oldest first, including batches of earlier runs.
+ *
+ * Entries carry their inverter and metric names, so they can be replayed
+ * without the catalog they were written with. Each entry has a CRC32. A
+ * torn entry at the end is cut off when the log is opened. Appends only
+ * reach the disk on Sync, one fdatasync for all of them. Segments hold
+ * about LOG_SEGMENT_BYTES and are deleted once fully acknowledged.
+ */
+class BatchLog
+{
+public:
+    // creates the directory if needed, throws std::runtime_error if it can not be used
+    explicit BatchLog(std::string directory);
+    ~BatchLog();
+    BatchLog(const BatchLog &) = delete;
+    BatchLog &operator=(const BatchLog &) = delete;
+
+    bool Append(const StorageBatch &batch, const SampleCatalog &catalog);
+    bool Sync();
+    // batches after from, their ids refer to catalog. visit returns false to stop
+    void Replay(LogPosition from, SampleCatalog &catalog, const std::function<bool(StorageBatch &, LogPosition)> &visit);
+    // everything up to position has been stored
+    void Acknowledge(LogPosition position);
+
+    [[nodiscard]] LogPosition acknowledged() const { return m_acknowledged; }
+    // bytes appended and not acknowledged yet
+    [[nodiscard]] std::uint64_t pending() const;
+
+private:
+    [[nodiscard]] std::string SegmentPath(std::uint64_t segment) const;
+    bool OpenSegment(std::uint64_t segment);
+
+    std::string m_directory;
+    std::vector<std::uint64_t> m_segments;  // on disk, oldest first
+    LogPosition m_acknowledged;
+    LogPosition m_end;
+    int m_fd{-1};
+    bool m_dirty{false};
+};
+
+#endif  //SMA_BLUETOOTH_BATCH_LOG_H
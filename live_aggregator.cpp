@@ -0,0 +1,139 @@
+#include "live_aggregator.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+
+LiveAggregator::LiveAggregator(const ReturnType *keys, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; ++i) {
+        if (keys[i].window > 0)
+            m_lengths[keys[i].description] = keys[i].window;
+    }
+}
+
+void LiveAggregator::Aggregate(const LiveBatch &batch, const SampleCatalog &catalog, LiveBatch &stored)
+{
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto time = batch.Time(i);
+        const auto value = batch.values[i];
+        const auto metric = catalog.GetMetric(batch.metrics[i]);
+        const auto &description = catalog.GetString(metric.description);
+        const auto length = m_lengths.find(description);
+        if (metric.kind != MetricKind::Number || length == m_lengths.end()) {
+            stored.Add(time, batch.sources[i], batch.metrics[i], value);
+            continue;
+        }
+
+        const auto source = catalog.GetSource(batch.sources[i]);
+        auto [found, added] = m_open.try_emplace(fmt::format("{}\t{}\t{}", catalog.GetString(source.inverter), source.serial, description));
+        auto &window = found->second;
+        // a late sample does not reopen a window that was already stored
+        if (!added && time < window.start) {
+            stored.Add(time, batch.sources[i], batch.metrics[i], value);
+            continue;
+        }
+
+        window.source = batch.sources[i];
+        window.metric = batch.metrics[i];
+        const auto start = time - time % length->second;
+        if (!added && (start != window.start || length->second != window.length)) {
+            Emit(window, stored);
+            added = true;
+        }
+
+        if (added) {
+            window.start = start;
+            window.length = length->second;
+            window.last_time = time;
+            window.last = value;
+            window.sum = value;
+            window.minimum = value;
+            window.maximum = value;
+            window.count = 1;
+        } else {
+            if (time >= window.last_time) {
+                window.last_time = time;
+                window.last = value;
+            }
+            window.sum += value;
+            window.minimum = std::min(window.minimum, value);
+            window.maximum = std::max(window.maximum, value);
+            ++window.count;
+        }
+    }
+}
+
+void LiveAggregator::Flush(time_t now, LiveBatch &stored)
+{
+    for (auto it = m_open.begin(); it != m_open.end();) {
+        if (it->second.source && it->second.start + it->second.length <= now) {
+            Emit(it->second, stored);
+            it = m_open.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void LiveAggregator::Emit(const Window &window, LiveBatch &stored)
+{
+    stored.AddWindow(window.last_time, *window.source, window.metric, window.last, window.sum / window.count, window.minimum, window.maximum);
+}
+
+bool LiveAggregator::Load(const char *path)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    // inverter, serial and description, then the window
+    std::string line;
+    std::vector<std::string> fields;
+    while (std::getline(file, line)) {
+        fields.clear();
+        std::size_t begin = 0;
+        for (auto end = line.find('\t'); end != std::string::npos; end = line.find('\t', begin)) {
+            fields.push_back(line.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        fields.push_back(line.substr(begin));
+        if (fields.size() != 11)
+            continue;
+
+        Window window{};
+        window.start = strtoll(fields[3].c_str(), nullptr, 10);
+        window.length = strtoll(fields[4].c_str(), nullptr, 10);
+        window.last_time = strtoll(fields[5].c_str(), nullptr, 10);
+        window.last = strtod(fields[6].c_str(), nullptr);
+        window.sum = strtod(fields[7].c_str(), nullptr);
+        window.minimum = strtod(fields[8].c_str(), nullptr);
+        window.maximum = strtod(fields[9].c_str(), nullptr);
+        window.count = static_cast<std::uint32_t>(strtoul(fields[10].c_str(), nullptr, 10));
+        if (window.length > 0 && window.count > 0)
+            m_open.insert_or_assign(fmt::format("{}\t{}\t{}", fields[0], fields[1], fields[2]), window);
+    }
+    return true;
+}
+
+bool LiveAggregator::Save(const char *path) const
+{
+    // write next to the state file and rename so a crash never leaves half a file
+    const auto temporary = std::string(path) + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        if (!file)
+            return false;
+
+        for (const auto &[key, window] : m_open)
+            file << fmt::format("{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\n", key, window.start, window.length, window.last_time, window.last, window.sum, window.minimum, window.maximum, window.count);
+        if (!file.flush())
+            return false;
+    }
+
+    return std::rename(temporary.c_str(), path) == 0;
+}
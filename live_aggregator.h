@@ -0,0 +1,61 @@
+#ifndef SMA_BLUETOOTH_LIVE_AGGREGATOR_H
+#define SMA_BLUETOOTH_LIVE_AGGREGATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "sample_batch.h"
+#include "sma_struct.h"
+
+/*
+ * Windowed aggregation of live values between the decoder and the
+ * database. Number metrics with a window in the unit conversions are
+ * collected per inverter into windows aligned to multiples of their
+ * length and stored once per window with the mean, minimum, maximum and
+ * last value. Everything else passes unchanged. A window is emitted by
+ * the first sample after it or by Flush once it has ended.
+ *
+ * smatool reads the inverter once per run, so open windows can be carried
+ * over in a state file, one tab separated line each.
+ */
+class LiveAggregator
+{
+public:
+    LiveAggregator(const ReturnType *keys, unsigned int count);
+
+    // the samples of batch for storage, windowed samples replaced by the windows they close
+    void Aggregate(const LiveBatch &batch, const SampleCatalog &catalog, LiveBatch &stored);
+    // add the windows that ended at or before now
+    void Flush(time_t now, LiveBatch &stored);
+
+    bool Load(const char *path);
+    bool Save(const char *path) const;
+
+    [[nodiscard]] std::size_t open() const { return m_open.size(); }
+
+private:
+    struct Window {
+        time_t start;
+        time_t length;
+        time_t last_time;
+        double last;
+        double sum;
+        double minimum;
+        double maximum;
+        std::uint32_t count;
+        // ids of this run, unknown for a loaded window until its metric is read again
+        std::optional<SourceId> source;
+        MetricId metric;
+    };
+
+    static void Emit(const Window &window, LiveBatch &stored);
+
+    std::unordered_map<std::string, time_t> m_lengths;  // by description
+    std::unordered_map<std::string, Window> m_open;      // by inverter, serial and description
+};
+
+#endif  //SMA_BLUETOOTH_LIVE_AGGREGATOR_H
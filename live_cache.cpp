@@ -0,0 +1,60 @@
+#include "live_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+
+std::size_t LiveValueCache::KeyHash::operator()(const Key &key) const
+{
+    std::size_t hash = std::hash<std::string>{}(key.inverter);
+    hash ^= std::hash<unsigned long long>{}(key.serial) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= std::hash<std::string>{}(key.description) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+bool LiveValueCache::Changed(std::string_view inverter, unsigned long long serial, std::string_view description, std::string_view value) const
+{
+    const auto found = m_values.find(Key{std::string(inverter), serial, std::string(description)});
+    return found == m_values.end() || found->second != value;
+}
+
+void LiveValueCache::Update(std::string_view inverter, unsigned long long serial, std::string_view description, std::string_view value)
+{
+    m_values[Key{std::string(inverter), serial, std::string(description)}].assign(value);
+}
+
+bool LiveValueCache::Load(const char *path)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string inverter;
+    std::string serial;
+    std::string description;
+    std::string value;
+    while (std::getline(file, inverter, '\t') && std::getline(file, serial, '\t') && std::getline(file, description, '\t') && std::getline(file, value))
+        Update(inverter, strtoull(serial.c_str(), nullptr, 10), description, value);
+
+    m_primed = true;
+    return true;
+}
+
+bool LiveValueCache::Save(const char *path) const
+{
+    // write next to the snapshot and rename so a crash never leaves half a file
+    const auto temporary = std::string(path) + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        if (!file)
+            return false;
+
+        for (const auto &[key, value] : m_values)
+            file << key.inverter << '\t' << key.serial << '\t' << key.description << '\t' << value << '\n';
+        if (!file.flush())
+            return false;
+    }
+
+    return std::rename(temporary.c_str(), path) == 0;
+}
@@ -0,0 +1,44 @@
+#ifndef SMA_BLUETOOTH_LIVE_CACHE_H
+#define SMA_BLUETOOTH_LIVE_CACHE_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+ * Most recent LiveData value of every (inverter, serial, description), so
+ * unchanged persistent values can be skipped without asking the database.
+ * The snapshot file holds one tab separated entry per line.
+ */
+class LiveValueCache
+{
+public:
+    // true if the value differs from the last one stored or nothing is known yet
+    [[nodiscard]] bool Changed(std::string_view inverter, unsigned long long serial, std::string_view description, std::string_view value) const;
+    void Update(std::string_view inverter, unsigned long long serial, std::string_view description, std::string_view value);
+    void MarkPrimed() { m_primed = true; }
+
+    bool Load(const char *path);
+    bool Save(const char *path) const;
+
+    [[nodiscard]] bool primed() const { return m_primed; }
+    [[nodiscard]] std::size_t size() const { return m_values.size(); }
+
+private:
+    struct Key {
+        std::string inverter;
+        unsigned long long serial;
+        std::string description;
+
+        bool operator==(const Key &other) const { return serial == other.serial && inverter == other.inverter && description == other.description; }
+    };
+    struct KeyHash {
+        std::size_t operator()(const Key &key) const;
+    };
+
+    std::unordered_map<Key, std::string, KeyHash> m_values;
+    bool m_primed{false};
+};
+
+#endif  //SMA_BLUETOOTH_LIVE_CACHE_H
@@ -0,0 +1,99 @@
+#include "live_retention.h"
+
+#include <algorithm>
+#include <cmath>
+
+time_t StartOfDay(time_t time)
+{
+    tm local{};
+    localtime_r(&time, &local);
+    local.tm_hour = 0;
+    local.tm_min = 0;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return mktime(&local);
+}
+
+time_t NextDay(time_t day)
+{
+    // mktime normalises the 32nd and takes care of daylight saving changes
+    tm local{};
+    localtime_r(&day, &local);
+    local.tm_mday += 1;
+    local.tm_hour = 0;
+    local.tm_min = 0;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return mktime(&local);
+}
+
+static time_t StartOfHour(time_t time)
+{
+    // tm_isdst is kept, so the hour repeated when daylight saving ends stays two hours
+    tm local{};
+    localtime_r(&time, &local);
+    local.tm_min = 0;
+    local.tm_sec = 0;
+    return mktime(&local);
+}
+
+time_t LiveRetention::HourlyBefore(time_t now) const
+{
+    return StartOfDay(now - static_cast<time_t>(raw_days) * 86400);
+}
+
+time_t LiveRetention::ChangesBefore(time_t now) const
+{
+    // the change points are taken from hourly rows only
+    return StartOfDay(now - static_cast<time_t>(std::max(hourly_days, raw_days)) * 86400);
+}
+
+std::vector<LiveRow> CompactHours(const std::vector<LiveRow> &rows)
+{
+    std::vector<LiveRow> hours;
+    std::size_t count = 0;
+    double sum = 0;
+    // local hours like the days, looked up only when a row leaves the hour of the row before
+    time_t hour = 0;
+    for (const auto &row : rows) {
+        if (hours.empty() || row.time < hour || row.time >= hour + 3600)
+            hour = StartOfHour(row.time);
+        const auto windowed = !std::isnan(row.mean);
+        auto *last = hours.empty() ? nullptr : &hours.back();
+        if (!last || last->inverter != row.inverter || last->metric != row.metric || last->time != hour) {
+            hours.push_back({row.inverter, row.metric, row.kind, hour, row.value, NAN, NAN, NAN});
+            last = &hours.back();
+            count = 0;
+            sum = 0;
+            if (row.kind == MetricKind::Number) {
+                last->minimum = windowed ? row.minimum : row.value;
+                last->maximum = windowed ? row.maximum : row.value;
+            }
+        }
+
+        // the rows are in time order, so the last one has the value of the hour
+        last->value = row.value;
+        if (row.kind != MetricKind::Number)
+            continue;
+        sum += windowed ? row.mean : row.value;
+        last->mean = sum / static_cast<double>(++count);
+        last->minimum = std::min(last->minimum, windowed ? row.minimum : row.value);
+        last->maximum = std::max(last->maximum, windowed ? row.maximum : row.value);
+    }
+    return hours;
+}
+
+std::vector<LiveRow> RepeatedRows(const std::vector<LiveRow> &rows, LiveSeriesValues &previous)
+{
+    std::vector<LiveRow> repeated;
+    for (const auto &row : rows) {
+        const auto [found, added] = previous.try_emplace({row.inverter, row.metric}, row.value);
+        if (added)
+            continue;
+        if (found->second == row.value)
+            repeated.push_back(row);
+        else
+            found->second = row.value;
+    }
+    return repeated;
+}
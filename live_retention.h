@@ -0,0 +1,62 @@
+#ifndef SMA_BLUETOOTH_LIVE_RETENTION_H
+#define SMA_BLUETOOTH_LIVE_RETENTION_H
+
+#include <ctime>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "sample_batch.h"
+
+// a single run spends at most this long compacting, a backlog is worked off over several runs
+static constexpr time_t LIVE_COMPACT_SECONDS = 20;
+
+/*
+ * How LiveValue is thinned out as it ages: rows newer than raw_days are
+ * kept as stored, older ones are reduced to one row per series and hour,
+ * and after hourly_days only the hours whose value differs from the hour
+ * before are kept. 0 keeps the rows of that stage for ever.
+ *
+ * The backends compact a local day per transaction, oldest first, and
+ * remember how far each stage got, so no lock is held for long and a day
+ * is never compacted twice.
+ */
+struct LiveRetention {
+    int raw_days;
+    int hourly_days;
+
+    [[nodiscard]] bool enabled() const { return raw_days > 0; }
+    // the end of the days each stage may compact, local midnight
+    [[nodiscard]] time_t HourlyBefore(time_t now) const;
+    [[nodiscard]] time_t ChangesBefore(time_t now) const;
+};
+
+// one row of LiveValue, the ids are those of the database
+struct LiveRow {
+    long long inverter;
+    long long metric;
+    MetricKind kind;
+    time_t time;
+    double value;
+    double mean;  // NaN if the row is not a window
+    double minimum;
+    double maximum;
+};
+
+time_t StartOfDay(time_t time);
+time_t NextDay(time_t day);
+
+// rows sorted by series and time, one row per series and hour at the start
+// of the local hour: the last value and, for numbers, the mean, minimum and maximum
+// over the samples and windows of the hour
+std::vector<LiveRow> CompactHours(const std::vector<LiveRow> &rows);
+
+// the last value of each series, by inverter and metric
+using LiveSeriesValues = std::map<std::pair<long long, long long>, double>;
+
+// rows sorted by series and time that repeat the value kept before them.
+// previous holds the value before the first row of a series if there is one
+// and is left holding the last value of every series.
+std::vector<LiveRow> RepeatedRows(const std::vector<LiveRow> &rows, LiveSeriesValues &previous);
+
+#endif  //SMA_BLUETOOTH_LIVE_RETENTION_H
@@ -0,0 +1,245 @@
+#include "mysql_storage.h"
+
+#include <fmt/format.h>
+
+#include <cstdlib>
+#include <utility>
+
+#include "almanac.h"
+#include "sma_queries.h"
+
+MySQLStorage::MySQLStorage(const ConfType &conf, bool debug, bool select_database)
+    : m_conf(conf), m_debug(debug), m_connection(conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, select_database ? conf.MySqlDatabase : nullptr),
+      m_batch_rows(conf.daydata_batch_rows > 0 ? conf.daydata_batch_rows : 1), m_batch_bytes(conf.daydata_batch_bytes > 0 ? conf.daydata_batch_bytes : 1)
+{
+    m_connection.query_stats().SetSlowThreshold(std::chrono::milliseconds(conf.slow_query_ms));
+}
+
+void MySQLStorage::Install()
+{
+    install_mysql_tables(m_connection, &m_conf, SCHEMA, m_debug);
+}
+
+void MySQLStorage::Update()
+{
+    update_mysql_tables(m_connection, m_debug);
+}
+
+bool MySQLStorage::CheckSchema()
+{
+    return check_schema(m_connection, SCHEMA, m_debug) == 1;
+}
+
+void MySQLStorage::Maintain()
+{
+    maintain_partitions(m_connection, m_debug);
+}
+
+void MySQLStorage::Explain()
+{
+    explain_queries(m_connection, m_debug);
+}
+
+void MySQLStorage::Ping()
+{
+    m_connection.Ping();
+}
+
+bool MySQLStorage::HasAlmanac()
+{
+    return todays_almanac(m_connection, m_debug) == 1;
+}
+
+void MySQLStorage::StoreAlmanac(const char *sunrise, const char *sunset)
+{
+    update_almanac(m_connection, sunrise, sunset, m_debug);
+}
+
+bool MySQLStorage::IsLight()
+{
+    bool light = true;
+
+    MYSQL_ROW row;
+    if (auto result = m_connection.ExecuteQuery(QUERY_AFTER_SUNRISE, m_debug); result.res && (row = mysql_fetch_row(result.res))) {
+        if (atoi(row[0]) == 0) light = false;
+    }
+
+    if (light) {
+        if (auto result = m_connection.ExecuteQuery(QUERY_AFTER_SUNSET, m_debug); result.res && (row = mysql_fetch_row(result.res))) {
+            if (atoi(row[0]) == 1) light = false;
+        }
+    }
+
+    return light;
+}
+
+std::vector<SyncState> MySQLStorage::SyncStates()
+{
+    std::vector<SyncState> states;
+    m_connection.ForEachRow(
+        QUERY_SYNC_STATES,
+        [&states](MYSQL_ROW row) {
+            const auto column = [row](int i) { return std::string(row[i] ? row[i] : ""); };
+            states.push_back({column(0), strtoull(row[1], nullptr, 10), column(2), column(3), column(4)});
+            return true;
+        },
+        m_debug);
+
+    return states;
+}
+
+TimeRangeList MySQLStorage::DayDataGaps(unsigned long long serial, time_t from, time_t to)
+{
+    return daydata_gaps(m_connection, serial, from, to, m_debug);
+}
+
+bool MySQLStorage::StoreDayData(const ArchiveBatch &batch, const SampleCatalog &catalog)
+{
+    // the sync state only moves once the whole batch is stored
+    if (!m_connection.Begin(m_debug))
+        return false;
+    const auto stored_all = insert_daydata(m_connection, batch, catalog, m_batch_rows, m_batch_bytes, m_debug) &&
+                            update_sync_state(m_connection, "LastArchive", LatestTimes(batch), catalog, m_debug);
+    if (!stored_all) {
+        m_connection.Rollback(m_debug);
+        return false;
+    }
+    return m_connection.Commit(m_debug);
+}
+
+bool MySQLStorage::StoreDayDataBulk(const ArchiveBatch &batch, const SampleCatalog &catalog)
+{
+    // one rollup statement per day and month of the backlog, a year is a few hundred
+    if (!m_bulk_refused) {
+        if (!m_connection.Begin(m_debug))
+            return false;
+        const auto loaded = bulk_load_daydata(m_connection, batch, catalog, m_debug);
+        if (loaded == BulkLoad::Stored) {
+            const auto stored_all = update_day_energy(m_connection, batch, catalog, m_debug) &&
+                                    update_sync_state(m_connection, "LastArchive", LatestTimes(batch), catalog, m_debug);
+            if (!stored_all) {
+                m_connection.Rollback(m_debug);
+                return false;
+            }
+            return m_connection.Commit(m_debug);
+        }
+        m_connection.Rollback(m_debug);
+        // a failed load is tried again with the batch, only a refusal lasts for the run
+        if (loaded == BulkLoad::Failed)
+            return false;
+
+        fmt::print(stderr, "LOAD DATA LOCAL refused, storing the archive with INSERTs\n");
+        m_bulk_refused = true;
+    }
+
+    return StoreDayData(batch, catalog);
+}
+
+std::vector<PVOutputRecord> MySQLStorage::PendingPVOutput(int max_power, const DayDataKey &after, std::size_t limit)
+{
+    auto &query = m_connection.Prepare(QUERY_PVOUTPUT_PENDING);
+    query.Bind(0, static_cast<long long>(max_power));
+    query.Bind(1, after.date_time.empty() ? "1970-01-01 00:00:00" : after.date_time);
+    query.Bind(2, after.inverter);
+    // Serial is a varchar, compared and sorted as text like the column
+    query.Bind(3, std::to_string(after.serial));
+    query.Bind(4, static_cast<unsigned long long>(limit));
+
+    std::vector<PVOutputRecord> pending;
+    if (!query.Execute(m_debug))
+        return pending;
+    while (query.Fetch()) {
+        const auto column = [&query](int i) { return std::string(query.Column(i) ? query.Column(i) : ""); };
+        pending.push_back({column(0), column(1), column(2), column(3), {column(4), column(5), strtoull(column(6).c_str(), nullptr, 10)}});
+    }
+
+    return pending;
+}
+
+void MySQLStorage::MarkPVOutput(const DayDataKey &key)
+{
+    auto &query_update = m_connection.Prepare("UPDATE DayData set PVOutput=NOW() WHERE DateTime=? AND Inverter=? AND Serial=?");
+    auto &sync_update = m_connection.Prepare(
+        "UPDATE SyncState AS ss JOIN DayData AS dd ON dd.Inverter=ss.Inverter AND dd.Serial=ss.Serial \
+         SET ss.LastUpload=GREATEST(IFNULL(ss.LastUpload, dd.DateTime), dd.DateTime) WHERE dd.DateTime=? AND dd.Inverter=? AND dd.Serial=?");
+    if (!m_connection.Begin(m_debug))
+        return;
+    for (auto *statement : {&query_update, &sync_update}) {
+        statement->Bind(0, key.date_time);
+        statement->Bind(1, key.inverter);
+        statement->Bind(2, std::to_string(key.serial));
+    }
+    if (query_update.Execute(m_debug) && sync_update.Execute(m_debug))
+        m_connection.Commit(m_debug);
+    else
+        m_connection.Rollback(m_debug);
+}
+
+std::vector<std::pair<std::string, float>> MySQLStorage::FinishedDays(const std::string &before, std::size_t limit)
+{
+    std::vector<std::pair<std::string, float>> days;
+    m_connection.ForEachRow(
+        fmt::format(QUERY_REPOST_DAYS, before, limit),
+        [&days](MYSQL_ROW row) {
+            days.emplace_back(row[0], atof(row[1] ? row[1] : "0"));
+            return true;
+        },
+        m_debug);
+
+    return days;
+}
+
+std::vector<MonthTotal> MySQLStorage::MonthTotals(const std::string &from, const std::string &to)
+{
+    return month_totals(m_connection, from, to, m_debug);
+}
+
+bool MySQLStorage::StoreMonthData(const ArchiveBatch &batch, const SampleCatalog &catalog)
+{
+    return insert_monthdata(m_connection, batch, catalog, m_debug);
+}
+
+std::string MySQLStorage::MonthDataWatermark(const char *inverter, unsigned long long serial)
+{
+    return monthdata_watermark(m_connection, inverter, serial, m_debug);
+}
+
+bool MySQLStorage::StoreLive(const LiveBatch &batch, const SampleCatalog &catalog, LiveValueCache &cache)
+{
+    if (!m_connection.Begin(m_debug))
+        return false;
+    // the values of a rolled back batch are not stored, the cache must not skip them next time
+    auto cached = cache;
+    const auto stored_all = live_mysql(m_connection, m_debug, batch, catalog, cache) && update_sync_state(m_connection, "LastLive", LatestTimes(batch), catalog, m_debug);
+    if (!stored_all) {
+        m_connection.Rollback(m_debug);
+        cache = std::move(cached);
+        return false;
+    }
+    if (m_connection.Commit(m_debug))
+        return true;
+    cache = std::move(cached);
+    return false;
+}
+
+void MySQLStorage::PrimeLiveCache(LiveValueCache &cache)
+{
+    prime_live_cache(m_connection, cache, m_debug);
+}
+
+std::optional<double> MySQLStorage::LatestLive(const char *inverter, unsigned long long serial, const char *description)
+{
+    auto &query = m_connection.Prepare(QUERY_LATEST_METRIC);
+    query.Bind(0, inverter);
+    query.Bind(1, serial);
+    query.Bind(2, description);
+    if (query.Execute(m_debug) && query.Fetch() && query.Column(0))
+        return strtod(query.Column(0), nullptr);
+
+    return std::nullopt;
+}
+
+void MySQLStorage::CompactLive(time_t now)
+{
+    compact_live(m_connection, {m_conf.live_raw_days, m_conf.live_hourly_days}, now, m_debug);
+}
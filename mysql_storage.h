@@ -0,0 +1,56 @@
+#ifndef SMA_BLUETOOTH_MYSQL_STORAGE_H
+#define SMA_BLUETOOTH_MYSQL_STORAGE_H
+
+#include "sma_mysql.h"
+#include "storage.h"
+
+/*
+ * Storage on a MySQL server through one MySQLConnection, using the
+ * functions of sma_mysql.h.
+ */
+class MySQLStorage : public Storage
+{
+public:
+    MySQLStorage(const ConfType &conf, bool debug, bool select_database);
+
+    void Install() override;
+    void Update() override;
+    bool CheckSchema() override;
+    void Maintain() override;
+    void Explain() override;
+    void Ping() override;
+
+    bool HasAlmanac() override;
+    void StoreAlmanac(const char *sunrise, const char *sunset) override;
+    bool IsLight() override;
+
+    std::vector<SyncState> SyncStates() override;
+    TimeRangeList DayDataGaps(unsigned long long serial, time_t from, time_t to) override;
+    bool StoreDayData(const ArchiveBatch &batch, const SampleCatalog &catalog) override;
+    bool StoreDayDataBulk(const ArchiveBatch &batch, const SampleCatalog &catalog) override;
+    std::vector<PVOutputRecord> PendingPVOutput(int max_power, const DayDataKey &after, std::size_t limit) override;
+    void MarkPVOutput(const DayDataKey &key) override;
+    std::vector<std::pair<std::string, float>> FinishedDays(const std::string &before, std::size_t limit) override;
+    std::vector<MonthTotal> MonthTotals(const std::string &from, const std::string &to) override;
+
+    bool StoreMonthData(const ArchiveBatch &batch, const SampleCatalog &catalog) override;
+    std::string MonthDataWatermark(const char *inverter, unsigned long long serial) override;
+
+    bool StoreLive(const LiveBatch &batch, const SampleCatalog &catalog, LiveValueCache &cache) override;
+    void PrimeLiveCache(LiveValueCache &cache) override;
+    std::optional<double> LatestLive(const char *inverter, unsigned long long serial, const char *description) override;
+    void CompactLive(time_t now) override;
+
+    QueryStats &query_stats() override { return m_connection.query_stats(); }
+
+private:
+    ConfType m_conf;
+    bool m_debug;
+    MySQLConnection m_connection;
+    std::size_t m_batch_rows;
+    std::size_t m_batch_bytes;
+    // the server refused LOAD DATA LOCAL once, don't ask again
+    bool m_bulk_refused{false};
+};
+
+#endif  //SMA_BLUETOOTH_MYSQL_STORAGE_H
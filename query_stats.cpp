@@ -0,0 +1,117 @@
+#include "query_stats.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cctype>
+
+static bool IsWord(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+}
+
+static void FoldValueRows(std::string &query)
+/* Turn "(?,?),(?,?),(?,?)" into "(?,?),..." */
+{
+    std::size_t open = 0;
+    while ((open = query.find('(', open)) != std::string::npos) {
+        const auto close = query.find(')', open);
+        if (close == std::string::npos)
+            return;
+
+        const auto row = query.substr(open, close - open + 1);
+        if (row.find_first_not_of("(?, )") != std::string::npos) {
+            open = close;
+            continue;
+        }
+
+        auto end = close + 1;
+        auto repeats = 0;
+        while (end < query.size() && query[end] == ',' && query.compare(end + 1, row.size(), row) == 0) {
+            end += 1 + row.size();
+            ++repeats;
+        }
+        if (repeats > 0)
+            query.replace(close + 1, end - close - 1, ",...");
+        open = close + 1;
+    }
+}
+
+std::string QueryTemplate(std::string_view query)
+{
+    std::string text;
+    text.reserve(query.size());
+
+    for (std::size_t i = 0; i < query.size();) {
+        const char c = query[i];
+        if (c == '\'' || c == '"') {
+            // quoted literal, backslash escapes and doubled quotes stay inside it
+            for (++i; i < query.size(); ++i) {
+                if (query[i] == '\\')
+                    ++i;
+                else if (query[i] == c && (i + 1 >= query.size() || query[i + 1] != c))
+                    break;
+                else if (query[i] == c)
+                    ++i;
+            }
+            ++i;
+            text += '?';
+        } else if (std::isdigit(static_cast<unsigned char>(c)) && (text.empty() || !IsWord(text.back()))) {
+            while (i < query.size() && (IsWord(query[i]) || query[i] == '.'))
+                ++i;
+            text += '?';
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            while (i < query.size() && std::isspace(static_cast<unsigned char>(query[i])))
+                ++i;
+            // spacing around commas and parentheses varies between callers
+            const char next = i < query.size() ? query[i] : ',';
+            if (!text.empty() && text.back() != ',' && text.back() != '(' && next != ',' && next != ')')
+                text += ' ';
+        } else {
+            text += c;
+            ++i;
+        }
+    }
+    FoldValueRows(text);
+    return text;
+}
+
+void QueryStats::Record(std::string_view query, duration elapsed, unsigned long long rows)
+{
+    if (m_slow_threshold.count() > 0 && elapsed >= m_slow_threshold) {
+        // multi row inserts can be huge, the start is enough to recognise them
+        constexpr std::size_t shown = 400;
+        fmt::print(stderr, "slow query {} ms, {} rows: {}{}\n", std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), rows,
+                   query.substr(0, shown), query.size() > shown ? "..." : "");
+    }
+
+    auto &entry = m_templates[QueryTemplate(query)];
+    ++entry.count;
+    entry.rows += rows;
+    entry.total += elapsed;
+    entry.max = std::max(entry.max, elapsed);
+    if (entry.samples.size() < MAX_SAMPLES)
+        entry.samples.push_back(elapsed);
+    else
+        entry.samples[entry.count % MAX_SAMPLES] = elapsed;
+}
+
+void QueryStats::Print(FILE *out) const
+{
+    std::vector<std::pair<const std::string *, const Entry *>> order;
+    order.reserve(m_templates.size());
+    for (const auto &[query, entry] : m_templates)
+        order.emplace_back(&query, &entry);
+    std::sort(order.begin(), order.end(), [](const auto &a, const auto &b) { return a.second->total > b.second->total; });
+
+    const auto ms = [](duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    fmt::print(out, "{:>7} {:>10} {:>9} {:>9} {:>9}  query\n", "count", "rows", "total ms", "max ms", "p95 ms");
+    for (const auto &[query, entry] : order) {
+        // nearest rank, the sample at ceil(0.95 n)
+        auto samples = entry->samples;
+        const auto p95 = samples.begin() + (samples.size() * 95 + 99) / 100 - 1;
+        std::nth_element(samples.begin(), p95, samples.end());
+        fmt::print(out, "{:>7} {:>10} {:>9.1f} {:>9.1f} {:>9.1f}  {}\n", entry->count, entry->rows, ms(entry->total), ms(entry->max), ms(*p95), *query);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef SMA_BLUETOOTH_QUERY_STATS_H
+#define SMA_BLUETOOTH_QUERY_STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// query text with literals replaced by ? and repeated VALUES rows folded, so
+// every run of the same statement lands on the same key
+std::string QueryTemplate(std::string_view query);
+
+/*
+ * Time spent in the database per query template. Statements slower than
+ * the threshold are written to stderr with their full text.
+ */
+class QueryStats
+{
+public:
+    using duration = std::chrono::steady_clock::duration;
+
+    // zero turns the slow query log off
+    void SetSlowThreshold(std::chrono::milliseconds threshold) { m_slow_threshold = threshold; }
+    void Record(std::string_view query, duration elapsed, unsigned long long rows);
+    // one line per template, slowest total first
+    void Print(FILE *out) const;
+
+    [[nodiscard]] bool empty() const { return m_templates.empty(); }
+
+private:
+    // p95 is taken from the most recent samples only
+    static constexpr std::size_t MAX_SAMPLES = 1024;
+
+    struct Entry {
+        std::size_t count{0};
+        unsigned long long rows{0};
+        duration total{};
+        duration max{};
+        std::vector<duration> samples;
+    };
+
+    std::chrono::milliseconds m_slow_threshold{0};
+    std::map<std::string, Entry> m_templates;
+};
+
+#endif  //SMA_BLUETOOTH_QUERY_STATS_H
@@ -23,9 +23,12 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
 
-#include "sma_mysql.h"
 #include "sma_struct.h"
+#include "storage.h"
 
 std::size_t write_data(void *ptr, std::size_t size, std::size_t num_blocks, void *stream)
 {
@@ -35,7 +38,10 @@ std::size_t write_data(void *ptr, std::size_t size, std::size_t num_blocks, void
     return written;
 }
 
-void sma_repost(ConfType *conf, FlagType *flag)
+// days read from the database at a time, the result is not held open while posting
+constexpr std::size_t REPOST_PAGE = 100;
+
+void sma_repost(Storage &storage, ConfType *conf, FlagType *flag)
 {
     FILE *fp;
     CURL *curl;
@@ -44,80 +50,85 @@ void sma_repost(ConfType *conf, FlagType *flag)
     char SQLQUERY[1000];
     char compurl[400];
     int update_data;
-    MYSQL_ROW row;
 
     float dtotal;
     float power;
 
-    /* Connect to database */
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
-    //Get Start of day value
-    printf(R"(SELECT DATE_FORMAT( dt1.DateTime, "%%Y%%m%%d" ), round((dt1.ETotalToday*1000-dt2.ETotalToday*1000),0) FROM DayData as dt1 join DayData as dt2 on dt2.DateTime = DATE_SUB( dt1.DateTime, interval 1 day ) WHERE dt1.DateTime LIKE "%%-%%-%% 23:55:00" ' ORDER BY dt1.DateTime DESC)");
-    sprintf(SQLQUERY, R"(SELECT DATE_FORMAT( dt1.DateTime, "%%Y%%m%%d" ), round((dt1.ETotalToday*1000-dt2.ETotalToday*1000),0) FROM DayData as dt1 join DayData as dt2 on dt2.DateTime = DATE_SUB( dt1.DateTime, interval 1 day ) WHERE dt1.DateTime LIKE "%%-%%-%% 23:55:00" ORDER BY dt1.DateTime DESC)");
-    auto result = mysql_connection.ExecuteQuery(SQLQUERY, flag->debug);
-    while ((row = mysql_fetch_row(result.res)))  //if there is a result, update the row
-    {
-    startforwait:
-        fp = fopen("/tmp/curl_output", "w+");
-        update_data = 0;
-        dtotal = atof(row[1]);
-        sleep(2);  //pvoutput limits 1 second output
-        sprintf(compurl, "http://pvoutput.org/service/r1/getstatistic.jsp?df=%s&dt=%s&key=%s&sid=%s", row[0], row[0], conf->PVOutputKey, conf->PVOutputSid);
-        curl = curl_easy_init();
-        if (curl) {
-            curl_easy_setopt(curl, CURLOPT_URL, compurl);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-            //curl_easy_setopt(curl, CURLOPT_FAILONERROR, compurl);
-            curl_result = curl_easy_perform(curl);
-            if (flag->debug == 1) printf("result = %d\n", curl_result);
-            rewind(fp);
-            fgets(buf, sizeof(buf), fp);
-            curl_result = static_cast<CURLcode>(sscanf(buf, "Bad request %s has no outputs between the requested period", buf1));
-            printf("return=%d buf1=%s\n", curl_result, buf1);
-            if (curl_result > 0) {
-                update_data = 1;
-                printf("test\n");
-            } else {
-                printf("buf=%s here 1.\n", buf);
-                curl_result = static_cast<CURLcode>(sscanf(buf, "Forbidden 403: Exceeded 60 requests %s", buf1));
-                if (curl_result > 0) {
-                    printf("Too Many requests in 1hr sleeping for 1hr\n");
-                    fclose(fp);
-                    sleep(3600);
-                    goto startforwait;
-                }
+    std::vector<std::pair<std::string, float>> days;
+    std::string cursor = "99991231";
+    do {
+        //Get energy produced on the next page of finished days
+        if (flag->debug == 1) printf("finished days before %s\n", cursor.c_str());
+        days = storage.FinishedDays(cursor, REPOST_PAGE);
 
+        for (const auto &[day, day_total] : days) {
+        startforwait:
+            fp = fopen("/tmp/curl_output", "w+");
+            update_data = 0;
+            dtotal = day_total;
+            sleep(2);  //pvoutput limits 1 second output
+            sprintf(compurl, "http://pvoutput.org/service/r1/getstatistic.jsp?df=%s&dt=%s&key=%s&sid=%s", day.c_str(), day.c_str(), conf->PVOutputKey, conf->PVOutputSid);
+            curl = curl_easy_init();
+            if (curl) {
+                curl_easy_setopt(curl, CURLOPT_URL, compurl);
+                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+                curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+                //curl_easy_setopt(curl, CURLOPT_FAILONERROR, compurl);
+                curl_result = curl_easy_perform(curl);
+                if (flag->debug == 1) printf("result = %d\n", curl_result);
+                rewind(fp);
+                fgets(buf, sizeof(buf), fp);
+                curl_result = static_cast<CURLcode>(sscanf(buf, "Bad request %s has no outputs between the requested period", buf1));
                 printf("return=%d buf1=%s\n", curl_result, buf1);
-                if (sscanf(buf, "%f,%s", &power, buf1) > 0) {
-                    printf("Power %f\n", power);
-                    if (power != dtotal) {
-                        printf("Power %f Produced=%f\n", power, dtotal);
-                        update_data = 1;
+                if (curl_result > 0) {
+                    update_data = 1;
+                    printf("test\n");
+                } else {
+                    printf("buf=%s here 1.\n", buf);
+                    curl_result = static_cast<CURLcode>(sscanf(buf, "Forbidden 403: Exceeded 60 requests %s", buf1));
+                    if (curl_result > 0) {
+                        printf("Too Many requests in 1hr sleeping for 1hr\n");
+                        fclose(fp);
+                        sleep(3600);
+                        goto startforwait;
+                    }
+
+                    printf("return=%d buf1=%s\n", curl_result, buf1);
+                    if (sscanf(buf, "%f,%s", &power, buf1) > 0) {
+                        printf("Power %f\n", power);
+                        if (power != dtotal) {
+                            printf("Power %f Produced=%f\n", power, dtotal);
+                            update_data = 1;
+                        }
                     }
                 }
-            }
-            curl_easy_cleanup(curl);
-            if (update_data == 1) {
-                curl = curl_easy_init();
-                if (curl) {
-                    sprintf(compurl, "http://pvoutput.org/service/r2/addoutput.jsp?d=%s&g=%f&key=%s&sid=%s", row[0], dtotal, conf->PVOutputKey, conf->PVOutputSid);
-                    if (flag->debug == 1) printf("url = %s\n", compurl);
-                    curl_easy_setopt(curl, CURLOPT_URL, compurl);
-                    curl_easy_setopt(curl, CURLOPT_FAILONERROR, compurl);
-                    curl_result = curl_easy_perform(curl);
-                    sleep(1);
-                    if (flag->debug == 1) printf("result = %d\n", curl_result);
-                    curl_easy_cleanup(curl);
-                    if (curl_result == 0) {
-                        sprintf(SQLQUERY, "UPDATE DayData set PVOutput=NOW() WHERE DateTime=\"%s235500\"  ", row[0]);
-                        if (flag->debug == 1) printf("%s\n", SQLQUERY);
-                        //DoQuery(SQLQUERY);
-                    } else
-                        break;
+                curl_easy_cleanup(curl);
+                if (update_data == 1) {
+                    curl = curl_easy_init();
+                    if (curl) {
+                        sprintf(compurl, "http://pvoutput.org/service/r2/addoutput.jsp?d=%s&g=%f&key=%s&sid=%s", day.c_str(), dtotal, conf->PVOutputKey, conf->PVOutputSid);
+                        if (flag->debug == 1) printf("url = %s\n", compurl);
+                        curl_easy_setopt(curl, CURLOPT_URL, compurl);
+                        curl_easy_setopt(curl, CURLOPT_FAILONERROR, compurl);
+                        curl_result = curl_easy_perform(curl);
+                        sleep(1);
+                        if (flag->debug == 1) printf("result = %d\n", curl_result);
+                        curl_easy_cleanup(curl);
+                        if (curl_result == 0) {
+                            sprintf(SQLQUERY, "UPDATE DayData set PVOutput=NOW() WHERE DateTime=\"%s235500\"  ", day.c_str());
+                            if (flag->debug == 1) printf("%s\n", SQLQUERY);
+                            //DoQuery(SQLQUERY);
+                        } else {
+                            fclose(fp);
+                            return;
+                        }
+                    }
                 }
             }
+            fclose(fp);
         }
-        fclose(fp);
-    }
+
+        if (!days.empty())
+            cursor = days.back().first;
+    } while (days.size() == REPOST_PAGE);
 }
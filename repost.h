@@ -16,5 +16,6 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "sma_struct.h"
+#include "storage.h"
 
-void sma_repost(ConfType* conf, FlagType* flag);
+void sma_repost(Storage &storage, ConfType *conf, FlagType *flag);
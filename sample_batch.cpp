@@ -0,0 +1,258 @@
+#include "sample_batch.h"
+
+#include <fmt/format.h>
+#if __has_include(<fmt/chrono.h>)
+#include <fmt/chrono.h>
+#else
+#include <fmt/time.h>
+#endif
+
+#include <algorithm>
+#include <map>
+
+StringId SampleCatalog::Intern(std::string_view text)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return InternLocked(text);
+}
+
+StringId SampleCatalog::InternLocked(std::string_view text)
+{
+    if (auto it = m_string_ids.find(text); it != m_string_ids.end())
+        return it->second;
+
+    const auto id = static_cast<StringId>(m_strings.size());
+    const auto &stored = m_strings.emplace_back(text);
+    m_string_ids.emplace(stored, id);
+    return id;
+}
+
+const std::string &SampleCatalog::GetString(StringId id) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_strings.at(id);
+}
+
+SourceId SampleCatalog::AddSource(const char *inverter, unsigned long long serial)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto name = InternLocked(inverter);
+    for (std::size_t i = 0; i < m_sources.size(); ++i) {
+        if (m_sources[i].inverter == name && m_sources[i].serial == serial)
+            return static_cast<SourceId>(i);
+    }
+
+    m_sources.push_back({name, serial});
+    return static_cast<SourceId>(m_sources.size() - 1);
+}
+
+SampleSource SampleCatalog::GetSource(SourceId id) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sources.at(id);
+}
+
+std::optional<SourceId> SampleCatalog::FindSource(const char *inverter, unsigned long long serial) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto name = m_string_ids.find(inverter);
+    if (name == m_string_ids.end())
+        return std::nullopt;
+
+    for (std::size_t i = 0; i < m_sources.size(); ++i) {
+        if (m_sources[i].inverter == name->second && m_sources[i].serial == serial)
+            return static_cast<SourceId>(i);
+    }
+    return std::nullopt;
+}
+
+MetricId SampleCatalog::AddMetric(const char *description, const char *units, int decimals, bool persistent, MetricKind kind)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto description_id = InternLocked(description);
+    const auto units_id = InternLocked(units);
+    for (std::size_t i = 0; i < m_metrics.size(); ++i) {
+        if (m_metrics[i].description == description_id && m_metrics[i].units == units_id)
+            return static_cast<MetricId>(i);
+    }
+
+    m_metrics.push_back({description_id, units_id, decimals, persistent, kind});
+    return static_cast<MetricId>(m_metrics.size() - 1);
+}
+
+SampleMetric SampleCatalog::GetMetric(MetricId id) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_metrics.at(id);
+}
+
+std::optional<MetricId> SampleCatalog::FindMetric(std::string_view description) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto name = m_string_ids.find(description);
+    if (name == m_string_ids.end())
+        return std::nullopt;
+
+    for (std::size_t i = 0; i < m_metrics.size(); ++i) {
+        if (m_metrics[i].description == name->second)
+            return static_cast<MetricId>(i);
+    }
+    return std::nullopt;
+}
+
+void LiveBatch::Add(time_t time, SourceId source, MetricId metric, double value)
+{
+    AddWindow(time, source, metric, value, NAN, NAN, NAN);
+}
+
+void LiveBatch::AddWindow(time_t time, SourceId source, MetricId metric, double last, double mean, double minimum, double maximum)
+{
+    times.push_back(static_cast<std::uint32_t>(time));
+    sources.push_back(source);
+    metrics.push_back(metric);
+    values.push_back(last);
+    means.push_back(mean);
+    minimums.push_back(minimum);
+    maximums.push_back(maximum);
+}
+
+void LiveBatch::clear()
+{
+    times.clear();
+    sources.clear();
+    metrics.clear();
+    values.clear();
+    means.clear();
+    minimums.clear();
+    maximums.clear();
+}
+
+void ArchiveBatch::Add(time_t time, SourceId source, double energy_kwh, float current_value)
+{
+    times.push_back(static_cast<std::uint32_t>(time));
+    sources.push_back(source);
+    energy.push_back(energy_kwh);
+    current.push_back(current_value);
+}
+
+void ArchiveBatch::Append(const ArchiveBatch &other)
+{
+    times.insert(times.end(), other.times.begin(), other.times.end());
+    sources.insert(sources.end(), other.sources.begin(), other.sources.end());
+    energy.insert(energy.end(), other.energy.begin(), other.energy.end());
+    current.insert(current.end(), other.current.begin(), other.current.end());
+}
+
+void ArchiveBatch::clear()
+{
+    times.clear();
+    sources.clear();
+    energy.clear();
+    current.clear();
+}
+
+template <typename Batch>
+static std::unordered_map<SourceId, time_t> NewestBySource(const Batch &batch)
+{
+    std::unordered_map<SourceId, time_t> latest;
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        auto [found, added] = latest.try_emplace(batch.sources[i], batch.Time(i));
+        if (!added)
+            found->second = std::max(found->second, batch.Time(i));
+    }
+    return latest;
+}
+
+std::unordered_map<SourceId, time_t> LatestTimes(const ArchiveBatch &batch)
+{
+    return NewestBySource(batch);
+}
+
+std::unordered_map<SourceId, time_t> LatestTimes(const LiveBatch &batch)
+{
+    return NewestBySource(batch);
+}
+
+std::vector<DaySummary> SummariseDays(const ArchiveBatch &batch)
+{
+    // batches normally cover one or two days of one inverter
+    std::map<std::pair<SourceId, int>, DaySummary> days;
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        // empty archive slots decode to a zero counter, as the start of the day it would count the lifetime total
+        if (batch.energy[i] <= 0)
+            continue;
+
+        const auto time = batch.Time(i);
+        tm local{};
+        localtime_r(&time, &local);
+
+        const auto [day, added] = days.try_emplace({batch.sources[i], (local.tm_year + 1900) * 1000 + local.tm_yday}, DaySummary{batch.sources[i], time, batch.energy[i], batch.energy[i], batch.current[i], time});
+        if (!added) {
+            day->second.start = std::min(day->second.start, batch.energy[i]);
+            day->second.end = std::max(day->second.end, batch.energy[i]);
+            if (batch.current[i] > day->second.peak || (batch.current[i] == day->second.peak && time < day->second.peak_time)) {
+                day->second.peak = batch.current[i];
+                day->second.peak_time = time;
+            }
+        }
+    }
+
+    std::vector<DaySummary> summary;
+    summary.reserve(days.size());
+    for (const auto &day : days)
+        summary.push_back(day.second);
+    return summary;
+}
+
+std::vector<MonthSpan> SummariseMonths(const std::vector<DaySummary> &days)
+{
+    std::map<std::pair<SourceId, int>, MonthSpan> months;
+    for (const auto &day : days) {
+        tm local{};
+        localtime_r(&day.time, &local);
+        // day 0 of the next month is the last day of this one
+        tm last{};
+        last.tm_year = local.tm_year;
+        last.tm_mon = local.tm_mon + 1;
+        last.tm_mday = 0;
+        last.tm_hour = 12;
+        last.tm_isdst = -1;
+        mktime(&last);
+
+        months.try_emplace({day.source, (local.tm_year + 1900) * 100 + local.tm_mon},
+                           MonthSpan{day.source, fmt::format("{:04d}-{:02d}-01", local.tm_year + 1900, local.tm_mon + 1),
+                                     fmt::format("{:04d}-{:02d}-{:02d}", last.tm_year + 1900, last.tm_mon + 1, last.tm_mday)});
+    }
+
+    std::vector<MonthSpan> summary;
+    summary.reserve(months.size());
+    for (const auto &month : months)
+        summary.push_back(month.second);
+    return summary;
+}
+
+std::string FormatLiveValue(const SampleCatalog &catalog, const SampleMetric &metric, double value)
+{
+    if (metric.kind == MetricKind::Text)
+        return catalog.GetString(static_cast<StringId>(value));
+
+    return FormatLiveValue(metric.kind, metric.decimals, value);
+}
+
+std::string FormatLiveValue(MetricKind kind, int decimals, double value)
+{
+    switch (kind) {
+        case MetricKind::Text:
+            break;
+        case MetricKind::Date: {
+            const auto time = static_cast<time_t>(value);
+            tm local{};
+            localtime_r(&time, &local);
+            return fmt::format("{:%Y-%m-%d %H:%M:%S}", local);
+        }
+        case MetricKind::Number:
+            break;
+    }
+
+    return fmt::format("{:.{}f}", value, decimals);
+}
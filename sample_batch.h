@@ -0,0 +1,170 @@
+#ifndef SMA_BLUETOOTH_SAMPLE_BATCH_H
+#define SMA_BLUETOOTH_SAMPLE_BATCH_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using StringId = std::uint32_t;
+using SourceId = std::uint16_t;
+using MetricId = std::uint16_t;
+
+// an inverter samples are read from
+struct SampleSource {
+    StringId inverter;
+    unsigned long long serial;
+};
+
+enum class MetricKind {
+    Number,
+    Text,  // values are ids of the string table
+    Date,  // values are unix timestamps
+};
+
+// a live value as described in the unit conversions of the .in file
+struct SampleMetric {
+    StringId description;
+    StringId units;
+    int decimals;
+    bool persistent;  // only stored when the value changed
+    MetricKind kind;
+};
+
+/*
+ * Strings, inverters and metrics referenced by the ids in sample batches.
+ * One catalog is shared by all batches of a run. Lookups are thread safe
+ * so storage threads can resolve ids while the decoder adds new ones.
+ */
+class SampleCatalog
+{
+public:
+    StringId Intern(std::string_view text);
+    [[nodiscard]] const std::string &GetString(StringId id) const;
+
+    SourceId AddSource(const char *inverter, unsigned long long serial);
+    [[nodiscard]] SampleSource GetSource(SourceId id) const;
+    [[nodiscard]] std::optional<SourceId> FindSource(const char *inverter, unsigned long long serial) const;
+
+    MetricId AddMetric(const char *description, const char *units, int decimals, bool persistent, MetricKind kind);
+    [[nodiscard]] SampleMetric GetMetric(MetricId id) const;
+    // the first metric with this description, whatever its units
+    [[nodiscard]] std::optional<MetricId> FindMetric(std::string_view description) const;
+
+private:
+    StringId InternLocked(std::string_view text);
+
+    mutable std::mutex m_mutex;
+    std::deque<std::string> m_strings;  // deque keeps references valid while growing
+    std::unordered_map<std::string_view, StringId> m_string_ids;
+    std::vector<SampleSource> m_sources;
+    std::vector<SampleMetric> m_metrics;
+};
+
+/*
+ * Live values in columns, one entry per sample in each vector. An entry
+ * can also summarise a window of samples, then values holds the last one
+ * and times its time. means, minimums and maximums are NaN for single
+ * samples.
+ */
+struct LiveBatch {
+    std::vector<std::uint32_t> times;  // inverters report 32 bit timestamps
+    std::vector<SourceId> sources;
+    std::vector<MetricId> metrics;
+    std::vector<double> values;
+    std::vector<double> means;
+    std::vector<double> minimums;
+    std::vector<double> maximums;
+
+    void Add(time_t time, SourceId source, MetricId metric, double value);
+    void AddWindow(time_t time, SourceId source, MetricId metric, double last, double mean, double minimum, double maximum);
+    [[nodiscard]] time_t Time(std::size_t i) const { return static_cast<time_t>(times[i]); }
+    [[nodiscard]] bool Windowed(std::size_t i) const { return !std::isnan(means[i]); }
+    [[nodiscard]] std::size_t size() const { return times.size(); }
+    [[nodiscard]] bool empty() const { return times.empty(); }
+    void clear();
+};
+
+/*
+ * Archive records in columns. current is the average power in Watts for
+ * day archive records and the energy of that day in kWh for month archive
+ * records.
+ */
+struct ArchiveBatch {
+    std::vector<std::uint32_t> times;
+    std::vector<SourceId> sources;
+    std::vector<double> energy;  // energy counter in kWh
+    std::vector<float> current;
+
+    void Add(time_t time, SourceId source, double energy_kwh, float current_value);
+    void Append(const ArchiveBatch &other);
+    [[nodiscard]] time_t Time(std::size_t i) const { return static_cast<time_t>(times[i]); }
+    [[nodiscard]] std::size_t size() const { return times.size(); }
+    [[nodiscard]] bool empty() const { return times.empty(); }
+    void clear();
+};
+
+// one unit of work for the storage thread
+struct StorageBatch {
+    enum class Kind {
+        None,
+        DayArchive,
+        MonthArchive,
+        Live,
+    };
+
+    Kind kind{Kind::None};
+    ArchiveBatch archive;
+    LiveBatch live;
+};
+
+// counter range and peak power of one inverter on one local day of an archive batch,
+// records with a zero counter are left out
+struct DaySummary {
+    SourceId source;
+    time_t time;  // any record of the day
+    double start;
+    double end;
+    float peak;
+    time_t peak_time;  // first record with the peak power
+};
+
+std::vector<DaySummary> SummariseDays(const ArchiveBatch &batch);
+
+// local month of an inverter the days of a summary fall in
+struct MonthSpan {
+    SourceId source;
+    std::string first;  // YYYY-MM-01
+    std::string last;   // last day of the month, YYYY-MM-DD
+};
+
+std::vector<MonthSpan> SummariseMonths(const std::vector<DaySummary> &days);
+
+// newest record of every inverter in a batch, what its SyncState moves to
+std::unordered_map<SourceId, time_t> LatestTimes(const ArchiveBatch &batch);
+std::unordered_map<SourceId, time_t> LatestTimes(const LiveBatch &batch);
+
+// one row of the MonthEnergy rollup
+struct MonthTotal {
+    std::string month;  // YYYY-MM
+    std::string inverter;
+    unsigned long long serial;
+    double energy;  // kWh
+    int days;       // with DayData
+    int peak_power;
+    std::string peak_time;  // YYYY-MM-DD HH:MM:SS, empty if not known
+};
+
+// value of a live sample as shown in LiveData
+std::string FormatLiveValue(const SampleCatalog &catalog, const SampleMetric &metric, double value);
+// same for number and date metrics without a catalog
+std::string FormatLiveValue(MetricKind kind, int decimals, double value);
+
+#endif  //SMA_BLUETOOTH_SAMPLE_BATCH_H
@@ -18,6 +18,10 @@
 #include <ctime>
 #include <string>
 
+#include "archive_decoder.h"
+#include "storage_writer.h"
+#include "sample_batch.h"
+#include "series_store.h"
 #include "sma_mysql.h"
 #include "sma_struct.h"
 #include "smatool.h"
@@ -30,29 +34,18 @@ std::string debugdate()
 }
 
 /*
- * Update internal running list with live data for later processing
+ * Update internal running batch with live data for later processing
  */
-int UpdateLiveList(FlagType *flag, UnitType *unit, const char *format, time_t idate, const char *description, float fvalue, int ivalue, const char *svalue, const char *units, int persistent, LiveDataList &livedatalist)
+int UpdateLiveList(SessionData &session_data, time_t idate, const ReturnType &key, MetricKind kind, double value)
 {
+    UnitType *unit = session_data.unit[0];
     if (strlen(unit->Inverter) > 0) {
-        auto &element = livedatalist.emplace_back();
-        element.date = idate;
-        strcpy(element.inverter, unit->Inverter);
-
         unsigned long long inverter_serial = (unit->Serial[0] << 24) + (unit->Serial[1] << 16) + (unit->Serial[2] << 8) + unit->Serial[3];
-        element.serial = inverter_serial;
-        strcpy(element.Description, description);
-        strcpy(element.Units, units);
-        if (fvalue >= 0)
-            sprintf(element.Value, format, fvalue);
-        else if (ivalue > 0)
-            sprintf(element.Value, format, ivalue);
-        else if (strlen(svalue) > 0) {
-            sprintf(element.Value, format, svalue);
-        }
-        element.Persistent = persistent;
+        const auto source = session_data.catalog.AddSource(unit->Inverter, inverter_serial);
+        const auto metric = session_data.catalog.AddMetric(key.description, key.units, key.decimal, key.persistent == 1, kind);
+        session_data.liveBatch.Add(idate, source, metric, value);
     } else {
-        if (flag->debug == 1)
+        if (session_data.flags.debug == 1)
             printf("Don't have inverter details yet\n");
     }
     return 0;
@@ -73,7 +66,6 @@ int ProcessCommand(SessionData &session_data, int *linenum)
     tm tm{};
     unsigned char fl[1024] = {0};
     unsigned char received[1024];
-    unsigned char datarecord[1024];
     unsigned char dest_address[6] = {0};
     unsigned char timestr[25] = {0};
     ReadRecordType readRecord;
@@ -86,12 +78,10 @@ int ProcessCommand(SessionData &session_data, int *linenum)
     float currentpower_total = 0.0;
     float dtotal = 0.0;
     float gtotal = 0.0;
-    float ptotal = 0.0;
     float strength = 0.0;
     int already_read = 0, terminated = 0;
     int gap = 0, return_key = 0, datalength = 0;
     int pass_i = 0, send_count = 0;
-    int persistent = 0;
     int index = 0;
     unsigned long long inverter_serial = 0;
 
@@ -712,47 +702,45 @@ int ProcessCommand(SessionData &session_data, int *linenum)
                         case 18:  // $ARCHIVEDATA1
                         {
                             finished = 0;
-                            ptotal = 0;
-                            time_t timestamp = 0;
-                            time_t timestamp_prev = 0;
+                            bool first_record = true;
+                            ArchiveRecord previous{};
                             printf("\n");
                             while (finished != 1) {
                                 if ((data = ReadStream(&session_data.conf, &session_data.flags, &readRecord, session_data.btConnection.get_socket(), received, &rr, data, &datalen, last_sent, &terminated, &togo)) != nullptr) {
-                                    std::size_t j = 0;
-                                    for (int i = 0; i < datalen; i++) {
-                                        datarecord[j] = data[i];
-                                        j++;
-                                        if (j > 11) {
-                                            if (timestamp > 0)
-                                                timestamp_prev = timestamp;
-                                            else
-                                                timestamp_prev = 0;
-                                            timestamp = ConvertStreamTo<time_t>(datarecord, 4);
-                                            if (timestamp_prev == 0)
-                                                timestamp_prev = timestamp - 300;
-
-                                            gtotal = ConvertStreamTo<float>(datarecord + 4, 8);
-                                            if (session_data.archDataList.empty())
-                                                ptotal = gtotal;
-
-                                            fmt::print("\n{:%Y-%m-%d %H:%M:%S}  total={:.3f} Kwh current={:.0f} Watts togo={} i={}\n", *std::localtime(&timestamp), gtotal / 1000, (gtotal - ptotal) * 12, togo, i);
-                                            if (timestamp != timestamp_prev + 300) {
-                                                printf("Date Error! prev=%d current=%d\n", (int)timestamp_prev, (int)timestamp);
-                                                error = 1;
-                                                // break;
+                                    ArchiveBatch batch;
+                                    for (auto &record : DecodeArchiveRecords(data, datalen)) {
+                                        // the stored record before a gap gives the power of the first missing one,
+                                        // anything older is already stored and would get power 0 here
+                                        if (session_data.archiveSeed != 0 && record.date <= session_data.archiveSeed) {
+                                            if (record.date == session_data.archiveSeed) {
+                                                previous = record;
+                                                first_record = false;
                                             }
-
-                                            auto &element = session_data.archDataList.emplace_back();
-                                            element.date = timestamp;
-                                            strcpy(element.inverter, session_data.unit[0]->Inverter);
-                                            inverter_serial = (session_data.unit[0]->Serial[0] << 24) + (session_data.unit[0]->Serial[1] << 16) + (session_data.unit[0]->Serial[2] << 8) + session_data.unit[0]->Serial[3];
-                                            element.serial = inverter_serial;
-                                            element.accum_value = gtotal / 1000;
-                                            element.current_value = (gtotal - ptotal) * 12;
-                                            ptotal = gtotal;
-                                            j = 0;  //get ready for another record
+                                            continue;
+                                        }
+                                        if (first_record)
+                                            previous = {record.date - ARCHIVE_INTERVAL, record.total_wh, 0};
+                                        first_record = false;
+                                        record.power = ArchivePower(previous, record);
+
+                                        fmt::print("\n{:%Y-%m-%d %H:%M:%S}  total={:.3f} Kwh current={:.0f} Watts togo={}\n", *std::localtime(&record.date), record.total_wh / 1000.0, record.power, togo);
+                                        if (record.date != previous.date + ARCHIVE_INTERVAL) {
+                                            printf("Date Error! prev=%d current=%d\n", (int)previous.date, (int)record.date);
+                                            AddArchiveGap(session_data.archiveGaps, previous.date, record.date);
                                         }
+
+                                        inverter_serial = (session_data.unit[0]->Serial[0] << 24) + (session_data.unit[0]->Serial[1] << 16) + (session_data.unit[0]->Serial[2] << 8) + session_data.unit[0]->Serial[3];
+                                        batch.Add(record.date, session_data.catalog.AddSource(session_data.unit[0]->Inverter, inverter_serial), record.total_wh / 1000.0, record.power);
+                                        previous = record;
                                     }
+                                    if (session_data.seriesStore)
+                                        session_data.seriesStore->Append(batch, session_data.catalog);
+                                    if (session_data.storageWriter)
+                                        session_data.storageWriter->PushDayArchive(std::move(batch));
+                                    else
+                                        session_data.archiveBatch.Append(batch);
+                                    free(data);
+                                    data = nullptr;
                                     if (togo == 0)
                                         finished = 1;
                                     else if (read_bluetooth(&session_data.conf, &session_data.flags, &readRecord, session_data.btConnection.get_socket(), &rr, received, last_sent, &terminated) != 0) {
@@ -766,7 +754,6 @@ int ProcessCommand(SessionData &session_data, int *linenum)
                                     //An Error has occurred
                                     break;
                             }
-                            free(data);
                             printf("\n");
 
                             break;
@@ -850,53 +837,32 @@ int ProcessCommand(SessionData &session_data, int *linenum)
                                         switch (session_data.conf.returnkeylist[return_key].decimal) {
                                             case 0:
                                                 currentpower_total = ConvertStreamTo<float>(data + i + 8, datalength);
-                                                if (currentpower_total == 0)
-                                                    persistent = 1;
-                                                else
-                                                    persistent = session_data.conf.returnkeylist[return_key].persistent;
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>20s} = {:.0f} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%.0f", timestamp, session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, -1, (char *)nullptr, session_data.conf.returnkeylist[return_key].units, persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Number, currentpower_total / session_data.conf.returnkeylist[return_key].divisor);
                                                 break;
                                             case 1:
                                                 currentpower_total = ConvertStreamTo<float>(data + i + 8, datalength);
-                                                if (currentpower_total == 0)
-                                                    persistent = 1;
-                                                else
-                                                    persistent = session_data.conf.returnkeylist[return_key].persistent;
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>30s} = {:.1f} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%.1f", timestamp, session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, -1, (char *)nullptr, session_data.conf.returnkeylist[return_key].units, persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Number, currentpower_total / session_data.conf.returnkeylist[return_key].divisor);
                                                 break;
                                             case 2:
                                                 currentpower_total = ConvertStreamTo<float>(data + i + 8, datalength);
-                                                if (currentpower_total == 0)
-                                                    persistent = 1;
-                                                else
-                                                    persistent = session_data.conf.returnkeylist[return_key].persistent;
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>30s} = {:.2f} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%.2f", timestamp, session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, -1, (char *)nullptr, session_data.conf.returnkeylist[return_key].units, persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Number, currentpower_total / session_data.conf.returnkeylist[return_key].divisor);
                                                 break;
                                             case 3:
                                                 currentpower_total = ConvertStreamTo<float>(data + i + 8, datalength);
-                                                if (currentpower_total == 0)
-                                                    persistent = 1;
-                                                else
-                                                    persistent = session_data.conf.returnkeylist[return_key].persistent;
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>30s} = {:.3f} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%.3f", timestamp, session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, -1, (char *)nullptr, session_data.conf.returnkeylist[return_key].units, persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Number, currentpower_total / session_data.conf.returnkeylist[return_key].divisor);
                                                 break;
                                             case 4:
                                                 currentpower_total = ConvertStreamTo<float>(data + i + 8, datalength);
-                                                if (currentpower_total == 0)
-                                                    persistent = 1;
-                                                else
-                                                    persistent = session_data.conf.returnkeylist[return_key].persistent;
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>30s} = {:.4f} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%.4f", timestamp, session_data.conf.returnkeylist[return_key].description, currentpower_total / session_data.conf.returnkeylist[return_key].divisor, -1, (char *)nullptr, session_data.conf.returnkeylist[return_key].units, persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Number, currentpower_total / session_data.conf.returnkeylist[return_key].divisor);
                                                 break;
                                             case 97: {
                                                 fmt::print("                    {:>30s} = {:%Y-%m-%d %H:%M:%S}\n", session_data.conf.returnkeylist[return_key].description, *std::localtime(&timestamp));
-                                                auto vbuf = fmt::format("{:%Y-%m-%d %H:%M:%S}", *std::localtime(&timestamp));
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%s", timestamp, session_data.conf.returnkeylist[return_key].description, -1.0, -1, vbuf.c_str(), session_data.conf.returnkeylist[return_key].units, session_data.conf.returnkeylist[return_key].persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Date, timestamp);
 
                                                 break;
                                             }
@@ -905,7 +871,7 @@ int ProcessCommand(SessionData &session_data, int *linenum)
                                                 index = ConvertStreamTo<int>(data + i + 8, 2);
                                                 datastring = return_xml_data(index);
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>30s} = {:s} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, datastring, session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%s", timestamp, session_data.conf.returnkeylist[return_key].description, -1.0, -1, datastring, session_data.conf.returnkeylist[return_key].units, session_data.conf.returnkeylist[return_key].persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Text, session_data.catalog.Intern(datastring));
                                                 if ((data + i + 1)[0] == 0x20 && (data + i + 2)[0] == 0x82) {
                                                     strcpy(session_data.unit[0]->Inverter, datastring);
                                                 }
@@ -915,7 +881,7 @@ int ProcessCommand(SessionData &session_data, int *linenum)
                                             case 99: {
                                                 auto data_string = ConvertStreamTo<std::string>(data + i + 8, datalength);
                                                 fmt::print("{:%Y-%m-%d %H:%M:%S} {:>30s} = {:s} {:>20s}\n", *std::localtime(&timestamp), session_data.conf.returnkeylist[return_key].description, data_string.c_str(), session_data.conf.returnkeylist[return_key].units);
-                                                UpdateLiveList(&session_data.flags, session_data.unit[0], "%s", timestamp, session_data.conf.returnkeylist[return_key].description, -1.0, -1, data_string.c_str(), session_data.conf.returnkeylist[return_key].units, session_data.conf.returnkeylist[return_key].persistent, session_data.liveDataList);
+                                                UpdateLiveList(session_data, timestamp, session_data.conf.returnkeylist[return_key], MetricKind::Text, session_data.catalog.Intern(data_string));
                                                 break;
                                             }
                                         }
@@ -932,6 +898,55 @@ int ProcessCommand(SessionData &session_data, int *linenum)
                                 //An Error has occurred
                                 break;
                             }
+                        case 32:  // $ARCHIVEDATA2 daily totals of the month archive
+                        {
+                            finished = 0;
+                            // $TIMEFROM2 starts a day early, the records before datefrom only give the counter
+                            // the first requested day starts from. Without one the history starts at 0
+                            ArchiveRecord previous{};
+                            time_t requested_from = 0;
+                            if (strptime(session_data.conf.datefrom, "%Y-%m-%d %H:%M:%S", &tm) != nullptr) {
+                                tm.tm_isdst = -1;
+                                requested_from = mktime(&tm);
+                            }
+                            printf("\n");
+                            while (finished != 1) {
+                                if ((data = ReadStream(&session_data.conf, &session_data.flags, &readRecord, session_data.btConnection.get_socket(), received, &rr, data, &datalen, last_sent, &terminated, &togo)) != nullptr) {
+                                    for (const auto &record : DecodeArchiveRecords(data, datalen)) {
+                                        if (record.total_wh == 0)  // no value recorded for this day
+                                            continue;
+
+                                        if (record.date < requested_from) {
+                                            previous = record;
+                                            continue;
+                                        }
+
+                                        const auto day_energy = (static_cast<double>(record.total_wh) - static_cast<double>(previous.total_wh)) / 1000;
+                                        fmt::print("{:%Y-%m-%d}  total={:.3f} Kwh day={:.3f} Kwh\n", *std::localtime(&record.date), record.total_wh / 1000.0, day_energy);
+
+                                        inverter_serial = (session_data.unit[0]->Serial[0] << 24) + (session_data.unit[0]->Serial[1] << 16) + (session_data.unit[0]->Serial[2] << 8) + session_data.unit[0]->Serial[3];
+                                        session_data.monthBatch.Add(record.date, session_data.catalog.AddSource(session_data.unit[0]->Inverter, inverter_serial), record.total_wh / 1000.0, day_energy);
+                                        previous = record;
+                                    }
+                                    free(data);
+                                    data = nullptr;
+                                    if (togo == 0)
+                                        finished = 1;
+                                    else if (read_bluetooth(&session_data.conf, &session_data.flags, &readRecord, session_data.btConnection.get_socket(), &rr, received, last_sent, &terminated) != 0) {
+                                        strcpy(lineread, "");
+                                        sleep(10);
+                                        failedbluetooth++;
+                                        if (failedbluetooth > 3)
+                                            exit(-1);
+                                    }
+                                } else
+                                    //An Error has occurred
+                                    break;
+                            }
+                            printf("\n");
+
+                            break;
+                        }
                         case 31:  // LOGIN Data
                             auto date = ConvertStreamTo<time_t>(received + 59, 4);
                             if (session_data.flags.debug == 1) fmt::print("Date power = {:%Y-%m-%d %H:%M:%S}\n", *std::localtime(&date));
@@ -981,6 +996,67 @@ void InverterCommand(const char *command, SessionData &session_data)
     }
 }
 
+/*
+ * Get the daily totals of the month archive starting with the day 'from'
+ * up to the end of the current date range
+ */
+void InverterMonthArchive(const char *from, SessionData &session_data)
+{
+    char datefrom[DATELENGTH];
+    strcpy(datefrom, session_data.conf.datefrom);
+    const auto daterange = session_data.flags.daterange;
+
+    snprintf(session_data.conf.datefrom, DATELENGTH, "%s", from);
+    session_data.flags.daterange = 1;
+    InverterCommand("getmonthdata", session_data);
+
+    strcpy(session_data.conf.datefrom, datefrom);
+    session_data.flags.daterange = daterange;
+}
+
+/*
+ * Request only the missing slots found while extracting archive data
+ * instead of downloading the whole date range again
+ */
+void RefetchArchiveGaps(SessionData &session_data)
+{
+    auto gaps = MergeArchiveGaps(std::move(session_data.archiveGaps));
+    session_data.archiveGaps.clear();
+    if (gaps.empty())
+        return;
+
+    if (gaps.size() > MAX_GAP_REFETCH) {
+        printf("%zu archive gaps found, only refetching the first %zu\n", gaps.size(), MAX_GAP_REFETCH);
+        gaps.resize(MAX_GAP_REFETCH);
+    }
+
+    char datefrom[DATELENGTH];
+    char dateto[DATELENGTH];
+    strcpy(datefrom, session_data.conf.datefrom);
+    strcpy(dateto, session_data.conf.dateto);
+    const auto daterange = session_data.flags.daterange;
+
+    for (const auto &gap : gaps) {
+        // $TIMEFROM1 asks for one record before datefrom, the stored one before the gap that
+        // only gives the power of the first missing slot
+        session_data.archiveSeed = gap.from - ARCHIVE_INTERVAL;
+        snprintf(session_data.conf.datefrom, DATELENGTH, "%s", FormatArchiveTime(gap.from).c_str());
+        snprintf(session_data.conf.dateto, DATELENGTH, "%s", FormatArchiveTime(gap.to).c_str());
+        session_data.flags.daterange = 1;
+        printf("Refetching missing archive data from %s to %s\n", session_data.conf.datefrom, session_data.conf.dateto);
+        InverterCommand("getrangedata", session_data);
+    }
+
+    session_data.archiveSeed = 0;
+
+    // whatever is still missing was never recorded by the inverter, don't try again
+    session_data.archiveGaps.clear();
+
+    strcpy(session_data.conf.datefrom, datefrom);
+    strcpy(session_data.conf.dateto, dateto);
+    session_data.flags.daterange = daterange;
+}
+
 /*
  * Get Line number of the command required
  * return line number on success 0 on failure
@@ -7,21 +7,36 @@
 
 #include <cstdio>
 
+#include "archive_gaps.h"
 #include "bt_connection.h"
+#include "sample_batch.h"
 #include "sma_struct.h"
 
+class SeriesStore;
+class StorageWriter;
+
 struct SessionData {
-    ArchDataList &archDataList;
-    LiveDataList &liveDataList;
+    ArchiveBatch &archiveBatch;
+    LiveBatch &liveBatch;
+    SampleCatalog &catalog;
     BTConnection &btConnection;
     ConfType &conf;
     FlagType &flags;
     UnitType **unit{nullptr};
     FILE *fp{nullptr};
+    StorageWriter *storageWriter{nullptr};  // if set archive records are streamed to it instead of archiveBatch
+    SeriesStore *seriesStore{nullptr};      // if set archive records are also appended to the local history
+    TimeRangeList archiveGaps{};            // missing slots seen while extracting archive data
+    ArchiveBatch monthBatch{};              // daily totals of the month archive
+    time_t archiveSeed{0};                  // a first archive record at this time is already stored, it only gives the power of the next
 };
 
 int GetLine(const char *command, FILE *fp);
 
 void InverterCommand(const char *command, SessionData &session_data);
 
+void InverterMonthArchive(const char *from, SessionData &session_data);
+
+void RefetchArchiveGaps(SessionData &session_data);
+
 #endif  //SMA_BLUETOOTH_SB_COMMANDS_H
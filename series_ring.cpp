@@ -0,0 +1,306 @@
+#include "series_ring.h"
+
+#include <algorithm>
+#include <cstring>
+
+// time span of one chunk, whole chunks are dropped once they are older than the retention
+static constexpr time_t RING_CHUNK_SECONDS = 2 * 60 * 60;
+
+static std::uint64_t LowBits(int bits)
+{
+    return bits >= 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << bits) - 1;
+}
+
+static std::uint64_t ValueBits(double value)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double BitsValue(std::uint64_t bits)
+{
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static int LeadingZeros(std::uint64_t bits)
+{
+    int count = 0;
+    for (auto mask = std::uint64_t{1} << 63; mask != 0 && (bits & mask) == 0; mask >>= 1)
+        ++count;
+    return count;
+}
+
+static int TrailingZeros(std::uint64_t bits)
+{
+    int count = 0;
+    for (auto mask = std::uint64_t{1}; mask != 0 && (bits & mask) == 0; mask <<= 1)
+        ++count;
+    return count;
+}
+
+void GorillaChunk::WriteBits(std::uint64_t value, int bits)
+{
+    // most significant bit first, a field may straddle two words
+    while (bits > 0) {
+        if (m_bits % 64 == 0)
+            m_words.push_back(0);
+        const int free = 64 - static_cast<int>(m_bits % 64);
+        const int take = std::min(free, bits);
+        m_words.back() |= ((value >> (bits - take)) & LowBits(take)) << (free - take);
+        m_bits += take;
+        bits -= take;
+    }
+}
+
+void GorillaChunk::Append(time_t time, double value)
+{
+    const auto bits = ValueBits(value);
+    if (m_count == 0) {
+        m_first = m_min = m_max = time;
+        m_time = time;
+        m_delta = 0;
+        m_value = bits;
+        WriteBits(bits, 64);
+        m_count = 1;
+        return;
+    }
+
+    const std::int64_t delta = time - m_time;
+    const auto dod = delta - m_delta;
+    if (dod == 0) {
+        WriteBits(0b0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        WriteBits(0b10, 2);
+        WriteBits(dod + 63, 7);
+    } else if (dod >= -255 && dod <= 256) {
+        WriteBits(0b110, 3);
+        WriteBits(dod + 255, 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        WriteBits(0b1110, 4);
+        WriteBits(dod + 2047, 12);
+    } else {
+        WriteBits(0b1111, 4);
+        WriteBits(static_cast<std::uint64_t>(dod), 64);
+    }
+    m_time = time;
+    m_delta = delta;
+
+    const auto changed = bits ^ m_value;
+    if (changed == 0) {
+        WriteBits(0b0, 1);
+    } else {
+        // the leading zero count has 5 bits
+        const int leading = std::min(LeadingZeros(changed), 31);
+        const int trailing = TrailingZeros(changed);
+        if (m_leading >= 0 && leading >= m_leading && trailing >= m_trailing) {
+            WriteBits(0b10, 2);
+            WriteBits(changed >> m_trailing, 64 - m_leading - m_trailing);
+        } else {
+            const int meaningful = 64 - leading - trailing;
+            WriteBits(0b11, 2);
+            WriteBits(leading, 5);
+            WriteBits(meaningful - 1, 6);
+            WriteBits(changed >> trailing, meaningful);
+            m_leading = leading;
+            m_trailing = trailing;
+        }
+    }
+    m_value = bits;
+
+    m_min = std::min(m_min, time);
+    m_max = std::max(m_max, time);
+    ++m_count;
+}
+
+void GorillaChunk::Seal()
+{
+    m_words.shrink_to_fit();
+}
+
+RingPoint GorillaChunk::last() const
+{
+    return {static_cast<time_t>(m_time), BitsValue(m_value)};
+}
+
+GorillaChunk::const_iterator::const_iterator(const GorillaChunk *chunk, std::uint32_t remaining) : m_chunk(chunk), m_remaining(remaining)
+{
+    if (m_remaining > 0)
+        Decode();
+}
+
+GorillaChunk::const_iterator &GorillaChunk::const_iterator::operator++()
+{
+    if (--m_remaining > 0)
+        Decode();
+    return *this;
+}
+
+GorillaChunk::const_iterator GorillaChunk::const_iterator::operator++(int)
+{
+    auto previous = *this;
+    ++*this;
+    return previous;
+}
+
+std::uint64_t GorillaChunk::const_iterator::ReadBits(int bits)
+{
+    std::uint64_t result = 0;
+    while (bits > 0) {
+        const auto word = m_chunk->m_words[m_position / 64];
+        const int available = 64 - static_cast<int>(m_position % 64);
+        const int take = std::min(available, bits);
+        const auto part = (word >> (available - take)) & LowBits(take);
+        result = take >= 64 ? part : (result << take) | part;
+        m_position += take;
+        bits -= take;
+    }
+    return result;
+}
+
+void GorillaChunk::const_iterator::Decode()
+{
+    if (m_position == 0) {
+        m_value = ReadBits(64);
+        m_point = {m_chunk->m_first, BitsValue(m_value)};
+        return;
+    }
+
+    std::int64_t dod;
+    if (ReadBits(1) == 0)
+        dod = 0;
+    else if (ReadBits(1) == 0)
+        dod = static_cast<std::int64_t>(ReadBits(7)) - 63;
+    else if (ReadBits(1) == 0)
+        dod = static_cast<std::int64_t>(ReadBits(9)) - 255;
+    else if (ReadBits(1) == 0)
+        dod = static_cast<std::int64_t>(ReadBits(12)) - 2047;
+    else
+        dod = static_cast<std::int64_t>(ReadBits(64));
+    m_delta += dod;
+    m_point.time += m_delta;
+
+    if (ReadBits(1) == 1) {
+        if (ReadBits(1) == 1) {
+            m_leading = static_cast<int>(ReadBits(5));
+            m_trailing = 64 - m_leading - static_cast<int>(ReadBits(6)) - 1;
+        }
+        m_value ^= ReadBits(64 - m_leading - m_trailing) << m_trailing;
+    }
+    m_point.value = BitsValue(m_value);
+}
+
+SeriesRing::View::const_iterator::const_iterator(const View *view, std::deque<GorillaChunk>::const_iterator chunk) : m_view(view), m_chunk(chunk)
+{
+    if (m_chunk != m_view->m_series->chunks.end())
+        m_point = m_chunk->begin();
+    Settle();
+}
+
+SeriesRing::View::const_iterator &SeriesRing::View::const_iterator::operator++()
+{
+    ++m_point;
+    Settle();
+    return *this;
+}
+
+SeriesRing::View::const_iterator SeriesRing::View::const_iterator::operator++(int)
+{
+    auto previous = *this;
+    ++*this;
+    return previous;
+}
+
+void SeriesRing::View::const_iterator::Settle()
+{
+    const auto &chunks = m_view->m_series->chunks;
+    while (m_chunk != chunks.end()) {
+        // chunks outside the range are skipped without decoding them
+        if (m_chunk->max_time() >= m_view->m_from && m_chunk->min_time() <= m_view->m_to) {
+            for (; m_point != m_chunk->end(); ++m_point) {
+                if (m_point->time >= m_view->m_from && m_point->time <= m_view->m_to)
+                    return;
+            }
+        }
+        ++m_chunk;
+        m_point = m_chunk != chunks.end() ? m_chunk->begin() : GorillaChunk::const_iterator{};
+    }
+}
+
+SeriesRing::View::const_iterator SeriesRing::View::begin() const
+{
+    return {this, m_series->chunks.begin()};
+}
+
+SeriesRing::View::const_iterator SeriesRing::View::end() const
+{
+    return {this, m_series->chunks.end()};
+}
+
+void SeriesRing::Add(time_t time, SourceId source, MetricId metric, double value)
+{
+    m_newest = std::max(m_newest, time);
+    auto &series = m_series[Key(source, metric)];
+    if (series.chunks.empty() || time >= series.chunks.back().first() + RING_CHUNK_SECONDS) {
+        if (!series.chunks.empty())
+            series.chunks.back().Seal();
+        series.chunks.emplace_back();
+        Expire(series);
+    }
+    series.chunks.back().Append(time, value);
+}
+
+void SeriesRing::Append(const LiveBatch &batch)
+{
+    for (std::size_t i = 0; i < batch.size(); ++i)
+        Add(batch.Time(i), batch.sources[i], batch.metrics[i], batch.values[i]);
+
+    // series that are no longer reported expire too
+    for (auto &[key, series] : m_series)
+        Expire(series);
+}
+
+void SeriesRing::Expire(Series &series) const
+{
+    // the chunk being appended to stays
+    while (series.chunks.size() > 1 && series.chunks.front().max_time() < m_newest - m_retention)
+        series.chunks.pop_front();
+}
+
+SeriesRing::View SeriesRing::Samples(SourceId source, MetricId metric, time_t from, time_t to) const
+{
+    static const Series no_series;
+    const auto found = m_series.find(Key(source, metric));
+    return {found != m_series.end() ? &found->second : &no_series, from, to};
+}
+
+std::optional<RingPoint> SeriesRing::Latest(SourceId source, MetricId metric) const
+{
+    const auto found = m_series.find(Key(source, metric));
+    if (found == m_series.end() || found->second.chunks.empty() || found->second.chunks.back().size() == 0)
+        return std::nullopt;
+
+    return found->second.chunks.back().last();
+}
+
+std::size_t SeriesRing::samples() const
+{
+    std::size_t count = 0;
+    for (const auto &[key, series] : m_series) {
+        for (const auto &chunk : series.chunks)
+            count += chunk.size();
+    }
+    return count;
+}
+
+std::size_t SeriesRing::bytes() const
+{
+    std::size_t total = 0;
+    for (const auto &[key, series] : m_series) {
+        for (const auto &chunk : series.chunks)
+            total += sizeof(chunk) + chunk.bytes();
+    }
+    return total;
+}
@@ -0,0 +1,172 @@
+#ifndef SMA_BLUETOOTH_SERIES_RING_H
+#define SMA_BLUETOOTH_SERIES_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <iterator>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "sample_batch.h"
+
+// one decompressed sample of a series
+struct RingPoint {
+    time_t time;
+    double value;
+};
+
+/*
+ * Samples of one series compressed as in Facebook's Gorilla: timestamps
+ * as delta of delta, a single bit for the usual fixed poll interval, and
+ * values XORed with the previous one, a single bit when unchanged and
+ * only the meaningful bits otherwise. Samples are appended in any order,
+ * iteration returns them in append order.
+ */
+class GorillaChunk
+{
+public:
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = RingPoint;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const RingPoint *;
+        using reference = const RingPoint &;
+
+        const_iterator() = default;
+        const_iterator(const GorillaChunk *chunk, std::uint32_t remaining);
+
+        reference operator*() const { return m_point; }
+        pointer operator->() const { return &m_point; }
+        const_iterator &operator++();
+        const_iterator operator++(int);
+        bool operator==(const const_iterator &other) const { return m_remaining == other.m_remaining; }
+        bool operator!=(const const_iterator &other) const { return m_remaining != other.m_remaining; }
+
+    private:
+        std::uint64_t ReadBits(int bits);
+        void Decode();
+
+        const GorillaChunk *m_chunk{nullptr};
+        std::uint32_t m_remaining{0};
+        std::size_t m_position{0};
+        std::int64_t m_delta{0};
+        std::uint64_t m_value{0};
+        int m_leading{0};
+        int m_trailing{0};
+        RingPoint m_point{};
+    };
+
+    void Append(time_t time, double value);
+    // release the spare capacity once nothing is appended any more
+    void Seal();
+
+    [[nodiscard]] const_iterator begin() const { return {this, m_count}; }
+    [[nodiscard]] const_iterator end() const { return {}; }
+    [[nodiscard]] std::uint32_t size() const { return m_count; }
+    [[nodiscard]] time_t first() const { return m_first; }
+    [[nodiscard]] time_t min_time() const { return m_min; }
+    [[nodiscard]] time_t max_time() const { return m_max; }
+    [[nodiscard]] RingPoint last() const;
+    [[nodiscard]] std::size_t bytes() const { return m_words.capacity() * sizeof(std::uint64_t); }
+
+private:
+    void WriteBits(std::uint64_t value, int bits);
+
+    std::vector<std::uint64_t> m_words;
+    std::size_t m_bits{0};
+    std::uint32_t m_count{0};
+    time_t m_first{0};
+    time_t m_min{0};
+    time_t m_max{0};
+    // encoder state, the last sample appended
+    std::int64_t m_time{0};
+    std::int64_t m_delta{0};
+    std::uint64_t m_value{0};
+    int m_leading{-1};
+    int m_trailing{0};
+};
+
+/*
+ * The recent live values of every inverter and metric in memory, for
+ * derived values and charts without a database round trip. Each series
+ * is a list of GorillaChunk, one per RING_CHUNK_SECONDS, and chunks older
+ * than the retention, counted back from the newest sample, are dropped
+ * as a whole. Not thread safe, the ring belongs to the decoding thread.
+ */
+class SeriesRing
+{
+    struct Series {
+        std::deque<GorillaChunk> chunks;
+    };
+
+public:
+    // samples of one series from from to to inclusive, decompressed while iterating
+    class View
+    {
+    public:
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = RingPoint;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const RingPoint *;
+            using reference = const RingPoint &;
+
+            const_iterator() = default;
+            const_iterator(const View *view, std::deque<GorillaChunk>::const_iterator chunk);
+
+            reference operator*() const { return *m_point; }
+            pointer operator->() const { return &*m_point; }
+            const_iterator &operator++();
+            const_iterator operator++(int);
+            bool operator==(const const_iterator &other) const { return m_chunk == other.m_chunk && m_point == other.m_point; }
+            bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+        private:
+            // move to the next sample in range, starting at the current one
+            void Settle();
+
+            const View *m_view{nullptr};
+            std::deque<GorillaChunk>::const_iterator m_chunk{};
+            GorillaChunk::const_iterator m_point{};
+        };
+
+        View(const Series *series, time_t from, time_t to) : m_series(series), m_from(from), m_to(to) {}
+
+        [[nodiscard]] const_iterator begin() const;
+        [[nodiscard]] const_iterator end() const;
+
+    private:
+        const Series *m_series;
+        time_t m_from;
+        time_t m_to;
+    };
+
+    explicit SeriesRing(time_t retention) : m_retention(retention) {}
+
+    void Add(time_t time, SourceId source, MetricId metric, double value);
+    void Append(const LiveBatch &batch);
+
+    [[nodiscard]] View Samples(SourceId source, MetricId metric, time_t from, time_t to) const;
+    // the sample appended last
+    [[nodiscard]] std::optional<RingPoint> Latest(SourceId source, MetricId metric) const;
+
+    [[nodiscard]] std::size_t samples() const;
+    [[nodiscard]] std::size_t bytes() const;
+
+private:
+    static std::uint32_t Key(SourceId source, MetricId metric) { return (static_cast<std::uint32_t>(source) << 16) | metric; }
+    void Expire(Series &series) const;
+
+    time_t m_retention;
+    time_t m_newest{0};
+    std::unordered_map<std::uint32_t, Series> m_series;
+};
+
+#endif  //SMA_BLUETOOTH_SERIES_RING_H
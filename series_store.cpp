@@ -0,0 +1,278 @@
+#include "series_store.h"
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+// records per sparse index entry, 12 KiB of a segment
+static constexpr std::size_t SERIES_BLOCK = 512;
+
+// time range of one block of a segment, the records in it need not be sorted
+struct SeriesBlock {
+    std::int64_t first;
+    std::int64_t last;
+};
+
+// read only mapping of a whole file, empty if it does not exist
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                m_data = data;
+                m_size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile()
+    {
+        if (m_data)
+            munmap(m_data, m_size);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    template <typename T>
+    [[nodiscard]] const T *data() const { return static_cast<const T *>(m_data); }
+    // whole records only, a torn one at the end is ignored
+    template <typename T>
+    [[nodiscard]] std::size_t count() const { return m_size / sizeof(T); }
+
+private:
+    void *m_data{nullptr};
+    std::size_t m_size{0};
+};
+
+static std::string SegmentDay(time_t time)
+{
+    tm tm{};
+    localtime_r(&time, &tm);
+    return fmt::format("{:04d}{:02d}{:02d}", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+static bool WriteAll(int fd, const void *data, std::size_t size, off_t offset)
+{
+    const auto *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        const auto written = pwrite(fd, bytes, size, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+SeriesStore::SeriesStore(std::string directory) : m_directory(std::move(directory))
+{
+    if (mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST)
+        throw std::runtime_error(fmt::format("{}: {}", m_directory, strerror(errno)));
+
+    std::ifstream file(m_directory + "/metrics");
+    std::string name;
+    while (std::getline(file, name)) {
+        m_metric_ids.emplace(name, static_cast<std::uint32_t>(m_metric_names.size()));
+        m_metric_names.push_back(name);
+    }
+}
+
+std::optional<std::uint32_t> SeriesStore::FindMetric(std::string_view name) const
+{
+    const auto found = m_metric_ids.find(std::string(name));
+    if (found == m_metric_ids.end())
+        return std::nullopt;
+
+    return found->second;
+}
+
+std::uint32_t SeriesStore::MetricId(const std::string &name)
+{
+    if (const auto found = m_metric_ids.find(name); found != m_metric_ids.end())
+        return found->second;
+
+    std::ofstream file(m_directory + "/metrics", std::ios::app);
+    if (!(file << name << '\n'))
+        fmt::print(stderr, "Error! Could not write {}/metrics\n", m_directory);
+
+    const auto id = static_cast<std::uint32_t>(m_metric_names.size());
+    m_metric_ids.emplace(name, id);
+    m_metric_names.push_back(name);
+    return id;
+}
+
+void SeriesStore::Append(const ArchiveBatch &batch, const SampleCatalog &catalog)
+{
+    const auto energy = MetricId("ETotalToday");
+    const auto power = MetricId("CurrentPower");
+
+    std::vector<SeriesRecord> records;
+    records.reserve(batch.size() * 2);
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto serial = static_cast<std::uint32_t>(catalog.GetSource(batch.sources[i]).serial);
+        records.push_back({batch.Time(i), energy, serial, batch.energy[i]});
+        records.push_back({batch.Time(i), power, serial, batch.current[i]});
+    }
+
+    Write(records);
+}
+
+void SeriesStore::Append(const LiveBatch &batch, const SampleCatalog &catalog)
+{
+    std::vector<SeriesRecord> records;
+    records.reserve(batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto metric = catalog.GetMetric(batch.metrics[i]);
+        // text values are ids of this run's string table, meaningless later
+        if (metric.kind == MetricKind::Text)
+            continue;
+
+        const auto serial = static_cast<std::uint32_t>(catalog.GetSource(batch.sources[i]).serial);
+        records.push_back({batch.Time(i), MetricId(catalog.GetString(metric.description)), serial, batch.values[i]});
+    }
+
+    Write(records);
+}
+
+void SeriesStore::Write(std::vector<SeriesRecord> &records)
+{
+    std::stable_sort(records.begin(), records.end(), [](const SeriesRecord &a, const SeriesRecord &b) { return a.time < b.time; });
+
+    // one write per day the batch touches
+    std::size_t first = 0;
+    while (first < records.size()) {
+        const auto day = SegmentDay(records[first].time);
+        auto last = first + 1;
+        while (last < records.size() && SegmentDay(records[last].time) == day)
+            ++last;
+
+        if (!WriteSegment(day, &records[first], last - first))
+            fmt::print(stderr, "Error! Could not write {}/{}.ts: {}\n", m_directory, day, strerror(errno));
+        first = last;
+    }
+}
+
+bool SeriesStore::WriteSegment(const std::string &day, const SeriesRecord *records, std::size_t count)
+{
+    const auto path = fmt::format("{}/{}", m_directory, day);
+    const int fd = open((path + ".ts").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    // cut off a record torn by a crash
+    const std::size_t stored = st.st_size / sizeof(SeriesRecord);
+    if (stored * sizeof(SeriesRecord) != static_cast<std::size_t>(st.st_size) && ftruncate(fd, stored * sizeof(SeriesRecord)) != 0) {
+        close(fd);
+        return false;
+    }
+    if (!WriteAll(fd, records, count * sizeof(SeriesRecord), stored * sizeof(SeriesRecord))) {
+        close(fd);
+        return false;
+    }
+
+    // index every block completed since the last write, also those lost in a crash
+    const int index_fd = open((path + ".idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd < 0) {
+        close(fd);
+        return false;
+    }
+    struct stat index_st {};
+    auto ok = fstat(index_fd, &index_st) == 0;
+    const std::size_t blocks = (stored + count) / SERIES_BLOCK;
+    std::vector<SeriesRecord> block(SERIES_BLOCK);
+    for (auto b = ok ? static_cast<std::size_t>(index_st.st_size) / sizeof(SeriesBlock) : blocks; ok && b < blocks; ++b) {
+        ok = pread(fd, block.data(), SERIES_BLOCK * sizeof(SeriesRecord), b * SERIES_BLOCK * sizeof(SeriesRecord)) == static_cast<ssize_t>(SERIES_BLOCK * sizeof(SeriesRecord));
+        if (!ok)
+            break;
+
+        const auto [first, last] = std::minmax_element(block.begin(), block.end(), [](const SeriesRecord &a, const SeriesRecord &b) { return a.time < b.time; });
+        const SeriesBlock range{first->time, last->time};
+        ok = WriteAll(index_fd, &range, sizeof(range), b * sizeof(SeriesBlock));
+    }
+
+    close(index_fd);
+    close(fd);
+    return ok;
+}
+
+std::size_t SeriesStore::Query(time_t from, time_t to, std::uint32_t metric, const std::function<void(const SeriesRecord &)> &visit) const
+{
+    std::size_t found = 0;
+    std::vector<SeriesRecord> matches;
+
+    tm day{};
+    localtime_r(&from, &day);
+    day.tm_hour = 0;
+    day.tm_min = 0;
+    day.tm_sec = 0;
+    day.tm_isdst = -1;
+    for (auto start = mktime(&day); start <= to; start = mktime(&day)) {
+        const auto path = fmt::format("{}/{}", m_directory, SegmentDay(start));
+        const MappedFile segment(path + ".ts");
+        const MappedFile index(path + ".idx");
+        const auto *records = segment.data<SeriesRecord>();
+        const auto count = segment.count<SeriesRecord>();
+        const auto *blocks = index.data<SeriesBlock>();
+        const auto indexed = std::min(index.count<SeriesBlock>(), count / SERIES_BLOCK);
+
+        matches.clear();
+        for (std::size_t first = 0; first < count; first += SERIES_BLOCK) {
+            const auto b = first / SERIES_BLOCK;
+            if (b < indexed && (blocks[b].last < from || blocks[b].first > to))
+                continue;
+
+            const auto last = std::min(count, first + SERIES_BLOCK);
+            for (auto i = first; i < last; ++i) {
+                if (records[i].metric == metric && records[i].time >= from && records[i].time <= to)
+                    matches.push_back(records[i]);
+            }
+        }
+
+        // refetched archive gaps land behind newer records and overlapping runs store a sample
+        // again, sort by time and keep the newest copy
+        std::stable_sort(matches.begin(), matches.end(), [](const SeriesRecord &a, const SeriesRecord &b) { return a.time < b.time || (a.time == b.time && a.serial < b.serial); });
+        std::size_t kept = 0;
+        for (const auto &record : matches) {
+            if (kept > 0 && matches[kept - 1].time == record.time && matches[kept - 1].serial == record.serial)
+                matches[kept - 1] = record;
+            else
+                matches[kept++] = record;
+        }
+        matches.resize(kept);
+
+        for (const auto &record : matches)
+            visit(record);
+        found += matches.size();
+
+        ++day.tm_mday;
+        day.tm_hour = 0;
+        day.tm_isdst = -1;
+    }
+
+    return found;
+}
@@ -0,0 +1,61 @@
+#ifndef SMA_BLUETOOTH_SERIES_STORE_H
+#define SMA_BLUETOOTH_SERIES_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sample_batch.h"
+
+// one sample in a segment file, fixed width in host byte order
+struct SeriesRecord {
+    std::int64_t time;
+    std::uint32_t metric;  // line of the metrics file
+    std::uint32_t serial;  // inverter serial
+    double value;
+};
+static_assert(sizeof(SeriesRecord) == 24, "segment files depend on the record size");
+
+/*
+ * Local history that does not depend on a database. Every sample is
+ * appended to the segment file of its local day, YYYYMMDD.ts, next to a
+ * sparse index YYYYMMDD.idx with the time range of each block of
+ * SERIES_BLOCK records. Segments are memory mapped for queries, which
+ * skip the blocks outside the requested range. Metric names are numbered
+ * in the order they are first seen, one per line of the metrics file.
+ * Day archive records are stored as ETotalToday in kWh and CurrentPower
+ * in W, live values under their description. A torn record left by a
+ * crash is cut off the next time the segment is appended to.
+ */
+class SeriesStore
+{
+public:
+    // creates the directory if needed, throws std::runtime_error if it can not be used
+    explicit SeriesStore(std::string directory);
+
+    void Append(const ArchiveBatch &batch, const SampleCatalog &catalog);
+    void Append(const LiveBatch &batch, const SampleCatalog &catalog);
+
+    [[nodiscard]] std::optional<std::uint32_t> FindMetric(std::string_view name) const;
+    [[nodiscard]] const std::vector<std::string> &metrics() const { return m_metric_names; }
+
+    // records of a metric from from to to inclusive in time order, returns how many
+    std::size_t Query(time_t from, time_t to, std::uint32_t metric, const std::function<void(const SeriesRecord &)> &visit) const;
+
+private:
+    std::uint32_t MetricId(const std::string &name);
+    void Write(std::vector<SeriesRecord> &records);
+    bool WriteSegment(const std::string &day, const SeriesRecord *records, std::size_t count);
+
+    std::string m_directory;
+    std::vector<std::string> m_metric_names;
+    std::unordered_map<std::string, std::uint32_t> m_metric_ids;
+};
+
+#endif  //SMA_BLUETOOTH_SERIES_STORE_H
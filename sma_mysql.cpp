@@ -1,61 +1,659 @@
 #include "sma_mysql.h"
 
+#include "sma_queries.h"
+
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <climits>
 #include <ctime>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <stdexcept>
+#include <string_view>
+
+static bool ConnectionLost(unsigned int error)
+{
+    return error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST;
+}
+
+static bool LocalInfileRefused(unsigned int error)
+{
+    // ER_NOT_ALLOWED_COMMAND, ER_CLIENT_LOCAL_FILES_DISABLED and CR_LOAD_DATA_LOCAL_INFILE_REJECTED,
+    // not every client version has the names
+    return error == 1148 || error == 3948 || error == 2068;
+}
 
 MySQLConnection::MySQLConnection(const char *server, const char *user, const char *password, const char *database)
+    : m_server(server), m_user(user), m_password(password), m_database(database ? database : "")
+{
+    if (!Connect()) {
+        std::string error = mysql_error(m_conn);
+        mysql_close(m_conn);
+        throw std::runtime_error(error);
+    }
+}
+
+MySQLConnection::~MySQLConnection()
+{
+    // statements have to be closed while the connection is still open
+    m_statements.clear();
+    mysql_close(m_conn);
+}
+
+bool MySQLConnection::Connect()
 {
     m_conn = mysql_init(nullptr);
+    // LOCAL INFILE only ever reads m_infile through the handler below, never a file
+    const unsigned int local_infile = 1;
+    mysql_options(m_conn, MYSQL_OPT_LOCAL_INFILE, &local_infile);
+    mysql_set_local_infile_handler(m_conn, InfileInit, InfileRead, InfileEnd, InfileError, this);
     /* Connect to database */
-    if (!mysql_real_connect(m_conn, server,
-                            user, password, database, 0, nullptr, 0)) {
+    if (!mysql_real_connect(m_conn, m_server.c_str(),
+                            m_user.c_str(), m_password.c_str(), m_database.empty() ? nullptr : m_database.c_str(), 0, nullptr, 0))
+        return false;
+
+    ++m_generation;
+    return true;
+}
+
+bool MySQLConnection::Reconnect()
+{
+    mysql_close(m_conn);
+    if (!Connect()) {
         fmt::print(stderr, "{}\n", mysql_error(m_conn));
-        exit(0);
+        return false;
     }
+
+    return true;
 }
 
-MySQLConnection::~MySQLConnection()
+bool MySQLConnection::Ping()
 {
-    mysql_close(m_conn);
+    return mysql_ping(m_conn) == 0 || Reconnect();
 }
 
-MySQLResult MySQLConnection::ExecuteQuery(const char *query, bool debug)
+bool MySQLConnection::Begin(bool debug)
+{
+    // a connection lost before the transaction started is still reconnected
+    m_transaction = false;
+    m_transaction = Send("START TRANSACTION", strlen("START TRANSACTION"), debug);
+    return m_transaction;
+}
+
+bool MySQLConnection::Commit(bool debug)
+{
+    const auto committed = Send("COMMIT", strlen("COMMIT"), debug);
+    m_transaction = false;
+    if (!committed)
+        Ping();
+    return committed;
+}
+
+void MySQLConnection::Rollback(bool debug)
+{
+    Send("ROLLBACK", strlen("ROLLBACK"), debug);
+    m_transaction = false;
+    Ping();
+}
+
+bool MySQLConnection::Send(const char *query, std::size_t length, bool debug)
 {
     if (debug)
         fmt::print("{}\n", query);
 
-    if (mysql_real_query(m_conn, query, strlen(query))) {
-        fmt::print(stderr, "{}\n", mysql_error(m_conn));
+    if (mysql_real_query(m_conn, query, length)) {
+        if (!ConnectionLost(mysql_errno(m_conn)) || m_transaction || !Reconnect() || mysql_real_query(m_conn, query, length)) {
+            fmt::print(stderr, "{}\n", mysql_error(m_conn));
+            return false;
+        }
     }
 
-    return MySQLResult{mysql_store_result(m_conn)};
+    return true;
+}
+
+MySQLResult MySQLConnection::Query(const char *query, std::size_t length, bool debug)
+{
+    const auto start = std::chrono::steady_clock::now();
+    Send(query, length, debug);
+    MySQLResult result{mysql_store_result(m_conn)};
+    auto rows = result.res ? mysql_num_rows(result.res) : mysql_affected_rows(m_conn);
+    if (rows == static_cast<decltype(rows)>(-1))  // failed statement
+        rows = 0;
+    m_query_stats.Record({query, length}, std::chrono::steady_clock::now() - start, rows);
+
+    return result;
+}
+
+bool MySQLConnection::ForEachRow(const std::string &query, const std::function<bool(MYSQL_ROW)> &row_fn, bool debug)
+{
+    // the time includes row_fn, the rows arrive while it runs
+    const auto start = std::chrono::steady_clock::now();
+    unsigned long long rows = 0;
+    const auto stream = [&]() {
+        if (!Send(query.c_str(), query.size(), debug))
+            return false;
+
+        // freeing the result reads and drops whatever row_fn did not want
+        MySQLResult result{mysql_use_result(m_conn)};
+        if (!result.res)
+            return false;
+
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(result.res))) {
+            ++rows;
+            if (!row_fn(row))
+                return true;
+        }
+
+        if (mysql_errno(m_conn)) {
+            fmt::print(stderr, "{}\n", mysql_error(m_conn));
+            return false;
+        }
+
+        return true;
+    };
+
+    const auto success = stream();
+    m_query_stats.Record(query, std::chrono::steady_clock::now() - start, rows);
+    return success;
+}
+
+MySQLResult MySQLConnection::ExecuteQuery(const char *query, bool debug)
+{
+    return Query(query, strlen(query), debug);
 }
 
 MySQLResult MySQLConnection::ExecuteQuery(const std::string &query, bool debug)
+{
+    return Query(query.c_str(), query.size(), debug);
+}
+
+int MySQLConnection::InfileInit(void **handle, const char *, void *connection)
+{
+    *handle = connection;
+    return 0;
+}
+
+int MySQLConnection::InfileRead(void *connection, char *buffer, unsigned int length)
+{
+    auto &data = static_cast<MySQLConnection *>(connection)->m_infile;
+    const auto size = std::min<std::size_t>(length, data.size());
+    memcpy(buffer, data.data(), size);
+    data.remove_prefix(size);
+    return static_cast<int>(size);
+}
+
+void MySQLConnection::InfileEnd(void *)
+{
+}
+
+int MySQLConnection::InfileError(void *, char *message, unsigned int length)
+{
+    snprintf(message, length, "local infile is only available to LoadData");
+    return CR_UNKNOWN_ERROR;
+}
+
+bool MySQLConnection::LoadData(const std::string &statement, std::string_view data, bool debug)
+{
+    m_infile = data;
+    ExecuteQuery(statement, debug);
+    m_infile = {};
+
+    return mysql_errno(m_conn) == 0;
+}
+
+std::size_t MySQLConnection::MaxAllowedPacket(bool debug)
+{
+    if (m_max_allowed_packet == 0) {
+        MYSQL_ROW row;
+        if (auto result = ExecuteQuery("SELECT @@max_allowed_packet", debug); result.res && (row = mysql_fetch_row(result.res)))
+            m_max_allowed_packet = strtoull(row[0], nullptr, 10);
+        if (m_max_allowed_packet == 0)
+            m_max_allowed_packet = 1024 * 1024;  // server default of old versions
+    }
+
+    return m_max_allowed_packet;
+}
+
+MySQLStatement &MySQLConnection::Prepare(const std::string &query)
+{
+    auto &statement = m_statements[query];
+    if (!statement)
+        statement = std::make_unique<MySQLStatement>(*this, query);
+
+    return *statement;
+}
+
+std::unique_ptr<MySQLStatement> MySQLConnection::PrepareOnce(const std::string &query)
+{
+    return std::make_unique<MySQLStatement>(*this, query);
+}
+
+MySQLStatement::MySQLStatement(MySQLConnection &connection, std::string query) : m_connection(connection), m_query(std::move(query))
+{
+    Prepare();
+}
+
+void MySQLStatement::Prepare()
+{
+    if (m_stmt)
+        mysql_stmt_close(m_stmt);
+
+    m_generation = m_connection.generation();
+    m_stmt = mysql_stmt_init(m_connection.handle());
+    if (!m_stmt) {
+        fmt::print(stderr, "{}\n", mysql_error(m_connection.handle()));
+        return;
+    }
+    if (mysql_stmt_prepare(m_stmt, m_query.c_str(), m_query.size())) {
+        fmt::print(stderr, "{}\n", mysql_stmt_error(m_stmt));
+        mysql_stmt_close(m_stmt);
+        m_stmt = nullptr;
+        return;
+    }
+
+    // parameters bound before a reconnect stay valid
+    m_param_binds.resize(mysql_stmt_param_count(m_stmt));
+    m_params.resize(m_param_binds.size());
+}
+
+MySQLStatement::~MySQLStatement()
+{
+    if (m_stmt)
+        mysql_stmt_close(m_stmt);
+}
+
+void MySQLStatement::Bind(std::size_t index, long long value)
+{
+    m_params[index].integer = value;
+    m_param_binds[index] = MYSQL_BIND{};
+    m_param_binds[index].buffer_type = MYSQL_TYPE_LONGLONG;
+    m_param_binds[index].buffer = &m_params[index].integer;
+}
+
+void MySQLStatement::Bind(std::size_t index, unsigned long long value)
+{
+    Bind(index, static_cast<long long>(value));
+    m_param_binds[index].is_unsigned = true;
+}
+
+void MySQLStatement::Bind(std::size_t index, double value)
+{
+    m_params[index].real = value;
+    m_param_binds[index] = MYSQL_BIND{};
+    m_param_binds[index].buffer_type = MYSQL_TYPE_DOUBLE;
+    m_param_binds[index].buffer = &m_params[index].real;
+}
+
+void MySQLStatement::Bind(std::size_t index, std::string_view value)
+{
+    auto &param = m_params[index];
+    param.text.assign(value);
+    param.length = param.text.size();
+    m_param_binds[index] = MYSQL_BIND{};
+    m_param_binds[index].buffer_type = MYSQL_TYPE_STRING;
+    m_param_binds[index].buffer = param.text.data();
+    m_param_binds[index].buffer_length = param.length;
+    m_param_binds[index].length = &param.length;
+}
+
+void MySQLStatement::BindNull(std::size_t index)
+{
+    m_param_binds[index] = MYSQL_BIND{};
+    m_param_binds[index].buffer_type = MYSQL_TYPE_NULL;
+}
+
+bool MySQLStatement::Run()
+{
+    if (m_generation != m_connection.generation())
+        Prepare();
+    if (!m_stmt)
+        return false;
+
+    mysql_stmt_free_result(m_stmt);
+    return !(!m_param_binds.empty() && mysql_stmt_bind_param(m_stmt, m_param_binds.data())) && !mysql_stmt_execute(m_stmt);
+}
+
+bool MySQLStatement::Execute(bool debug)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const auto success = Store(debug);
+    auto rows = success ? mysql_stmt_affected_rows(m_stmt) : 0;
+    if (rows == static_cast<decltype(rows)>(-1))
+        rows = 0;
+    m_connection.query_stats().Record(m_query, std::chrono::steady_clock::now() - start, rows);
+
+    return success;
+}
+
+bool MySQLStatement::Store(bool debug)
 {
     if (debug)
-        fmt::print("{}\n", query);
+        fmt::print("{}\n", m_query);
 
-    if (mysql_real_query(m_conn, query.c_str(), query.size())) {
-        fmt::print(stderr, "{}\n", mysql_error(m_conn));
+    if (!Run()) {
+        if (!m_stmt || !ConnectionLost(mysql_stmt_errno(m_stmt)) || m_connection.in_transaction() || !m_connection.Reconnect() || !Run()) {
+            fmt::print(stderr, "{}\n", m_stmt ? mysql_stmt_error(m_stmt) : "statement not prepared");
+            return false;
+        }
+    }
+
+    const auto field_count = mysql_stmt_field_count(m_stmt);
+    if (field_count == 0)
+        return true;
+
+    m_columns.resize(field_count);
+    m_result_binds.assign(field_count, MYSQL_BIND{});
+    for (std::size_t i = 0; i < field_count; ++i) {
+        auto &column = m_columns[i];
+        if (column.buffer.size() < 64)
+            column.buffer.resize(64);
+        m_result_binds[i].buffer_type = MYSQL_TYPE_STRING;
+        m_result_binds[i].buffer = column.buffer.data();
+        m_result_binds[i].buffer_length = column.buffer.size() - 1;
+        m_result_binds[i].length = &column.length;
+        m_result_binds[i].is_null = &column.is_null;
+    }
+    if (mysql_stmt_bind_result(m_stmt, m_result_binds.data()) || mysql_stmt_store_result(m_stmt)) {
+        fmt::print(stderr, "{}\n", mysql_stmt_error(m_stmt));
+        return false;
+    }
+
+    return true;
+}
+
+bool MySQLStatement::Fetch()
+{
+    if (!m_stmt || m_columns.empty())
+        return false;
+
+    const auto status = mysql_stmt_fetch(m_stmt);
+    if (status != 0 && status != MYSQL_DATA_TRUNCATED)
+        return false;
+
+    bool rebind = false;
+    for (std::size_t i = 0; i < m_columns.size(); ++i) {
+        auto &column = m_columns[i];
+        if (column.is_null)
+            continue;
+        if (column.length >= column.buffer.size()) {
+            rebind = true;
+            // value did not fit, grow the buffer and read the column again
+            column.buffer.resize(column.length + 1);
+            m_result_binds[i].buffer = column.buffer.data();
+            m_result_binds[i].buffer_length = column.length;
+            mysql_stmt_fetch_column(m_stmt, &m_result_binds[i], i, 0);
+        }
+        column.buffer[column.length] = '\0';
+    }
+    if (rebind)
+        mysql_stmt_bind_result(m_stmt, m_result_binds.data());
+
+    return true;
+}
+
+const char *MySQLStatement::Column(std::size_t index) const
+{
+    const auto &column = m_columns[index];
+    return column.is_null ? nullptr : column.buffer.data();
+}
+
+// DayData and LiveData are partitioned by month, this many months are created in advance
+static constexpr int PARTITION_MONTHS_AHEAD = 3;
+
+struct YearMonth {
+    int year;
+    int month;
+
+    bool operator<(const YearMonth &other) const { return year < other.year || (year == other.year && month < other.month); }
+};
+
+static YearMonth NextMonth(YearMonth month)
+{
+    return month.month == 12 ? YearMonth{month.year + 1, 1} : YearMonth{month.year, month.month + 1};
+}
+
+static YearMonth CurrentMonth()
+{
+    const time_t now = time(nullptr);
+    tm local{};
+    localtime_r(&now, &local);
+    return {local.tm_year + 1900, local.tm_mon + 1};
+}
+
+static YearMonth LastPartitionMonth()
+{
+    auto month = CurrentMonth();
+    for (int i = 0; i < PARTITION_MONTHS_AHEAD; ++i)
+        month = NextMonth(month);
+    return month;
+}
+
+static std::string MonthPartitionList(YearMonth first, YearMonth last)
+/* One partition per month, named pYYYYMM */
+{
+    std::string partitions;
+    for (auto month = first; !(last < month); month = NextMonth(month)) {
+        const auto next = NextMonth(month);
+        partitions.append(fmt::format("PARTITION p{:04d}{:02d} VALUES LESS THAN (TO_DAYS('{:04d}-{:02d}-01')), ", month.year, month.month, next.year, next.month));
+    }
+    partitions.append("PARTITION pmax VALUES LESS THAN MAXVALUE");
+    return partitions;
+}
+
+static std::string DayDataTable(const char *name, YearMonth first)
+{
+    return fmt::format(
+        "CREATE TABLE `{}` ( \
+           `DateTime` datetime NOT NULL, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `CurrentPower` int(11) DEFAULT NULL, \
+           `ETotalToday` DECIMAL(10,3) DEFAULT NULL, \
+           `Voltage` DECIMAL(10,3) DEFAULT NULL, \
+           `PVOutput` datetime DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`DateTime`,`Inverter`,`Serial`) \
+           ) ENGINE=InnoDB PARTITION BY RANGE (TO_DAYS(`DateTime`)) ( {} )",
+        name, MonthPartitionList(first, LastPartitionMonth()));
+}
+
+static std::string LiveDataTable(const char *name, YearMonth first)
+{
+    // every unique key of a partitioned table has to contain DateTime
+    return fmt::format(
+        "CREATE TABLE `{}` ( \
+           `id` bigint(20) NOT NULL  AUTO_INCREMENT, \
+           `DateTime` datetime NOT NULL, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `Description` varchar(30) NOT NULL, \
+           `Value` varchar(30) NOT NULL, \
+           `Units` varchar(20) DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`id`,`DateTime`), \
+           UNIQUE KEY `DateTime` (`DateTime`,`Inverter`,`Serial`,`Description`) \
+           ) ENGINE=InnoDB PARTITION BY RANGE (TO_DAYS(`DateTime`)) ( {} )",
+        name, MonthPartitionList(first, LastPartitionMonth()));
+}
+
+static constexpr const char *DAY_ENERGY_TABLE =
+    "CREATE TABLE `DayEnergy` ( \
+           `Date` date NOT NULL, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `EStart` DECIMAL(12,3) DEFAULT NULL, \
+           `EEnd` DECIMAL(12,3) DEFAULT NULL, \
+           `PeakPower` int(11) DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`Inverter`,`Serial`,`Date`) \
+           ) ENGINE=InnoDB";
+
+// added to DayEnergy by schema 11
+static constexpr const char *DAY_ENERGY_PEAK_TIME = "ALTER TABLE `DayEnergy` ADD COLUMN `PeakTime` datetime DEFAULT NULL AFTER `PeakPower`";
+
+// monthly sums of DayEnergy, Month is the first day
+static constexpr const char *MONTH_ENERGY_TABLE =
+    "CREATE TABLE `MonthEnergy` ( \
+           `Month` date NOT NULL, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `Energy` DECIMAL(12,3) DEFAULT NULL, \
+           `Days` smallint DEFAULT NULL, \
+           `PeakPower` int(11) DEFAULT NULL, \
+           `PeakTime` datetime DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`Inverter`,`Serial`,`Month`) \
+           ) ENGINE=InnoDB";
+
+// how far each inverter has been synchronised, the automatic date range starts here
+static constexpr const char *SYNC_STATE_TABLE =
+    "CREATE TABLE `SyncState` ( \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `LastArchive` datetime DEFAULT NULL, \
+           `LastLive` datetime DEFAULT NULL, \
+           `LastUpload` datetime DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`Inverter`,`Serial`) \
+           ) ENGINE=InnoDB";
+
+static constexpr const char *INVERTERS_TABLE =
+    "CREATE TABLE `Inverters` ( \
+           `id` smallint unsigned NOT NULL AUTO_INCREMENT, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           PRIMARY KEY (`id`), \
+           UNIQUE KEY `Inverter` (`Inverter`,`Serial`) \
+           ) ENGINE=InnoDB";
+
+// Kind is MetricKind: 0 number, 1 text (Value is a MetricText id), 2 date (Value is a unix time)
+static constexpr const char *METRIC_TABLE =
+    "CREATE TABLE `Metric` ( \
+           `id` smallint unsigned NOT NULL AUTO_INCREMENT, \
+           `Description` varchar(30) NOT NULL, \
+           `Units` varchar(20) DEFAULT NULL, \
+           `Decimals` tinyint NOT NULL DEFAULT 0, \
+           `Kind` tinyint NOT NULL DEFAULT 0, \
+           PRIMARY KEY (`id`), \
+           UNIQUE KEY `Description` (`Description`) \
+           ) ENGINE=InnoDB";
+
+static constexpr const char *METRIC_TEXT_TABLE =
+    "CREATE TABLE `MetricText` ( \
+           `id` int unsigned NOT NULL AUTO_INCREMENT, \
+           `Text` varchar(60) NOT NULL, \
+           PRIMARY KEY (`id`), \
+           UNIQUE KEY `Text` (`Text`) \
+           ) ENGINE=InnoDB";
+
+// Secondary indexes that answer the queries in sma_queries.h from the index
+// alone. InnoDB appends the primary key, so DateTime, Inverter and Serial of
+// DayData come along for free.
+static constexpr const char *COVERING_INDEXES[] = {
+    "ALTER TABLE `DayData` ADD INDEX `PVOutputPending` (`PVOutput`,`DateTime`,`CurrentPower`,`ETotalToday`), \
+     ADD INDEX `SerialDateTime` (`Serial`,`DateTime`)",
+    "ALTER TABLE `DayEnergy` ADD INDEX `Date` (`Date`,`EStart`,`EEnd`)",
+};
+
+static std::string LiveValueTable(YearMonth first)
+{
+    return fmt::format(
+        "CREATE TABLE `LiveValue` ( \
+           `DateTime` datetime NOT NULL, \
+           `InverterId` smallint unsigned NOT NULL, \
+           `MetricId` smallint unsigned NOT NULL, \
+           `Value` double NOT NULL, \
+           `Mean` double DEFAULT NULL, \
+           `Min` double DEFAULT NULL, \
+           `Max` double DEFAULT NULL, \
+           PRIMARY KEY (`InverterId`,`MetricId`,`DateTime`) \
+           ) ENGINE=InnoDB PARTITION BY RANGE (TO_DAYS(`DateTime`)) ( {} )",
+        MonthPartitionList(first, LastPartitionMonth()));
+}
+
+// the old wide layout, for reports written against it, with the window summary of aggregated rows
+static constexpr const char *LIVE_DATA_VIEW =
+    "CREATE OR REPLACE VIEW `LiveData` AS SELECT lv.DateTime, inv.Inverter, inv.Serial, m.Description, \
+           CASE m.Kind WHEN 1 THEN t.Text WHEN 2 THEN FROM_UNIXTIME(lv.Value) ELSE ROUND(lv.Value, m.Decimals) END AS Value, m.Units, \
+           ROUND(lv.Mean, m.Decimals) AS Mean, ROUND(lv.Min, m.Decimals) AS Min, ROUND(lv.Max, m.Decimals) AS Max \
+           FROM LiveValue AS lv JOIN Inverters AS inv ON inv.id=lv.InverterId JOIN Metric AS m ON m.id=lv.MetricId \
+           LEFT JOIN MetricText AS t ON m.Kind=1 AND t.id=lv.Value";
+
+static void CopyAndSwapTable(MySQLConnection &mysql_connection, const char *table, const char *columns, std::string (*create)(const char *, YearMonth), bool debug)
+/* Rebuild a MyISAM table as partitioned InnoDB while the old one stays in use */
+{
+    auto first = CurrentMonth();
+    auto last = first;
+    {
+        MYSQL_ROW row;
+        const auto query = fmt::format("SELECT YEAR(MIN(DateTime)), MONTH(MIN(DateTime)), YEAR(MAX(DateTime)), MONTH(MAX(DateTime)) FROM `{}`", table);
+        if (auto result = mysql_connection.ExecuteQuery(query, debug); result.res && (row = mysql_fetch_row(result.res)) && row[0] && row[2]) {
+            first = {atoi(row[0]), atoi(row[1])};
+            last = {atoi(row[2]), atoi(row[3])};
+        }
     }
 
-    return MySQLResult{mysql_store_result(m_conn)};
+    const auto copy = fmt::format("{}_copy", table);
+    const auto backup = fmt::format("{}_myisam", table);
+    mysql_connection.ExecuteQuery(fmt::format("DROP TABLE IF EXISTS `{}`", copy), debug);
+    mysql_connection.ExecuteQuery(create(copy.c_str(), first), debug);
+
+    // a month per statement, so the MyISAM table lock is only held briefly
+    for (auto month = first; !(last < month); month = NextMonth(month)) {
+        const auto next = NextMonth(month);
+        mysql_connection.ExecuteQuery(fmt::format("INSERT IGNORE INTO `{0}` ( {1} ) SELECT {1} FROM `{2}` WHERE DateTime >= '{3:04d}-{4:02d}-01' AND DateTime < '{5:04d}-{6:02d}-01'",
+                                                  copy, columns, table, month.year, month.month, next.year, next.month),
+                                      debug);
+    }
+
+    mysql_connection.ExecuteQuery(fmt::format("RENAME TABLE `{0}` TO `{1}`, `{2}` TO `{0}`", table, backup, copy), debug);
+
+    // rows written to the last month while copying; older late rows are found again by the gap scan
+    mysql_connection.ExecuteQuery(fmt::format("INSERT IGNORE INTO `{0}` ( {1} ) SELECT {1} FROM `{2}` WHERE DateTime >= '{3:04d}-{4:02d}-01'", table, columns, backup, last.year, last.month), debug);
+    fmt::print("{} converted, the old table is kept as {}\n", table, backup);
+}
+
+void maintain_partitions(MySQLConnection &mysql_connection, bool debug)
+/* Split the catch-all partition so the coming months get their own */
+{
+    const auto target = LastPartitionMonth();
+    for (const auto *table : {"DayData", "LiveValue"}) {
+        YearMonth last{};
+        {
+            MYSQL_ROW row;
+            const auto query = fmt::format("SELECT PARTITION_NAME FROM information_schema.PARTITIONS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='{}' AND PARTITION_NAME LIKE 'p______' ORDER BY PARTITION_NAME DESC LIMIT 1", table);
+            auto result = mysql_connection.ExecuteQuery(query, debug);
+            if (!result.res || !(row = mysql_fetch_row(result.res)) || !row[0])
+                continue;  // not partitioned
+            const auto number = atoi(row[0] + 1);
+            last = {number / 100, number % 100};
+        }
+
+        if (!(last < target))
+            continue;
+
+        mysql_connection.ExecuteQuery(fmt::format("ALTER TABLE `{}` REORGANIZE PARTITION pmax INTO ( {} )", table, MonthPartitionList(NextMonth(last), target)), debug);
+    }
 }
 
-int install_mysql_tables(ConfType *conf, FlagType *flag, const char *SCHEMA)
+int install_mysql_tables(MySQLConnection &mysql_connection, const ConfType *conf, const char *schema, bool debug)
 /*  Do initial mysql table creationsa */
 {
     auto found = false;
     MYSQL_ROW row;
 
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
     //Get Start of day value
-    auto result = mysql_connection.ExecuteQuery("SHOW DATABASES", flag->debug);
+    auto result = mysql_connection.ExecuteQuery("SHOW DATABASES", debug);
     while ((row = mysql_fetch_row(result.res)))  //if there is a result, update the row
     {
         if (strcmp(row[0], conf->MySqlDatabase) == 0) {
@@ -68,12 +666,12 @@ int install_mysql_tables(ConfType *conf, FlagType *flag, const char *SCHEMA)
 
         {
             const auto query = fmt::format("CREATE DATABASE IF NOT EXISTS {}", conf->MySqlDatabase);
-            mysql_connection.ExecuteQuery(query, flag->debug);
+            mysql_connection.ExecuteQuery(query, debug);
         }
 
         {
             const auto query = fmt::format("USE  {}", conf->MySqlDatabase);
-            mysql_connection.ExecuteQuery(query, flag->debug);
+            mysql_connection.ExecuteQuery(query, debug);
         }
 
         {
@@ -86,43 +684,37 @@ int install_mysql_tables(ConfType *conf, FlagType *flag, const char *SCHEMA)
                   `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
                    PRIMARY KEY (`id`),\
                    UNIQUE KEY `date` (`date`)\
-                   ) ENGINE=MyISAM";
+                   ) ENGINE=InnoDB";
 
-            mysql_connection.ExecuteQuery(query, flag->debug);
+            mysql_connection.ExecuteQuery(query, debug);
         }
 
-        {
-            const auto query =
-                "CREATE TABLE `DayData` ( \
-           `DateTime` datetime NOT NULL, \
-           `Inverter` varchar(30) NOT NULL, \
-           `Serial` varchar(40) NOT NULL, \
-           `CurrentPower` int(11) DEFAULT NULL, \
-           `ETotalToday` DECIMAL(10,3) DEFAULT NULL, \
-           `Voltage` DECIMAL(10,3) DEFAULT NULL, \
-           `PVOutput` datetime DEFAULT NULL, \
-           `CHANGETIME` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00' ON UPDATE CURRENT_TIMESTAMP, \
-           PRIMARY KEY (`DateTime`,`Inverter`,`Serial`) \
-           ) ENGINE=MyISAM";
-
-            mysql_connection.ExecuteQuery(query, flag->debug);
-        }
+        mysql_connection.ExecuteQuery(DayDataTable("DayData", CurrentMonth()), debug);
+        mysql_connection.ExecuteQuery(INVERTERS_TABLE, debug);
+        mysql_connection.ExecuteQuery(METRIC_TABLE, debug);
+        mysql_connection.ExecuteQuery(METRIC_TEXT_TABLE, debug);
+        mysql_connection.ExecuteQuery(LiveValueTable(CurrentMonth()), debug);
+        mysql_connection.ExecuteQuery(LIVE_DATA_VIEW, debug);
+        mysql_connection.ExecuteQuery(DAY_ENERGY_TABLE, debug);
+        mysql_connection.ExecuteQuery(DAY_ENERGY_PEAK_TIME, debug);
+        mysql_connection.ExecuteQuery(MONTH_ENERGY_TABLE, debug);
+        mysql_connection.ExecuteQuery(SYNC_STATE_TABLE, debug);
+        for (const auto *query : COVERING_INDEXES)
+            mysql_connection.ExecuteQuery(query, debug);
 
         {
             const auto query =
-                "CREATE TABLE `LiveData` ( \
-           `id` bigint(20) NOT NULL  AUTO_INCREMENT, \
-           `DateTime` datetime NOT NULL, \
+                "CREATE TABLE `MonthData` ( \
+           `Date` date NOT NULL, \
            `Inverter` varchar(30) NOT NULL, \
            `Serial` varchar(40) NOT NULL, \
-           `Description` varchar(30) NOT NULL, \
-           `Value` varchar(30) NOT NULL, \
-           `Units` varchar(20) DEFAULT NULL, \
-           `CHANGETIME` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00' ON UPDATE CURRENT_TIMESTAMP, \
-           PRIMARY KEY (`id`), \
-           UNIQUE KEY 'DateTime'(`DateTime`,`Inverter`,`Serial`,`Description`) \
-           ) ENGINE=MyISAM";
-            mysql_connection.ExecuteQuery(query, flag->debug);
+           `ETotal` DECIMAL(12,3) DEFAULT NULL, \
+           `EDay` DECIMAL(10,3) DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`Inverter`,`Serial`,`Date`) \
+           ) ENGINE=InnoDB";
+
+            mysql_connection.ExecuteQuery(query, debug);
         }
 
         {
@@ -131,15 +723,15 @@ int install_mysql_tables(ConfType *conf, FlagType *flag, const char *SCHEMA)
            `value` varchar(128) NOT NULL, \
            `data` varchar(500) NOT NULL, \
            PRIMARY KEY (`value`) \
-           ) ENGINE=MyISAM";
+           ) ENGINE=InnoDB";
 
-            mysql_connection.ExecuteQuery(query, flag->debug);
+            mysql_connection.ExecuteQuery(query, debug);
         }
 
         {
-            const auto query = fmt::format(R"(INSERT INTO `settings` SET `value` = 'schema', `data` = '%s' )", SCHEMA);
+            const auto query = fmt::format(R"(INSERT INTO `settings` SET `value` = 'schema', `data` = '{}' )", schema);
 
-            mysql_connection.ExecuteQuery(query, flag->debug);
+            mysql_connection.ExecuteQuery(query, debug);
         }
     }
 
@@ -158,19 +750,17 @@ int get_schema_version(MySQLConnection &conn, unsigned int debug)
     return 0;
 }
 
-void update_mysql_tables(ConfType *conf, FlagType *flag)
+void update_mysql_tables(MySQLConnection &mysql_connection, bool debug)
 /*  Do mysql table schema updates */
 {
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
-
     /*Check current schema value*/
-    int schema_value = get_schema_version(mysql_connection, flag->debug);
+    int schema_value = get_schema_version(mysql_connection, debug);
 
     if (schema_value == 1) {  //Upgrade from 1 to 2
-        mysql_connection.ExecuteQuery("ALTER TABLE `DayData` CHANGE `ETotalToday` `ETotalToday` DECIMAL(10,3) NULL DEFAULT NULL", flag->debug);
-        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 2", flag->debug);
+        mysql_connection.ExecuteQuery("ALTER TABLE `DayData` CHANGE `ETotalToday` `ETotalToday` DECIMAL(10,3) NULL DEFAULT NULL", debug);
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 2", debug);
 
-        schema_value = get_schema_version(mysql_connection, flag->debug);
+        schema_value = get_schema_version(mysql_connection, debug);
     }
 
     if (schema_value == 2) {  //Upgrade from 2 to 3
@@ -187,10 +777,10 @@ void update_mysql_tables(ConfType *conf, FlagType *flag)
            	UNIQUE KEY (`DateTime`,`Inverter`,`Serial`,`Description`), \
 		    PRIMARY KEY ( `id` ) \
 		    ) ENGINE = MYISAM",
-            flag->debug);
-        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 3", flag->debug);
+            debug);
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 3", debug);
 
-        schema_value = get_schema_version(mysql_connection, flag->debug);
+        schema_value = get_schema_version(mysql_connection, debug);
     }
 
     if (schema_value == 3) {  //Upgrade from 3 to 4
@@ -198,32 +788,175 @@ void update_mysql_tables(ConfType *conf, FlagType *flag)
         mysql_connection.ExecuteQuery(
             "ALTER TABLE `DayData` CHANGE `Inverter` `Inverter` varchar(30) NOT NULL,"
             "CHANGE `Serial` `Serial` varchar(40) NOT NULL",
-            flag->debug);
+            debug);
 
         mysql_connection.ExecuteQuery(
             "ALTER TABLE `LiveData` CHANGE `Inverter` `Inverter` varchar(30) NOT NULL,"
             " CHANGE `Serial` `Serial` varchar(40) NOT NULL, CHANGE `Description` `Description` varchar(30) NOT NULL,"
             " CHANGE `Value` `Value` varchar(30), CHANGE `Units` `Units` varchar(20) NULL DEFAULT NULL ",
-            flag->debug);
+            debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 4", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 4) {  //Upgrade from 4 to 5
+
+        mysql_connection.ExecuteQuery(
+            "CREATE TABLE `MonthData` ( \
+           `Date` date NOT NULL, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `ETotal` DECIMAL(12,3) DEFAULT NULL, \
+           `EDay` DECIMAL(10,3) DEFAULT NULL, \
+           `CHANGETIME` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP, \
+           PRIMARY KEY (`Inverter`,`Serial`,`Date`) \
+           ) ENGINE=MyISAM",
+            debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 5", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 5) {  //Upgrade from 5 to 6, InnoDB with monthly partitions
+
+        CopyAndSwapTable(mysql_connection, "DayData", "DateTime, Inverter, Serial, CurrentPower, ETotalToday, Voltage, PVOutput, CHANGETIME", DayDataTable, debug);
+        CopyAndSwapTable(mysql_connection, "LiveData", "id, DateTime, Inverter, Serial, Description, Value, Units, CHANGETIME", LiveDataTable, debug);
+        mysql_connection.ExecuteQuery("ALTER TABLE `Almanac` ENGINE=InnoDB", debug);
+        mysql_connection.ExecuteQuery("ALTER TABLE `MonthData` ENGINE=InnoDB", debug);
+        mysql_connection.ExecuteQuery("ALTER TABLE `settings` ENGINE=InnoDB", debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 6", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 6) {  //Upgrade from 6 to 7
+
+        mysql_connection.ExecuteQuery(DAY_ENERGY_TABLE, debug);
+        mysql_connection.ExecuteQuery(
+            "INSERT INTO `DayEnergy` ( Date, Inverter, Serial, EStart, EEnd, PeakPower ) \
+             SELECT DATE(DateTime), Inverter, Serial, MIN(ETotalToday), MAX(ETotalToday), MAX(CurrentPower) FROM `DayData` WHERE ETotalToday > 0 GROUP BY DATE(DateTime), Inverter, Serial",
+            debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 7", debug);
 
-        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 4", flag->debug);
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 7) {  //Upgrade from 7 to 8, narrow numeric LiveValue replaces LiveData
+
+        auto first = CurrentMonth();
+        {
+            MYSQL_ROW row;
+            if (auto result = mysql_connection.ExecuteQuery("SELECT YEAR(MIN(DateTime)), MONTH(MIN(DateTime)) FROM `LiveData`", debug); result.res && (row = mysql_fetch_row(result.res)) && row[0])
+                first = {atoi(row[0]), atoi(row[1])};
+        }
+
+        mysql_connection.ExecuteQuery(INVERTERS_TABLE, debug);
+        mysql_connection.ExecuteQuery(METRIC_TABLE, debug);
+        mysql_connection.ExecuteQuery(METRIC_TEXT_TABLE, debug);
+        mysql_connection.ExecuteQuery(LiveValueTable(first), debug);
+
+        mysql_connection.ExecuteQuery("INSERT IGNORE INTO `Inverters` ( Inverter, Serial ) SELECT DISTINCT Inverter, Serial FROM `LiveData`", debug);
+        // the kind and decimals are guessed from the stored text, the next run corrects them from the unit conversions
+        mysql_connection.ExecuteQuery(
+            "INSERT IGNORE INTO `Metric` ( Description, Units, Decimals, Kind ) SELECT Description, MAX(Units), \
+             MAX(IF(LOCATE('.', Value) > 0, LENGTH(Value) - LOCATE('.', Value), 0)), \
+             CASE WHEN SUM(Value REGEXP '^[0-9]{4}-[0-9]{2}-[0-9]{2} ') = COUNT(*) THEN 2 WHEN SUM(Value REGEXP '^-?[0-9]+(\\\\.[0-9]+)?$') = COUNT(*) THEN 0 ELSE 1 END \
+             FROM `LiveData` GROUP BY Description",
+            debug);
+        mysql_connection.ExecuteQuery("INSERT IGNORE INTO `MetricText` ( Text ) SELECT DISTINCT ld.Value FROM `LiveData` AS ld JOIN `Metric` AS m ON m.Description=ld.Description AND m.Kind=1", debug);
+        mysql_connection.ExecuteQuery(
+            "INSERT IGNORE INTO `LiveValue` ( DateTime, InverterId, MetricId, Value ) \
+             SELECT ld.DateTime, inv.id, m.id, CASE m.Kind WHEN 1 THEN t.id WHEN 2 THEN UNIX_TIMESTAMP(ld.Value) ELSE ld.Value END \
+             FROM `LiveData` AS ld JOIN `Inverters` AS inv ON inv.Inverter=ld.Inverter AND inv.Serial=ld.Serial JOIN `Metric` AS m ON m.Description=ld.Description \
+             LEFT JOIN `MetricText` AS t ON m.Kind=1 AND t.Text=ld.Value",
+            debug);
+
+        mysql_connection.ExecuteQuery("RENAME TABLE `LiveData` TO `LiveData_wide`", debug);
+        mysql_connection.ExecuteQuery(LIVE_DATA_VIEW, debug);
+        fmt::print("LiveData converted, the old table is kept as LiveData_wide\n");
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 8", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 8) {  //Upgrade from 8 to 9, covering indexes for the hot queries
+
+        for (const auto *query : COVERING_INDEXES)
+            mysql_connection.ExecuteQuery(query, debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 9", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 9) {  //Upgrade from 9 to 10, window summaries of aggregated live values
+
+        mysql_connection.ExecuteQuery("ALTER TABLE `LiveValue` ADD COLUMN `Mean` double DEFAULT NULL, ADD COLUMN `Min` double DEFAULT NULL, ADD COLUMN `Max` double DEFAULT NULL", debug);
+        mysql_connection.ExecuteQuery(LIVE_DATA_VIEW, debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 10", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 10) {  //Upgrade from 10 to 11, time of the peak and the MonthEnergy rollup
+
+        mysql_connection.ExecuteQuery(DAY_ENERGY_PEAK_TIME, debug);
+        mysql_connection.ExecuteQuery(
+            "UPDATE `DayEnergy` AS de SET PeakTime=( SELECT MIN(dd.DateTime) FROM `DayData` AS dd WHERE dd.Serial=de.Serial AND dd.Inverter=de.Inverter \
+             AND dd.DateTime >= de.Date AND dd.DateTime < de.Date + INTERVAL 1 DAY AND dd.CurrentPower=de.PeakPower )",
+            debug);
+        mysql_connection.ExecuteQuery(MONTH_ENERGY_TABLE, debug);
+        mysql_connection.ExecuteQuery(
+            "INSERT INTO `MonthEnergy` ( Month, Inverter, Serial, Energy, Days, PeakPower ) \
+             SELECT DATE_FORMAT(Date, '%Y-%m-01'), Inverter, Serial, SUM(EEnd-EStart), COUNT(*), MAX(PeakPower) FROM `DayEnergy` GROUP BY DATE_FORMAT(Date, '%Y-%m-01'), Inverter, Serial",
+            debug);
+        mysql_connection.ExecuteQuery(
+            "UPDATE `MonthEnergy` AS me SET PeakTime=( SELECT de.PeakTime FROM `DayEnergy` AS de WHERE de.Inverter=me.Inverter AND de.Serial=me.Serial \
+             AND de.Date BETWEEN me.Month AND LAST_DAY(me.Month) ORDER BY de.PeakPower DESC, de.Date ASC LIMIT 1 )",
+            debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 11", debug);
+
+        schema_value = get_schema_version(mysql_connection, debug);
+    }
+
+    if (schema_value == 11) {  //Upgrade from 11 to 12, per inverter sync state instead of the newest DayData row
+
+        mysql_connection.ExecuteQuery(SYNC_STATE_TABLE, debug);
+        mysql_connection.ExecuteQuery("INSERT INTO `SyncState` ( Inverter, Serial, LastArchive ) SELECT Inverter, Serial, MAX(DateTime) FROM `DayData` GROUP BY Inverter, Serial", debug);
+        mysql_connection.ExecuteQuery(
+            "INSERT INTO `SyncState` ( Inverter, Serial, LastUpload ) SELECT Inverter, Serial, MAX(DateTime) FROM `DayData` WHERE PVOutput IS NOT NULL GROUP BY Inverter, Serial \
+             ON DUPLICATE KEY UPDATE LastUpload=VALUES(LastUpload)",
+            debug);
+        mysql_connection.ExecuteQuery(
+            "INSERT INTO `SyncState` ( Inverter, Serial, LastLive ) SELECT inv.Inverter, inv.Serial, MAX(lv.DateTime) FROM `LiveValue` AS lv JOIN `Inverters` AS inv ON inv.id=lv.InverterId \
+             GROUP BY inv.Inverter, inv.Serial ON DUPLICATE KEY UPDATE LastLive=VALUES(LastLive)",
+            debug);
+
+        mysql_connection.ExecuteQuery("UPDATE `settings` SET `value` = \'schema\', `data` = 12", debug);
     }
 }
 
-int check_schema(ConfType *conf, FlagType *flag, const char *SCHEMA)
+int check_schema(MySQLConnection &mysql_connection, const char *schema, bool debug)
 /*  Check if using the correct database schema */
 {
     int found = 0;
     MYSQL_ROW row;
 
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
     //Get Start of day value
 
     if (auto result = mysql_connection.ExecuteQuery("SELECT data FROM settings WHERE value=\'schema\'",
-                                                    flag->debug);
+                                                    debug);
         (row = mysql_fetch_row(result.res)))  //if there is a result, update the row
     {
-        if (strcmp(row[0], SCHEMA) == 0)
+        if (strcmp(row[0], schema) == 0)
             found = 1;
     }
 
@@ -233,42 +966,542 @@ int check_schema(ConfType *conf, FlagType *flag, const char *SCHEMA)
     return found;
 }
 
-void live_mysql(ConfType conf, bool debug, const LiveDataList &livedatalist)
-/* Live inverter values mysql update */
+void prime_live_cache(MySQLConnection &mysql_connection, LiveValueCache &cache, bool debug)
+/* Load the latest LiveValue of every inverter and metric */
 {
-    struct tm *loctime;
-    int day, month, year, hour, minute, second;
+    auto result = mysql_connection.ExecuteQuery(QUERY_LATEST_LIVE, debug);
 
-    auto mysql_connection = MySQLConnection(conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase);
-    for (const auto &data : livedatalist) {
+    MYSQL_ROW row;
+    while (result.res && (row = mysql_fetch_row(result.res))) {
+        const auto kind = static_cast<MetricKind>(atoi(row[3]));
+        const auto value = kind == MetricKind::Text ? std::string(row[6] ? row[6] : "") : FormatLiveValue(kind, atoi(row[4]), strtod(row[5], nullptr));
+        cache.Update(row[0] ? row[0] : "", strtoull(row[1], nullptr, 10), row[2] ? row[2] : "", value);
+    }
 
-        loctime = localtime(&data.date);
-        day = loctime->tm_mday;
-        month = loctime->tm_mon + 1;
-        year = loctime->tm_year + 1900;
-        hour = loctime->tm_hour;
-        minute = loctime->tm_min;
-        second = loctime->tm_sec;
+    cache.MarkPrimed();
+}
 
+static long long DimensionId(MySQLStatement &upsert, bool debug)
+/* Id of a dimension row inserted or found by an ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id) statement */
+{
+    return upsert.Execute(debug) ? static_cast<long long>(upsert.insert_id()) : 0;
+}
+
+bool live_mysql(MySQLConnection &mysql_connection, bool debug, const LiveBatch &batch, const SampleCatalog &catalog, LiveValueCache &cache)
+/* Live inverter values mysql update, false if a value could not be stored */
+{
+    auto &inverter_upsert = mysql_connection.Prepare("INSERT INTO Inverters ( Inverter, Serial ) VALUES ( ?, ? ) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id)");
+    auto &metric_upsert = mysql_connection.Prepare("INSERT INTO Metric ( Description, Units, Decimals, Kind ) VALUES ( ?, ?, ?, ? ) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id), Units=VALUES(Units), Decimals=VALUES(Decimals), Kind=VALUES(Kind)");
+    auto &text_upsert = mysql_connection.Prepare("INSERT INTO MetricText ( Text ) VALUES ( ? ) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id)");
+    auto &insert = mysql_connection.Prepare(
+        "INSERT INTO LiveValue ( DateTime, InverterId, MetricId, Value, Mean, Min, Max ) VALUES ( FROM_UNIXTIME(?), ?, ?, ?, ?, ?, ? ) \
+         ON DUPLICATE KEY UPDATE Value=VALUES(Value), Mean=VALUES(Mean), Min=VALUES(Min), Max=VALUES(Max)");
+
+    // dimension rows are looked up once per batch
+    std::unordered_map<SourceId, long long> inverter_ids;
+    std::unordered_map<MetricId, long long> metric_ids;
+    std::unordered_map<StringId, long long> text_ids;
+
+    auto stored_all = true;
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto source = catalog.GetSource(batch.sources[i]);
+        const auto metric = catalog.GetMetric(batch.metrics[i]);
+        const auto &inverter = catalog.GetString(source.inverter);
+        const auto &description = catalog.GetString(metric.description);
+        const auto value = FormatLiveValue(catalog, metric, batch.values[i]);
+
+        // windows are stored even when their last value did not change
         auto live_data = true;
-        if (data.Persistent == 1) {
-            const auto query = fmt::format(R"(SELECT IF (Value = "{}",NULL,Value) FROM LiveData where Inverter="{}" and Serial={} and Description="{}" ORDER BY DateTime DESC LIMIT 1)",
-                                           data.Value, data.inverter, data.serial, data.Description);
+        if (!batch.Windowed(i) && (metric.persistent || (metric.kind == MetricKind::Number && batch.values[i] == 0)))
+            live_data = cache.Changed(inverter, source.serial, description, value);
 
-            MYSQL_ROW row;
-            if (auto result = mysql_connection.ExecuteQuery(query, debug); (row = mysql_fetch_row(result.res)))  //if there is a result, update the row
-            {
-                if (row[0] == nullptr) {
-                    live_data = false;
+        if (live_data) {
+            auto [inverter_id, new_inverter] = inverter_ids.try_emplace(batch.sources[i], 0);
+            if (new_inverter) {
+                inverter_upsert.Bind(0, inverter);
+                inverter_upsert.Bind(1, source.serial);
+                inverter_id->second = DimensionId(inverter_upsert, debug);
+            }
+            auto [metric_id, new_metric] = metric_ids.try_emplace(batch.metrics[i], 0);
+            if (new_metric) {
+                metric_upsert.Bind(0, description);
+                metric_upsert.Bind(1, catalog.GetString(metric.units));
+                metric_upsert.Bind(2, static_cast<long long>(metric.decimals));
+                metric_upsert.Bind(3, static_cast<long long>(metric.kind));
+                metric_id->second = DimensionId(metric_upsert, debug);
+            }
+
+            // text values are stored as the id of their MetricText row
+            auto stored = batch.values[i];
+            if (metric.kind == MetricKind::Text) {
+                auto [text_id, new_text] = text_ids.try_emplace(static_cast<StringId>(batch.values[i]), 0);
+                if (new_text) {
+                    text_upsert.Bind(0, value);
+                    text_id->second = DimensionId(text_upsert, debug);
+                }
+                stored = static_cast<double>(text_id->second);
+            }
+
+            insert.Bind(0, static_cast<long long>(batch.times[i]));
+            insert.Bind(1, inverter_id->second);
+            insert.Bind(2, metric_id->second);
+            insert.Bind(3, stored);
+            if (batch.Windowed(i)) {
+                insert.Bind(4, batch.means[i]);
+                insert.Bind(5, batch.minimums[i]);
+                insert.Bind(6, batch.maximums[i]);
+            } else {
+                for (std::size_t column = 4; column < 7; ++column)
+                    insert.BindNull(column);
+            }
+            if (insert.Execute(debug))
+                cache.Update(inverter, source.serial, description, value);
+            else
+                stored_all = false;
+        }
+    }
+
+    return stored_all;
+}
+
+// rows per statement when compacted LiveValue rows are written or deleted
+static constexpr std::size_t LIVE_COMPACT_ROWS = 500;
+
+static std::string LiveSeriesFilter(MySQLConnection &mysql_connection, bool debug)
+/* Every inverter and metric as IN lists, so a day of LiveValue is read through the primary key */
+{
+    const auto ids = [&mysql_connection, debug](const char *query) {
+        std::string list;
+        mysql_connection.ForEachRow(
+            query,
+            [&list](MYSQL_ROW row) {
+                list.append(list.empty() ? "" : ",").append(row[0]);
+                return true;
+            },
+            debug);
+        return list;
+    };
+    const auto inverters = ids("SELECT id FROM Inverters");
+    const auto metrics = ids("SELECT id FROM Metric");
+    if (inverters.empty() || metrics.empty())
+        return {};
+
+    return fmt::format("InverterId IN ({}) AND MetricId IN ({})", inverters, metrics);
+}
+
+static std::optional<time_t> LiveCompactedTo(MySQLConnection &mysql_connection, const char *stage, const std::string &filter, bool debug)
+/* First day a compaction stage has not done yet, the oldest LiveValue day when it never ran */
+{
+    auto &query = mysql_connection.Prepare("SELECT data FROM settings WHERE value=?");
+    query.Bind(0, stage);
+    if (query.Execute(debug) && query.Fetch() && query.Column(0))
+        return static_cast<time_t>(strtoll(query.Column(0), nullptr, 10));
+
+    // one MIN per series, a loose scan of the primary key
+    std::optional<time_t> oldest;
+    mysql_connection.ForEachRow(
+        fmt::format("SELECT UNIX_TIMESTAMP(MIN(DateTime)) FROM LiveValue WHERE {} GROUP BY InverterId, MetricId", filter),
+        [&oldest](MYSQL_ROW row) {
+            if (row[0])
+                oldest = std::min(oldest.value_or(LLONG_MAX), static_cast<time_t>(strtoll(row[0], nullptr, 10)));
+            return true;
+        },
+        debug);
+    if (oldest)
+        return StartOfDay(*oldest);
+    return std::nullopt;
+}
+
+static std::vector<LiveRow> LiveDay(MySQLConnection &mysql_connection, const std::string &filter, time_t day, time_t next, bool debug)
+/* LiveValue rows of one day by series and time */
+{
+    std::vector<LiveRow> rows;
+    const auto number = [](const char *column) { return column ? strtod(column, nullptr) : NAN; };
+    mysql_connection.ForEachRow(
+        fmt::format("SELECT lv.InverterId, lv.MetricId, m.Kind, UNIX_TIMESTAMP(lv.DateTime), lv.Value, lv.Mean, lv.Min, lv.Max \
+                     FROM LiveValue AS lv JOIN Metric AS m ON m.id=lv.MetricId WHERE {} AND lv.DateTime >= FROM_UNIXTIME({}) AND lv.DateTime < FROM_UNIXTIME({}) \
+                     ORDER BY lv.InverterId, lv.MetricId, lv.DateTime",
+                    filter, day, next),
+        [&rows, &number](MYSQL_ROW row) {
+            rows.push_back({strtoll(row[0], nullptr, 10), strtoll(row[1], nullptr, 10), static_cast<MetricKind>(atoi(row[2])), static_cast<time_t>(strtoll(row[3], nullptr, 10)),
+                            number(row[4]), number(row[5]), number(row[6]), number(row[7])});
+            return true;
+        },
+        debug);
+    return rows;
+}
+
+static bool CompactLiveDay(MySQLConnection &mysql_connection, const char *stage, const std::string &filter, time_t day, LiveSeriesValues *previous, bool debug)
+/* Replace a day of LiveValue by its hours, or drop its repeated hours when previous is given, and record the day as done */
+{
+    const auto next = NextDay(day);
+    const auto rows = LiveDay(mysql_connection, filter, day, next, debug);
+    const auto number = [](double value) { return std::isnan(value) ? std::string("NULL") : fmt::format("{}", value); };
+    const auto succeeded = [&mysql_connection]() { return mysql_errno(mysql_connection.handle()) == 0; };
+
+    auto stored_all = mysql_connection.Begin(debug);
+    if (previous) {
+        // the value an old series had before the day, the first day of a run has not seen it yet
+        auto &before = mysql_connection.Prepare("SELECT Value FROM LiveValue WHERE InverterId=? AND MetricId=? AND DateTime < FROM_UNIXTIME(?) ORDER BY DateTime DESC LIMIT 1");
+        for (const auto &row : rows) {
+            if (previous->count({row.inverter, row.metric}) > 0)
+                continue;
+            before.Bind(0, row.inverter);
+            before.Bind(1, row.metric);
+            before.Bind(2, static_cast<long long>(day));
+            if (before.Execute(debug) && before.Fetch() && before.Column(0))
+                previous->emplace(std::make_pair(row.inverter, row.metric), strtod(before.Column(0), nullptr));
+        }
+
+        const auto repeated = RepeatedRows(rows, *previous);
+        for (std::size_t first = 0; first < repeated.size() && stored_all; first += LIVE_COMPACT_ROWS) {
+            std::string keys;
+            for (auto i = first; i < std::min(repeated.size(), first + LIVE_COMPACT_ROWS); ++i)
+                keys.append(fmt::format("{}({},{},FROM_UNIXTIME({}))", i == first ? "" : ",", repeated[i].inverter, repeated[i].metric, repeated[i].time));
+            mysql_connection.ExecuteQuery(fmt::format("DELETE FROM LiveValue WHERE (InverterId, MetricId, DateTime) IN ({})", keys), debug);
+            stored_all = succeeded();
+        }
+    } else {
+        const auto hours = CompactHours(rows);
+        if (hours.size() < rows.size()) {
+            mysql_connection.ExecuteQuery(fmt::format("DELETE FROM LiveValue WHERE {} AND DateTime >= FROM_UNIXTIME({}) AND DateTime < FROM_UNIXTIME({})", filter, day, next), debug);
+            stored_all = succeeded();
+            for (std::size_t first = 0; first < hours.size() && stored_all; first += LIVE_COMPACT_ROWS) {
+                std::string query = "INSERT INTO LiveValue ( DateTime, InverterId, MetricId, Value, Mean, Min, Max ) VALUES ";
+                for (auto i = first; i < std::min(hours.size(), first + LIVE_COMPACT_ROWS); ++i) {
+                    const auto &hour = hours[i];
+                    query.append(fmt::format("{}(FROM_UNIXTIME({}),{},{},{},{},{},{})", i == first ? "" : ",", hour.time, hour.inverter, hour.metric, hour.value, number(hour.mean),
+                                             number(hour.minimum), number(hour.maximum)));
                 }
+                mysql_connection.ExecuteQuery(query, debug);
+                stored_all = succeeded();
             }
         }
+    }
 
-        if (live_data) {
-            const auto datetime = fmt::format("{}-{:02d}-{:02d} {:02d}:{:02d}:{:02d}", year, month, day, hour, minute, second);
-            const auto query = fmt::format(R"(INSERT INTO LiveData ( DateTime, Inverter, Serial, Description, Value, Units ) VALUES ( '{}', '{}', {}, '{}', '{}', '{}'  ) ON DUPLICATE KEY UPDATE DateTime=Datetime, Inverter=VALUES(Inverter), Serial=VALUES(Serial), Description=VALUES(Description), Description=VALUES(Description), Value=VALUES(Value), Units=VALUES(Units))",
-                                           datetime, data.inverter, data.serial, data.Description, data.Value, data.Units);
-            mysql_connection.ExecuteQuery(query, debug);
+    if (stored_all) {
+        auto &done = mysql_connection.Prepare("INSERT INTO settings ( value, data ) VALUES ( ?, ? ) ON DUPLICATE KEY UPDATE data=VALUES(data)");
+        done.Bind(0, stage);
+        done.Bind(1, fmt::format("{}", next));
+        stored_all = done.Execute(debug);
+    }
+    if (!stored_all) {
+        mysql_connection.Rollback(debug);
+        return false;
+    }
+    return mysql_connection.Commit(debug);
+}
+
+void compact_live(MySQLConnection &mysql_connection, const LiveRetention &retention, time_t now, bool debug)
+/* Thin out old LiveValue rows by the retention policy, a day per transaction for at most LIVE_COMPACT_SECONDS */
+{
+    if (!retention.enabled())
+        return;
+    const auto filter = LiveSeriesFilter(mysql_connection, debug);
+    if (filter.empty())
+        return;
+
+    const auto deadline = time(nullptr) + LIVE_COMPACT_SECONDS;
+    const auto hourly_before = retention.HourlyBefore(now);
+    auto hourly = LiveCompactedTo(mysql_connection, "live_hourly", filter, debug);
+    for (; hourly && *hourly < hourly_before && time(nullptr) < deadline; *hourly = NextDay(*hourly)) {
+        if (!CompactLiveDay(mysql_connection, "live_hourly", filter, *hourly, nullptr, debug))
+            return;
+    }
+
+    // only days that are hourly already
+    if (retention.hourly_days <= 0 || !hourly)
+        return;
+    const auto changes_before = std::min(retention.ChangesBefore(now), *hourly);
+    LiveSeriesValues previous;
+    auto changes = LiveCompactedTo(mysql_connection, "live_changes", filter, debug);
+    for (; changes && *changes < changes_before && time(nullptr) < deadline; *changes = NextDay(*changes)) {
+        if (!CompactLiveDay(mysql_connection, "live_changes", filter, *changes, &previous, debug))
+            return;
+    }
+}
+
+bool insert_daydata(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, std::size_t max_rows, std::size_t max_bytes, bool debug)
+/* Store archive records in DayData, max_rows records per statement. False if a statement failed */
+{
+    // parameters of a record in the binary protocol, without the inverter name
+    static constexpr std::size_t record_bytes = 48;
+
+    // keep some room for the protocol header
+    max_bytes = std::min(max_bytes, mysql_connection.MaxAllowedPacket(debug) - 1024);
+    // a prepared statement takes at most 65535 placeholders, five per record
+    max_rows = std::clamp<std::size_t>(max_rows, 1, 65535 / 5);
+
+    const auto statement_text = [](std::size_t rows) {
+        std::string query = "INSERT INTO DayData ( DateTime, Inverter, Serial, CurrentPower, EtotalToday ) VALUES ";
+        for (std::size_t row = 0; row < rows; ++row)
+            query.append(row == 0 ? "( FROM_UNIXTIME(?),?,?,?,? )" : ",( FROM_UNIXTIME(?),?,?,?,? )");
+        query.append(" ON DUPLICATE KEY UPDATE DateTime=Datetime, Inverter=VALUES(Inverter), Serial=VALUES(Serial), CurrentPower=VALUES(CurrentPower), EtotalToday=VALUES(EtotalToday)");
+        return query;
+    };
+
+    auto stored_all = true;
+    std::size_t begin = 0;
+    while (begin < batch.size()) {
+        std::size_t end = begin;
+        std::size_t bytes = 0;
+        while (end < batch.size() && end - begin < max_rows) {
+            const auto size = record_bytes + catalog.GetString(catalog.GetSource(batch.sources[end]).inverter).size();
+            if (end > begin && bytes + size > max_bytes)
+                break;
+            bytes += size;
+            ++end;
+        }
+
+        // full statements are reused, the shorter remainder is prepared once
+        const auto rows = end - begin;
+        std::unique_ptr<MySQLStatement> remainder;
+        if (rows != max_rows)
+            remainder = mysql_connection.PrepareOnce(statement_text(rows));
+        auto &statement = remainder ? *remainder : mysql_connection.Prepare(statement_text(rows));
+
+        for (std::size_t row = 0; row < rows; ++row) {
+            const auto i = begin + row;
+            const auto source = catalog.GetSource(batch.sources[i]);
+            statement.Bind(row * 5, static_cast<long long>(batch.times[i]));
+            statement.Bind(row * 5 + 1, catalog.GetString(source.inverter));
+            statement.Bind(row * 5 + 2, source.serial);
+            statement.Bind(row * 5 + 3, static_cast<long long>(std::llround(batch.current[i])));
+            statement.Bind(row * 5 + 4, std::round(batch.energy[i] * 1000) / 1000);
+        }
+        stored_all = statement.Execute(debug) && stored_all;
+        begin = end;
+    }
+
+    return update_day_energy(mysql_connection, batch, catalog, debug) && stored_all;
+}
+
+BulkLoad bulk_load_daydata(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, bool debug)
+/* Load archive records into a staging table with LOAD DATA and merge them into DayData */
+{
+    // one tab separated line per record, the same rounding as insert_daydata
+    std::string data;
+    data.reserve(batch.size() * 48);
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto source = catalog.GetSource(batch.sources[i]);
+        fmt::format_to(std::back_inserter(data), "{}\t{}\t{}\t{}\t{:.3f}\n", batch.times[i], catalog.GetString(source.inverter), source.serial,
+                       std::llround(batch.current[i]), batch.energy[i]);
+    }
+
+    mysql_connection.ExecuteQuery("DROP TEMPORARY TABLE IF EXISTS `DayDataStage`", debug);
+    mysql_connection.ExecuteQuery(
+        "CREATE TEMPORARY TABLE `DayDataStage` ( \
+           `DateTime` datetime NOT NULL, \
+           `Inverter` varchar(30) NOT NULL, \
+           `Serial` varchar(40) NOT NULL, \
+           `CurrentPower` int(11) DEFAULT NULL, \
+           `ETotalToday` DECIMAL(10,3) DEFAULT NULL \
+           ) ENGINE=InnoDB",
+        debug);
+
+    auto result = BulkLoad::Stored;
+    if (!mysql_connection.LoadData(
+            "LOAD DATA LOCAL INFILE 'DayData' INTO TABLE `DayDataStage` FIELDS TERMINATED BY '\\t' ( @time, Inverter, Serial, CurrentPower, ETotalToday ) SET DateTime=FROM_UNIXTIME(@time)",
+            data, debug)) {
+        result = LocalInfileRefused(mysql_errno(mysql_connection.handle())) ? BulkLoad::Refused : BulkLoad::Failed;
+    } else {
+        mysql_connection.ExecuteQuery(
+            "INSERT INTO DayData ( DateTime, Inverter, Serial, CurrentPower, EtotalToday ) SELECT DateTime, Inverter, Serial, CurrentPower, ETotalToday FROM `DayDataStage` \
+             ON DUPLICATE KEY UPDATE CurrentPower=VALUES(CurrentPower), EtotalToday=VALUES(EtotalToday)",
+            debug);
+        if (mysql_errno(mysql_connection.handle()) != 0)
+            result = BulkLoad::Failed;
+    }
+    mysql_connection.ExecuteQuery("DROP TEMPORARY TABLE IF EXISTS `DayDataStage`", debug);
+
+    return result;
+}
+
+bool update_day_energy(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, bool debug)
+/* Widen the per day counter range and peak power in DayEnergy by the records of a batch and sum the months it touched again */
+{
+    // the energy counter only grows, so the smallest value is the start of the day.
+    // PeakTime is assigned before PeakPower, MySQL evaluates left to right
+    auto &upsert = mysql_connection.Prepare(
+        "INSERT INTO DayEnergy ( Date, Inverter, Serial, EStart, EEnd, PeakPower, PeakTime ) VALUES ( DATE(FROM_UNIXTIME(?)),?,?,?,?,?,FROM_UNIXTIME(?) ) \
+         ON DUPLICATE KEY UPDATE EStart=LEAST(IFNULL(EStart,VALUES(EStart)),VALUES(EStart)), EEnd=GREATEST(IFNULL(EEnd,VALUES(EEnd)),VALUES(EEnd)), \
+         PeakTime=IF(VALUES(PeakPower) > IFNULL(PeakPower,-1) OR (VALUES(PeakPower) = PeakPower AND VALUES(PeakTime) < PeakTime), VALUES(PeakTime), PeakTime), \
+         PeakPower=GREATEST(IFNULL(PeakPower,VALUES(PeakPower)),VALUES(PeakPower))");
+    // a late record changes its month like any other, so the month is summed again from its days
+    auto &month_upsert = mysql_connection.Prepare(
+        "INSERT INTO MonthEnergy ( Month, Inverter, Serial, Energy, Days, PeakPower, PeakTime ) \
+         SELECT ?, Inverter, Serial, SUM(EEnd-EStart), COUNT(*), MAX(PeakPower), \
+         ( SELECT PeakTime FROM DayEnergy WHERE Inverter=? AND Serial=? AND Date BETWEEN ? AND ? ORDER BY PeakPower DESC, Date ASC LIMIT 1 ) \
+         FROM DayEnergy WHERE Inverter=? AND Serial=? AND Date BETWEEN ? AND ? GROUP BY Inverter, Serial \
+         ON DUPLICATE KEY UPDATE Energy=VALUES(Energy), Days=VALUES(Days), PeakPower=VALUES(PeakPower), PeakTime=VALUES(PeakTime)");
+
+    const auto days = SummariseDays(batch);
+    auto stored_all = true;
+    for (const auto &day : days) {
+        const auto source = catalog.GetSource(day.source);
+        upsert.Bind(0, static_cast<long long>(day.time));
+        upsert.Bind(1, catalog.GetString(source.inverter));
+        upsert.Bind(2, source.serial);
+        upsert.Bind(3, std::round(day.start * 1000) / 1000);
+        upsert.Bind(4, std::round(day.end * 1000) / 1000);
+        upsert.Bind(5, static_cast<long long>(std::llround(day.peak)));
+        upsert.Bind(6, static_cast<long long>(day.peak_time));
+        stored_all = upsert.Execute(debug) && stored_all;
+    }
+    for (const auto &month : SummariseMonths(days)) {
+        const auto source = catalog.GetSource(month.source);
+        const auto &inverter = catalog.GetString(source.inverter);
+        month_upsert.Bind(0, month.first);
+        for (std::size_t where : {1, 5}) {
+            month_upsert.Bind(where, inverter);
+            month_upsert.Bind(where + 1, source.serial);
+            month_upsert.Bind(where + 2, month.first);
+            month_upsert.Bind(where + 3, month.last);
+        }
+        stored_all = month_upsert.Execute(debug) && stored_all;
+    }
+
+    return stored_all;
+}
+
+bool update_sync_state(MySQLConnection &mysql_connection, const char *column, const std::unordered_map<SourceId, time_t> &latest, const SampleCatalog &catalog, bool debug)
+/* Move a column of SyncState forward to the newest record of every inverter, never back */
+{
+    auto &upsert = mysql_connection.Prepare(fmt::format(
+        "INSERT INTO SyncState ( Inverter, Serial, {0} ) VALUES ( ?, ?, FROM_UNIXTIME(?) ) ON DUPLICATE KEY UPDATE {0}=GREATEST(IFNULL({0}, VALUES({0})), VALUES({0}))", column));
+    auto stored_all = true;
+    for (const auto &[id, time] : latest) {
+        const auto source = catalog.GetSource(id);
+        upsert.Bind(0, catalog.GetString(source.inverter));
+        upsert.Bind(1, source.serial);
+        upsert.Bind(2, static_cast<long long>(time));
+        stored_all = upsert.Execute(debug) && stored_all;
+    }
+    return stored_all;
+}
+
+std::vector<MonthTotal> month_totals(MySQLConnection &mysql_connection, const std::string &from, const std::string &to, bool debug)
+/* Rows of MonthEnergy from from to to */
+{
+    auto &query = mysql_connection.Prepare(QUERY_MONTH_TOTALS);
+    query.Bind(0, from);
+    query.Bind(1, to);
+
+    std::vector<MonthTotal> months;
+    if (!query.Execute(debug))
+        return months;
+    while (query.Fetch()) {
+        months.push_back({query.Column(0), query.Column(1), strtoull(query.Column(2), nullptr, 10), query.Column(3) ? strtod(query.Column(3), nullptr) : 0.0,
+                          query.Column(4) ? atoi(query.Column(4)) : 0, query.Column(5) ? atoi(query.Column(5)) : 0, query.Column(6) ? query.Column(6) : ""});
+    }
+    return months;
+}
+
+TimeRangeList daydata_gaps(MySQLConnection &mysql_connection, unsigned long long serial, time_t from, time_t to, bool debug)
+/* Find missing 5 minute slots of an inverter in DayData */
+{
+    const auto query = fmt::format(QUERY_DAYDATA_SLOTS, serial, from, to);
+
+    std::vector<time_t> timestamps;
+    MYSQL_ROW row;
+    auto result = mysql_connection.ExecuteQuery(query, debug);
+    while (result.res && (row = mysql_fetch_row(result.res)))
+        timestamps.push_back(atol(row[0]));
+
+    return FindArchiveGaps(timestamps);
+}
+
+bool insert_monthdata(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, bool debug)
+/* Store the daily totals of the month archive in MonthData */
+{
+    auto &insert = mysql_connection.Prepare("INSERT INTO MonthData ( Date, Inverter, Serial, ETotal, EDay ) VALUES ( DATE(FROM_UNIXTIME(?)),?,?,?,? ) ON DUPLICATE KEY UPDATE ETotal=VALUES(ETotal), EDay=VALUES(EDay)");
+    auto stored_all = true;
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto source = catalog.GetSource(batch.sources[i]);
+        insert.Bind(0, static_cast<long long>(batch.times[i]));
+        insert.Bind(1, catalog.GetString(source.inverter));
+        insert.Bind(2, source.serial);
+        insert.Bind(3, std::round(batch.energy[i] * 1000) / 1000);
+        insert.Bind(4, std::round(batch.current[i] * 1000.0) / 1000);
+        stored_all = insert.Execute(debug) && stored_all;
+    }
+
+    return stored_all;
+}
+
+std::string monthdata_watermark(MySQLConnection &mysql_connection, const char *inverter, unsigned long long serial, bool debug)
+/* Last day stored in MonthData for an inverter, empty if there is none */
+{
+    auto &query = mysql_connection.Prepare(QUERY_MONTH_WATERMARK);
+    query.Bind(0, inverter);
+    query.Bind(1, serial);
+
+    if (query.Execute(debug) && query.Fetch() && query.Column(0))
+        return query.Column(0);
+
+    return {};
+}
+
+static std::string BindSample(std::string_view query, std::initializer_list<std::string_view> values = {})
+/* Fill the ? of a prepared query with the given literals in order, '0' for the rest */
+{
+    std::string filled;
+    auto value = values.begin();
+    for (auto c : query) {
+        if (c != '?')
+            filled += c;
+        else if (value != values.end())
+            filled += *value++;
+        else
+            filled += "'0'";
+    }
+    return filled;
+}
+
+void explain_queries(MySQLConnection &mysql_connection, bool debug)
+/* Print the query plan of every built-in query and point out full table scans */
+{
+    const time_t now = time(nullptr);
+    const std::pair<const char *, std::string> queries[] = {
+        {"sync state", QUERY_SYNC_STATES},
+        {"DayData slots", fmt::format(QUERY_DAYDATA_SLOTS, 0, now - 86400, now)},
+        {"PVOutput pending", BindSample(QUERY_PVOUTPUT_PENDING, {"0", "'1970-01-01 00:00:00'", "''", "'0'", "30"})},
+        {"latest LiveValue", QUERY_LATEST_LIVE},
+        {"latest metric", BindSample(QUERY_LATEST_METRIC)},
+        {"MonthData watermark", BindSample(QUERY_MONTH_WATERMARK)},
+        {"todays Almanac", QUERY_TODAYS_ALMANAC},
+        {"after sunrise", QUERY_AFTER_SUNRISE},
+        {"after sunset", QUERY_AFTER_SUNSET},
+        {"repost days", fmt::format(QUERY_REPOST_DAYS, "99991231", 100)},
+        {"month totals", BindSample(QUERY_MONTH_TOTALS)},
+    };
+
+    for (const auto &[name, query] : queries) {
+        fmt::print("\n{}\n{}\n", name, query);
+
+        auto result = mysql_connection.ExecuteQuery("EXPLAIN " + query, debug);
+        if (!result.res)
+            continue;
+
+        const auto fields = mysql_num_fields(result.res);
+        const auto *field = mysql_fetch_fields(result.res);
+        int table_column = -1;
+        int type_column = -1;
+        for (unsigned int i = 0; i < fields; i++) {
+            fmt::print("{}{}", i ? "\t" : "", field[i].name);
+            if (strcmp(field[i].name, "table") == 0) table_column = i;
+            if (strcmp(field[i].name, "type") == 0) type_column = i;
+        }
+        fmt::print("\n");
+
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(result.res))) {
+            for (unsigned int i = 0; i < fields; i++)
+                fmt::print("{}{}", i ? "\t" : "", row[i] ? row[i] : "NULL");
+            fmt::print("\n");
+
+            if (type_column >= 0 && row[type_column] && strcmp(row[type_column], "ALL") == 0)
+                fmt::print("Warning: full scan of {}\n", table_column >= 0 && row[table_column] ? row[table_column] : "?");
         }
     }
 }
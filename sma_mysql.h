@@ -1,7 +1,22 @@
+#ifndef SMA_BLUETOOTH_SMA_MYSQL_H
+#define SMA_BLUETOOTH_SMA_MYSQL_H
+
+#include <mysql/errmsg.h>
 #include <mysql/mysql.h>
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
+#include "archive_gaps.h"
+#include "live_cache.h"
+#include "live_retention.h"
+#include "query_stats.h"
+#include "sample_batch.h"
 #include "sma_struct.h"
 
 struct MySQLResult {
@@ -14,19 +29,159 @@ struct MySQLResult {
     MYSQL_RES *res;
 };
 
+#define SCHEMA "12" /* Current database schema */
+
+class MySQLConnection;
+
+/*
+ * Server side prepared statement. Parameters are bound by position, result
+ * columns are returned as strings the same way MYSQL_ROW does. The statement
+ * is prepared again after its connection had to reconnect.
+ */
+class MySQLStatement
+{
+public:
+    MySQLStatement(MySQLConnection &connection, std::string query);
+    ~MySQLStatement();
+    MySQLStatement(const MySQLStatement &) = delete;
+    MySQLStatement &operator=(const MySQLStatement &) = delete;
+
+    [[nodiscard]] bool valid() const { return m_stmt != nullptr; }
+    void Bind(std::size_t index, long long value);
+    void Bind(std::size_t index, unsigned long long value);
+    void Bind(std::size_t index, double value);
+    void Bind(std::size_t index, std::string_view value);
+    void BindNull(std::size_t index);
+    // run with the bound parameters, any result set is buffered for Fetch
+    bool Execute(bool debug);
+    // advance to the next result row, false after the last one
+    bool Fetch();
+    // column of the current row, nullptr for NULL
+    [[nodiscard]] const char *Column(std::size_t index) const;
+    // AUTO_INCREMENT value of the last insert
+    [[nodiscard]] unsigned long long insert_id() const { return m_stmt ? mysql_stmt_insert_id(m_stmt) : 0; }
+
+private:
+    using null_flag = std::remove_pointer_t<decltype(MYSQL_BIND::is_null)>;
+
+    void Prepare();
+    bool Run();
+    bool Store(bool debug);
+
+    struct Parameter {
+        long long integer;
+        double real;
+        std::string text;
+        unsigned long length;
+    };
+    struct ResultColumn {
+        std::vector<char> buffer;
+        unsigned long length;
+        null_flag is_null;
+    };
+
+    MySQLConnection &m_connection;
+    MYSQL_STMT *m_stmt{nullptr};
+    unsigned m_generation{0};
+    std::string m_query;
+    std::vector<MYSQL_BIND> m_param_binds;
+    std::vector<Parameter> m_params;
+    std::vector<MYSQL_BIND> m_result_binds;
+    std::vector<ResultColumn> m_columns;
+};
+
+/*
+ * One connection is shared by everything running on a thread. Queries that
+ * find the server gone reconnect once and are retried. Failing to connect
+ * throws std::runtime_error.
+ */
 class MySQLConnection
 {
 public:
+    // database may be nullptr to connect without selecting one
     MySQLConnection(const char *server, const char *user, const char *password, const char *database);
     ~MySQLConnection();
+    MySQLConnection(const MySQLConnection &) = delete;
+    MySQLConnection &operator=(const MySQLConnection &) = delete;
+
+    // check the connection before a burst of work, false if the server can not be reached
+    bool Ping();
+    bool Reconnect();
+    // inside a transaction a lost connection fails the statement instead of
+    // reconnecting, the rest would run in autocommit. Commit and Rollback
+    // connect again for the next transaction.
+    bool Begin(bool debug);
+    bool Commit(bool debug);
+    void Rollback(bool debug);
+    [[nodiscard]] bool in_transaction() const { return m_transaction; }
+    [[nodiscard]] MYSQL *handle() const { return m_conn; }
+    // changes every time the connection is established again
+    [[nodiscard]] unsigned generation() const { return m_generation; }
+    // every query and statement run on this connection is timed here
+    [[nodiscard]] QueryStats &query_stats() { return m_query_stats; }
+    [[nodiscard]] const QueryStats &query_stats() const { return m_query_stats; }
+
     MySQLResult ExecuteQuery(const char *query, bool debug);
     MySQLResult ExecuteQuery(const std::string &query, bool debug);
+    // rows are handed to row_fn as they arrive from the server instead of being
+    // buffered, row_fn returns false to stop early. No other query may run on
+    // this connection until ForEachRow returns.
+    bool ForEachRow(const std::string &query, const std::function<bool(MYSQL_ROW)> &row_fn, bool debug);
+    // run a LOAD DATA LOCAL INFILE statement with data as the file, whatever
+    // file name it asks for. False if the server refuses local loads.
+    bool LoadData(const std::string &statement, std::string_view data, bool debug);
+    // largest statement the server accepts
+    std::size_t MaxAllowedPacket(bool debug);
+    // prepared once per connection and reused for every later call with the same text
+    MySQLStatement &Prepare(const std::string &query);
+    // prepared for a single use
+    std::unique_ptr<MySQLStatement> PrepareOnce(const std::string &query);
 
 private:
-    MYSQL *m_conn;
+    bool Connect();
+    static int InfileInit(void **handle, const char *name, void *connection);
+    static int InfileRead(void *connection, char *buffer, unsigned int length);
+    static void InfileEnd(void *connection);
+    static int InfileError(void *connection, char *message, unsigned int length);
+    bool Send(const char *query, std::size_t length, bool debug);
+    MySQLResult Query(const char *query, std::size_t length, bool debug);
+
+    std::string m_server;
+    std::string m_user;
+    std::string m_password;
+    std::string m_database;
+    MYSQL *m_conn{nullptr};
+    unsigned m_generation{0};
+    bool m_transaction{false};
+    std::size_t m_max_allowed_packet{0};
+    QueryStats m_query_stats;
+    // the only thing ever sent for LOCAL INFILE, empty outside LoadData
+    std::string_view m_infile;
+    std::unordered_map<std::string, std::unique_ptr<MySQLStatement>> m_statements;
+};
+
+int install_mysql_tables(MySQLConnection &, const ConfType *, const char *, bool debug);
+void update_mysql_tables(MySQLConnection &, bool debug);
+int check_schema(MySQLConnection &, const char *, bool debug);
+void maintain_partitions(MySQLConnection &mysql_connection, bool debug);
+bool live_mysql(MySQLConnection &, bool debug, const LiveBatch &, const SampleCatalog &, LiveValueCache &);
+void prime_live_cache(MySQLConnection &mysql_connection, LiveValueCache &cache, bool debug);
+void compact_live(MySQLConnection &mysql_connection, const LiveRetention &retention, time_t now, bool debug);
+bool insert_daydata(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, std::size_t max_rows, std::size_t max_bytes, bool debug);
+enum class BulkLoad {
+    Stored,
+    Refused,  // the server or the client does not allow LOAD DATA LOCAL
+    Failed,
 };
+// nothing has been stored unless Stored. The rollups are left to update_day_energy
+BulkLoad bulk_load_daydata(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, bool debug);
+bool update_day_energy(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, bool debug);
+// column is LastArchive or LastLive
+bool update_sync_state(MySQLConnection &mysql_connection, const char *column, const std::unordered_map<SourceId, time_t> &latest, const SampleCatalog &catalog, bool debug);
+std::vector<MonthTotal> month_totals(MySQLConnection &mysql_connection, const std::string &from, const std::string &to, bool debug);
+bool insert_monthdata(MySQLConnection &mysql_connection, const ArchiveBatch &batch, const SampleCatalog &catalog, bool debug);
+std::string monthdata_watermark(MySQLConnection &mysql_connection, const char *inverter, unsigned long long serial, bool debug);
+void explain_queries(MySQLConnection &mysql_connection, bool debug);
+TimeRangeList daydata_gaps(MySQLConnection &mysql_connection, unsigned long long serial, time_t from, time_t to, bool debug);
 
-int install_mysql_tables(ConfType *, FlagType *, const char *);
-void update_mysql_tables(ConfType *, FlagType *);
-int check_schema(ConfType *, FlagType *, const char *);
-void live_mysql(ConfType, bool debug, const LiveDataList &);
+#endif  //SMA_BLUETOOTH_SMA_MYSQL_H
@@ -0,0 +1,43 @@
+#ifndef SMA_BLUETOOTH_SMA_QUERIES_H
+#define SMA_BLUETOOTH_SMA_QUERIES_H
+
+/*
+ * Queries run on every cycle. They are kept together so --explain checks
+ * exactly the text the tool sends. {} are filled with fmt::format, ? are
+ * prepared statement parameters.
+ */
+
+// sync state of every inverter, the automatic date range starts there
+constexpr char QUERY_SYNC_STATES[] = "SELECT Inverter, Serial, DATE_FORMAT( LastArchive, \"%Y-%m-%d %H:%i:%S\" ), DATE_FORMAT( LastLive, \"%Y-%m-%d %H:%i:%S\" ), "
+                                     "DATE_FORMAT( LastUpload, \"%Y-%m-%d %H:%i:%S\" ) FROM SyncState";
+
+// stored five minute slots of an inverter: serial, from, to
+// Serial is a varchar, an unquoted number would be compared as one and skip SerialDateTime
+constexpr char QUERY_DAYDATA_SLOTS[] = "SELECT UNIX_TIMESTAMP(DateTime) FROM DayData WHERE Serial='{}' AND DateTime BETWEEN FROM_UNIXTIME({}) AND FROM_UNIXTIME({}) ORDER BY DateTime ASC";
+
+// DayData records not yet sent to PVOutput in key order: power cap, the DateTime, Inverter and Serial to continue after, limit
+constexpr char QUERY_PVOUTPUT_PENDING[] = R"(SELECT DATE_FORMAT(dd.DateTime,'%Y%m%d'), DATE_FORMAT(dd.DateTime,'%H:%i'), ROUND((dd.ETotalToday-de.EStart)*1000), LEAST(dd.CurrentPower, ?), dd.DateTime, dd.Inverter, dd.Serial FROM DayData as dd join DayEnergy as de on de.Inverter=dd.Inverter and de.Serial=dd.Serial and de.Date=DATE(dd.DateTime) WHERE dd.DateTime>=Date_Sub(CURDATE(),INTERVAL 13 DAY) and (dd.DateTime, dd.Inverter, dd.Serial)>(?, ?, ?) and dd.PVOutput IS NULL and dd.CurrentPower>0 ORDER BY dd.DateTime ASC, dd.Inverter ASC, dd.Serial ASC LIMIT ?)";
+
+// latest value of every inverter and metric
+constexpr char QUERY_LATEST_LIVE[] = "SELECT inv.Inverter, inv.Serial, m.Description, m.Kind, m.Decimals, lv.Value, t.Text FROM LiveValue AS lv "
+                                     "JOIN ( SELECT InverterId, MetricId, MAX(DateTime) AS DateTime FROM LiveValue GROUP BY InverterId, MetricId ) AS latest USING ( InverterId, MetricId, DateTime ) "
+                                     "JOIN Inverters AS inv ON inv.id=lv.InverterId JOIN Metric AS m ON m.id=lv.MetricId LEFT JOIN MetricText AS t ON m.Kind=1 AND t.id=lv.Value";
+
+// latest value of a metric of an inverter: inverter, serial, description
+constexpr char QUERY_LATEST_METRIC[] = "SELECT lv.Value FROM LiveValue AS lv JOIN Inverters AS inv ON inv.id=lv.InverterId JOIN Metric AS m ON m.id=lv.MetricId WHERE inv.Inverter=? and inv.Serial=? and m.Description=? ORDER BY lv.DateTime DESC LIMIT 1";
+
+// last day in MonthData of an inverter: inverter, serial
+constexpr char QUERY_MONTH_WATERMARK[] = "SELECT DATE_FORMAT( MAX(Date), \"%Y-%m-%d 00:00:00\" ) FROM MonthData WHERE Inverter=? AND Serial=?";
+
+constexpr char QUERY_TODAYS_ALMANAC[] = "SELECT sunrise FROM Almanac WHERE date=DATE_FORMAT( NOW(), \"%Y-%m-%d\" ) ";
+constexpr char QUERY_AFTER_SUNRISE[] = "SELECT if(sunrise < NOW(),1,0) FROM Almanac WHERE date= DATE_FORMAT( NOW(), \"%Y-%m-%d\")";
+// the newest DateTime is read from the end of the primary key
+constexpr char QUERY_AFTER_SUNSET[] = "SELECT IFNULL(( SELECT MAX(DateTime) FROM DayData ) > sunset, 0) FROM Almanac WHERE date=DATE(NOW())";
+
+// energy of all inverters on the {1} finished days before {0}, newest first, for sma_repost
+constexpr char QUERY_REPOST_DAYS[] = R"(SELECT DATE_FORMAT( Date, "%Y%m%d" ), round(SUM(EEnd*1000-EStart*1000),0) FROM DayEnergy WHERE Date < CURDATE() AND Date < '{0}' GROUP BY Date ORDER BY Date DESC LIMIT {1})";
+
+// MonthEnergy rows of the months from ? to ?, YYYY-MM-DD
+constexpr char QUERY_MONTH_TOTALS[] = "SELECT DATE_FORMAT( Month, \"%Y-%m\" ), Inverter, Serial, Energy, Days, PeakPower, DATE_FORMAT( PeakTime, \"%Y-%m-%d %H:%i:%S\" ) FROM MonthEnergy WHERE Month BETWEEN ? AND ? ORDER BY Month, Inverter, Serial";
+
+#endif  //SMA_BLUETOOTH_SMA_QUERIES_H
@@ -19,7 +19,6 @@
 #define H_SMASTRUCT
 
 #include <ctime>
-#include <vector>
 
 #define DATELENGTH 20
 
@@ -33,30 +32,9 @@ struct ReturnType {
     int datalength;
     int recordgap;
     int persistent;
+    int window; /* seconds live values are aggregated over before storing, 0 each */
 };
 
-struct ArchDataType {
-    time_t date;
-    char inverter[30];
-    unsigned long long serial;
-    float accum_value;
-    float current_value;
-};
-
-using ArchDataList = std::vector<ArchDataType>;
-
-struct LiveDataType {
-    time_t date;
-    char inverter[30];
-    unsigned long long serial;
-    char Description[30];
-    char Value[30];
-    char Units[30];
-    int Persistent;
-};
-
-using LiveDataList = std::vector<LiveDataType>;
-
 struct ConfType {
     char BTAddress[20];           /*--address  	-a 	*/
     int bt_timeout;               /*--timeout  	-t 	*/
@@ -82,6 +60,21 @@ struct ConfType {
     unsigned int num_return_keys; /* number of items in list */
     char datefrom[DATELENGTH];    /* is system using a daterange */
     char dateto[DATELENGTH];      /* is system using a daterange */
+    int gap_scan_days;            /* days of DayData checked for missing records */
+    char ArchiveFile[80];         /*--archivefile	raw archive capture to decode */
+    int daydata_batch_rows;       /* DayData rows per INSERT statement */
+    int daydata_batch_bytes;      /* upper limit of a DayData INSERT statement */
+    char LiveCacheFile[80];       /* snapshot of the latest LiveData values */
+    int slow_query_ms;            /* queries taking longer are logged, 0 never */
+    int bulk_load_days;           /* DayData backlog loaded with LOAD DATA, 0 never */
+    char SQLiteFile[80];          /* store in this SQLite file instead of MySQL */
+    char SeriesDir[80];           /* directory of the local time series history */
+    char WalDir[80];              /* write-ahead log of batches waiting for the database */
+    int ring_hours;               /* hours of live values kept in memory, 0 none */
+    char LiveWindowFile[80];      /* open live value windows between runs */
+    int live_raw_days;            /* days LiveValue rows are kept as stored, 0 always */
+    int live_hourly_days;         /* days hourly LiveValue rows are kept before only changes are, 0 always */
+    char QueryMetric[80];         /*--metric	series printed by query */
 };
 
 struct FlagType {
@@ -91,9 +84,13 @@ struct FlagType {
     unsigned int location;  /* is system using a daterange */
     unsigned int test;      /* is system using a daterange */
     unsigned int mysql;     /* is system using a daterange */
+    unsigned int storage;   /* is a database, MySQL or SQLite, configured */
     unsigned int file;      /* is system using a daterange */
     unsigned int post;      /* is system using a daterange */
     unsigned int repost;    /* is system using a daterange */
+    unsigned int explain;   /* print the query plans and exit */
+    unsigned int query;     /* print a series of the local history and exit */
+    unsigned int months;    /* print the monthly totals and exit */
 };
 
 struct UnitType {
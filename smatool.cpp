@@ -21,6 +21,11 @@
 
 #include <curl/curl.h>
 #include <fmt/format.h>
+#if __has_include(<fmt/chrono.h>)
+#include <fmt/chrono.h>
+#else
+#include <fmt/time.h>
+#endif
 #include <libxml2/libxml/parser.h>
 #include <libxml2/libxml/xpath.h>
 #include <sys/socket.h>
@@ -29,15 +34,29 @@
 
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "almanac.h"
+#include "archive_decoder.h"
+#include "storage_writer.h"
 #include "bt_connection.h"
+#include "live_aggregator.h"
 #include "repost.h"
 #include "sb_commands.h"
-#include "sma_mysql.h"
+#include "series_ring.h"
+#include "series_store.h"
+#include "storage.h"
 #include "stream_handling.h"
 
 /*
@@ -49,7 +68,7 @@ typedef u_int16_t u16;
 #define PPPINITFCS16 0xffff /* Initial FCS value    */
 #define PPPGOODFCS16 0xf0b8 /* Good final FCS value */
 #define ASSERT(x) assert(x)
-#define SCHEMA "4" /* Current database schema */
+#define PVOUTPUT_BATCH 30 /* statuses pvoutput.org accepts in one batch */
 
 const char *accepted_strings[] = {
     "$END",
@@ -83,7 +102,8 @@ const char *accepted_strings[] = {
     "$DATA",     /*Data string */
     "$MYSUSYID",
     "$MYSERIAL",
-    "$LOGIN"};
+    "$LOGIN",
+    "$ARCHIVEDATA2"};
 
 static u16 fcstab[256] = {
     0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
@@ -811,20 +831,17 @@ unsigned char *get_timezone_in_seconds(FlagType *flag, unsigned char *tzhex)
     return tzhex;
 }
 
-int auto_set_dates(ConfType *conf, FlagType *flag)
+int auto_set_dates(ConfType *conf, FlagType *flag, Storage *storage)
 /*  If there are no dates set - get last updated date and go from there to NOW */
 {
-    if (flag->mysql == 1) {
-        auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
-        //Get last updated value
-        const auto query = "SELECT DATE_FORMAT( DateTime, \"%Y-%m-%d %H:%i:%S\" ) FROM DayData WHERE 1 ORDER BY DateTime DESC LIMIT 1";
-
-        MYSQL_ROW row;
-        if (auto result = mysql_connection.ExecuteQuery(query, flag->debug);
-            (row = mysql_fetch_row(result.res)))  //if there is a result, update the row
-        {
-            strcpy(conf->datefrom, row[0]);
+    if (storage) {
+        // the inverter is not known before login, so start where the one furthest behind stopped
+        std::string oldest;
+        for (const auto &state : storage->SyncStates()) {
+            if (!state.last_archive.empty() && (oldest.empty() || state.last_archive < oldest))
+                oldest = state.last_archive;
         }
+        snprintf(conf->datefrom, DATELENGTH, "%s", oldest.c_str());
     }
 
     time_t curtime = time(nullptr);  //get time in seconds since epoch (1/1/1970)
@@ -846,33 +863,168 @@ int auto_set_dates(ConfType *conf, FlagType *flag)
     return 1;
 }
 
-int is_light(ConfType *conf, FlagType *flag)
-/*  Check if all data done and past sunset or before sunrise */
+void set_inverter_dates(Storage &storage, ConfType *conf, FlagType *flag, UnitType *unit)
+/*  Start the automatic date range where the archive of this inverter stopped */
 {
-    bool light = true;
+    unsigned long long inverter_serial = (unit->Serial[0] << 24) + (unit->Serial[1] << 16) + (unit->Serial[2] << 8) + unit->Serial[3];
+    for (const auto &state : storage.SyncStates()) {
+        if (state.serial != inverter_serial || state.last_archive.empty())
+            continue;
 
-    auto mysql_connection = MySQLConnection(conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
-    //Get Start of day value
+        snprintf(conf->datefrom, DATELENGTH, "%s", state.last_archive.c_str());
+        if (flag->verbose == 1)
+            fmt::print("Archive of {} from {}\n", inverter_serial, conf->datefrom);
+        break;
+    }
+}
 
-    MYSQL_ROW row;
-    if (auto result = mysql_connection.ExecuteQuery("SELECT if(sunrise < NOW(),1,0) FROM Almanac WHERE date= DATE_FORMAT( NOW(), \"%Y-%m-%d\")", flag->debug);
-        (row = mysql_fetch_row(result.res)))  //if there is a result, update the row
-    {
-        if (atoi((char *)row[0]) == 0) light = false;
+void find_daydata_gaps(Storage &storage, ConfType *conf, FlagType *flag, UnitType *unit, TimeRangeList &gaps)
+/*  Look for missing records in the DayData history before the requested range */
+{
+    tm tm{};
+    if (strptime(conf->datefrom, "%Y-%m-%d %H:%M:%S", &tm) == nullptr)
+        return;
+    tm.tm_isdst = -1;
+    const time_t to = mktime(&tm);
+    const time_t from = to - conf->gap_scan_days * 86400;
+
+    unsigned long long inverter_serial = (unit->Serial[0] << 24) + (unit->Serial[1] << 16) + (unit->Serial[2] << 8) + unit->Serial[3];
+    const auto found = storage.DayDataGaps(inverter_serial, from, to);
+    if (flag->verbose == 1)
+        fmt::print("{} gaps in DayData during the last {} days\n", found.size(), conf->gap_scan_days);
+
+    gaps.insert(gaps.end(), found.begin(), found.end());
+}
+
+bool needs_bulk_load(ConfType *conf)
+/*  True if the requested range reaches back at least BulkLoadDays */
+{
+    if (conf->bulk_load_days <= 0)
+        return false;
+
+    tm tm{};
+    if (strptime(conf->datefrom, "%Y-%m-%d %H:%M:%S", &tm) == nullptr)
+        return false;
+    tm.tm_isdst = -1;
+
+    return time(nullptr) - mktime(&tm) >= conf->bulk_load_days * 86400L;
+}
+
+LiveBatch aggregate_live(ConfType *conf, FlagType *flag, const LiveBatch &live_batch, const SampleCatalog &catalog)
+/*  The live values to store, windowed metrics as the windows they complete */
+{
+    LiveAggregator aggregator(conf->returnkeylist, conf->num_return_keys);
+    const auto carry = strlen(conf->LiveWindowFile) > 0;
+    if (carry)
+        aggregator.Load(conf->LiveWindowFile);
+
+    LiveBatch stored;
+    aggregator.Aggregate(live_batch, catalog, stored);
+    // without a state file every window is stored at the end of the run
+    aggregator.Flush(carry ? time(nullptr) : std::numeric_limits<time_t>::max(), stored);
+    if (carry && !aggregator.Save(conf->LiveWindowFile))
+        fmt::print(stderr, "Error! Could not write {}\n", conf->LiveWindowFile);
+
+    if (flag->verbose == 1)
+        fmt::print("{} live values stored as {} rows, {} windows open\n", live_batch.size(), stored.size(), aggregator.open());
+    return stored;
+}
+
+void sync_month_archive(Storage &storage, FlagType *flag, UnitType *unit, SessionData &session_data)
+/*  Get the daily totals added to the month archive since the last stored day */
+{
+    unsigned long long inverter_serial = (unit->Serial[0] << 24) + (unit->Serial[1] << 16) + (unit->Serial[2] << 8) + unit->Serial[3];
+
+    auto from = storage.MonthDataWatermark(unit->Inverter, inverter_serial);
+    if (from.empty())
+        from = "2000-01-01 00:00:00";
+    if (flag->verbose == 1)
+        fmt::print("Month archive from {}\n", from);
+
+    InverterMonthArchive(from.c_str(), session_data);
+
+    if (session_data.storageWriter)
+        session_data.storageWriter->PushMonthArchive(std::move(session_data.monthBatch));
+    else
+        storage.StoreMonthData(session_data.monthBatch, session_data.catalog);
+    session_data.monthBatch.clear();
+}
+
+int query_series(ConfType *conf, FlagType *flag)
+/*  Print one metric of the local history, the last day if no dates are given */
+{
+    if (strlen(conf->SeriesDir) == 0) {
+        fmt::print(stderr, "Error! SeriesDir is not set\n");
+        return -1;
+    }
+    std::optional<SeriesStore> series;
+    try {
+        series.emplace(conf->SeriesDir);
+    } catch (const std::runtime_error &e) {
+        fmt::print(stderr, "Error! Could not open the history: {}\n", e.what());
+        return -1;
     }
 
-    if (light) {
-        const auto query = "SELECT if( dd.datetime > al.sunset,1,0) FROM DayData as dd left join Almanac as al on al.date=DATE(dd.datetime) and al.date=DATE(NOW()) WHERE 1 ORDER BY dd.datetime DESC LIMIT 1";
+    const auto metric = series->FindMetric(conf->QueryMetric);
+    if (!metric) {
+        fmt::print(stderr, "Unknown metric '{}', the history has\n", conf->QueryMetric);
+        for (const auto &name : series->metrics())
+            fmt::print(stderr, "  {}\n", name);
+        return -1;
+    }
 
-        if (auto result = mysql_connection.ExecuteQuery(query, flag->debug); (row = mysql_fetch_row(result.res)))  //if there is a result, update the row
-        {
-            if (atoi((char *)row[0]) == 1) light = false;
-        }
+    const auto parse_date = [](const char *date, time_t fallback) {
+        tm tm{};
+        if (strlen(date) == 0 || strptime(date, "%Y-%m-%d %H:%M:%S", &tm) == nullptr)
+            return fallback;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    };
+    const time_t to = parse_date(conf->dateto, time(nullptr));
+    const time_t from = parse_date(conf->datefrom, to - 86400);
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto found = series->Query(from, to, *metric, [](const SeriesRecord &record) {
+        const auto time = static_cast<time_t>(record.time);
+        fmt::print("{:%Y-%m-%d %H:%M:%S} {} {}\n", *std::localtime(&time), record.serial, record.value);
+    });
+    if (flag->verbose == 1)
+        fmt::print("{} records in {} ms\n", found, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+    return 0;
+}
+
+int print_months(ConfType *conf, Storage &storage)
+/*  Print the monthly energy totals, all months if no dates are given */
+{
+    // whole months, only the year and month of the dates are used
+    const std::string from = strlen(conf->datefrom) >= 7 ? std::string(conf->datefrom).substr(0, 7) + "-01" : "0000-01-01";
+    const std::string to = strlen(conf->dateto) >= 7 ? std::string(conf->dateto).substr(0, 7) + "-01" : "9999-12-01";
+
+    fmt::print("{:<8} {:<20} {:>12} {:>12} {:>5} {:>10} {}\n", "Month", "Inverter", "Serial", "Energy kWh", "Days", "Peak W", "Peak Time");
+    for (const auto &month : storage.MonthTotals(from, to))
+        fmt::print("{:<8} {:<20} {:>12} {:>12.3f} {:>5} {:>10} {}\n", month.month, month.inverter, month.serial, month.energy, month.days, month.peak_power, month.peak_time);
+    return 0;
+}
+
+int decode_archive_file(ConfType *conf, FlagType *flag)
+/*  Decode a file of raw 12 byte archive records, e.g. reassembled from a capture */
+{
+    std::ifstream file(conf->ArchiveFile, std::ios::binary);
+    if (!file) {
+        fmt::print(stderr, "Error! Could not open file {}\n", conf->ArchiveFile);
+        return -1;
     }
-    if (flag->debug == 1)
-        fmt::print("is light {}\n", light);
+    const std::vector<unsigned char> buffer{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+    const auto records = DecodeArchiveRecordsParallel(buffer.data(), buffer.size());
+    if (flag->verbose == 1)
+        fmt::print("{} records in {} bytes\n", records.size(), buffer.size());
+
+    for (const auto &record : records)
+        fmt::print("{:%Y-%m-%d %H:%M:%S} {:.3f} {:.0f}\n", *std::localtime(&record.date), record.total_wh / 1000.0, record.power);
 
-    return light ? 1 : 0;
+    return 0;
 }
 
 //Set a value depending on inverter
@@ -902,6 +1054,11 @@ void SetSwitches(ConfType *conf, FlagType *flag)
         flag->mysql = 1;
     else
         flag->mysql = 0;
+    //A SQLite file takes the place of the MySQL server
+    if (((flag->mysql == 1) || (strlen(conf->SQLiteFile) > 0)) && (flag->test == 0))
+        flag->storage = 1;
+    else
+        flag->storage = 0;
     //Check if all File variables are set
     if (strlen(conf->File) > 0)
         flag->file = 1;
@@ -1002,8 +1159,10 @@ InitReturnKeys(ConfType *conf)
                         tmp.datalength = 0;
                         tmp.recordgap = 0;
                         tmp.persistent = 1;
+                        tmp.window = 0;
 
-                        if (sscanf(line, R"(%x %x "%[^"]" "%[^"]" %d %d %d %d)", &tmp.key1, &tmp.key2, tmp.description, tmp.units, &tmp.decimal, &tmp.recordgap, &tmp.datalength, &tmp.persistent) == 8) {
+                        // the aggregation window is optional
+                        if (sscanf(line, R"(%x %x "%[^"]" "%[^"]" %d %d %d %d %d)", &tmp.key1, &tmp.key2, tmp.description, tmp.units, &tmp.decimal, &tmp.recordgap, &tmp.datalength, &tmp.persistent, &tmp.window) >= 8) {
                             if (num_return_keys == 0)
                                 returnkeylist = (ReturnType *)malloc(sizeof(ReturnType));
                             else
@@ -1018,6 +1177,7 @@ InitReturnKeys(ConfType *conf)
                             (returnkeylist + num_return_keys)->datalength = tmp.datalength;
                             (returnkeylist + num_return_keys)->recordgap = tmp.recordgap;
                             (returnkeylist + num_return_keys)->persistent = tmp.persistent;
+                            (returnkeylist + num_return_keys)->window = tmp.window;
                             ++num_return_keys;
                         } else {
                             if (line[0] != ':') {
@@ -1056,6 +1216,21 @@ void InitConfig(ConfType *conf)
     strcpy(conf->PVOutputSid, "");
     strcpy(conf->datefrom, "");
     strcpy(conf->dateto, "");
+    conf->gap_scan_days = 7;
+    strcpy(conf->ArchiveFile, "");
+    conf->daydata_batch_rows = 500;
+    conf->daydata_batch_bytes = 256 * 1024;
+    strcpy(conf->LiveCacheFile, "");
+    conf->slow_query_ms = 1000;
+    conf->bulk_load_days = 7;
+    strcpy(conf->SQLiteFile, "");
+    strcpy(conf->SeriesDir, "");
+    strcpy(conf->WalDir, "");
+    conf->ring_hours = 24;
+    strcpy(conf->LiveWindowFile, "");
+    conf->live_raw_days = 0;
+    conf->live_hourly_days = 0;
+    strcpy(conf->QueryMetric, "");
 }
 
 /* Init Flagsg to default values */
@@ -1067,9 +1242,13 @@ void InitFlag(FlagType *flag)
     flag->location = 0;  /* is system using a daterange */
     flag->test = 0;      /* is system using a daterange */
     flag->mysql = 0;     /* is system using a daterange */
+    flag->storage = 0;   /* is a database configured */
     flag->file = 0;      /* is system using a daterange */
     flag->post = 0;      /* is system using a daterange */
     flag->repost = 0;    /* is system using a daterange */
+    flag->explain = 0;   /* print the query plans and exit */
+    flag->query = 0;     /* print a series of the history and exit */
+    flag->months = 0;    /* print the monthly totals and exit */
 }
 
 /* read Config from file */
@@ -1125,6 +1304,32 @@ int GetConfig(ConfType *conf, FlagType *flag)
                         strcpy(conf->PVOutputKey, value);
                     if (strcmp(variable, "PVOutputSid") == 0)
                         strcpy(conf->PVOutputSid, value);
+                    if (strcmp(variable, "GapScanDays") == 0)
+                        conf->gap_scan_days = atoi(value);
+                    if (strcmp(variable, "DayDataBatchRows") == 0)
+                        conf->daydata_batch_rows = atoi(value);
+                    if (strcmp(variable, "DayDataBatchBytes") == 0)
+                        conf->daydata_batch_bytes = atoi(value);
+                    if (strcmp(variable, "LiveCacheFile") == 0)
+                        strcpy(conf->LiveCacheFile, value);
+                    if (strcmp(variable, "SlowQueryMs") == 0)
+                        conf->slow_query_ms = atoi(value);
+                    if (strcmp(variable, "BulkLoadDays") == 0)
+                        conf->bulk_load_days = atoi(value);
+                    if (strcmp(variable, "SQLiteFile") == 0)
+                        strcpy(conf->SQLiteFile, value);
+                    if (strcmp(variable, "SeriesDir") == 0)
+                        strcpy(conf->SeriesDir, value);
+                    if (strcmp(variable, "WalDir") == 0)
+                        strcpy(conf->WalDir, value);
+                    if (strcmp(variable, "RingHours") == 0)
+                        conf->ring_hours = atoi(value);
+                    if (strcmp(variable, "LiveWindowFile") == 0)
+                        strcpy(conf->LiveWindowFile, value);
+                    if (strcmp(variable, "LiveRawDays") == 0)
+                        conf->live_raw_days = atoi(value);
+                    if (strcmp(variable, "LiveHourlyDays") == 0)
+                        conf->live_hourly_days = atoi(value);
                 }
             }
         }
@@ -1249,11 +1454,19 @@ void PrintHelp()
     fmt::print("privelege user to allow the creation of databases and tables, use command line \n");
     fmt::print("       --INSTALL                           install mysql data tables\n");
     fmt::print("       --UPDATE                            update mysql data tables\n");
+    fmt::print("       --explain                           show how the database runs the built in queries\n");
+    fmt::print("  months                                   print the monthly energy totals, -from and -to limit the months\n");
+    fmt::print("Set SQLiteFile in the config to store in a local SQLite file instead of mysql\n");
     fmt::print("PVOutput.org (A free solar information system) Configs\n");
     fmt::print("  -url,  --pvouturl PVOUTURL               pvoutput.org live url\n");
     fmt::print("  -key,  --pvoutkey PVOUTKEY               pvoutput.org key\n");
     fmt::print("  -sid,  --pvoutsid PVOUTSID               pvoutput.org sid\n");
     fmt::print("  -repost                                  verify and repost data if different\n");
+    fmt::print("       --archivefile FILE                  decode raw archive records from FILE and exit\n");
+    fmt::print("Local history, set SeriesDir in the config to keep one\n");
+    fmt::print("  query --metric NAME                      print a metric of the history and exit\n");
+    fmt::print("       --from YYYY-MM-DD HH:MM:SS          from date, default a day before --to\n");
+    fmt::print("       --to YYYY-MM-DD HH:MM:SS            to date, default now\n");
     fmt::print("\n\n");
 }
 
@@ -1275,12 +1488,12 @@ int ReadCommandConfig(ConfType *conf, FlagType *flag, int argc, char **argv, int
             }
         } else if (strcmp(argv[i], "--test") == 0) {
             flag->test = 1;
-        } else if ((strcmp(argv[i], "-from") == 0) || (strcmp(argv[i], "--datefrom") == 0)) {
+        } else if ((strcmp(argv[i], "-from") == 0) || (strcmp(argv[i], "--datefrom") == 0) || (strcmp(argv[i], "--from") == 0)) {
             i++;
             if (i < argc) {
                 strcpy(conf->datefrom, argv[i]);
             }
-        } else if ((strcmp(argv[i], "-to") == 0) || (strcmp(argv[i], "--dateto") == 0)) {
+        } else if ((strcmp(argv[i], "-to") == 0) || (strcmp(argv[i], "--dateto") == 0) || (strcmp(argv[i], "--to") == 0)) {
             i++;
             if (i < argc) {
                 strcpy(conf->dateto, argv[i]);
@@ -1358,10 +1571,26 @@ int ReadCommandConfig(ConfType *conf, FlagType *flag, int argc, char **argv, int
         } else if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
             PrintHelp();
             return (-1);
+        } else if (strcmp(argv[i], "--archivefile") == 0) {
+            i++;
+            if (i < argc) {
+                strcpy(conf->ArchiveFile, argv[i]);
+            }
         } else if (strcmp(argv[i], "--INSTALL") == 0) {
             (*install) = 1;
         } else if (strcmp(argv[i], "--UPDATE") == 0) {
             (*update) = 1;
+        } else if (strcmp(argv[i], "--explain") == 0) {
+            flag->explain = 1;
+        } else if (strcmp(argv[i], "query") == 0) {
+            flag->query = 1;
+        } else if (strcmp(argv[i], "months") == 0) {
+            flag->months = 1;
+        } else if (strcmp(argv[i], "--metric") == 0) {
+            i++;
+            if (i < argc) {
+                strcpy(conf->QueryMetric, argv[i]);
+            }
         } else {
             printf("Bad Syntax\n\n");
             for (i = 0; i < argc; i++)
@@ -1375,7 +1604,7 @@ int ReadCommandConfig(ConfType *conf, FlagType *flag, int argc, char **argv, int
     return (0);
 }
 
-bool post_pvoutput(const std::string &batch_string, std::size_t batch_count, MySQLConnection &mysql_connection, const std::string &PVOutputKey, const std::string &PVOutputSid, bool debug)
+bool post_pvoutput(const std::string &batch_string, const std::vector<DayDataKey> &keys, Storage &storage, const std::string &PVOutputKey, const std::string &PVOutputSid, bool debug)
 {
     CURL *curl = curl_easy_init();
     if (!curl)
@@ -1394,15 +1623,8 @@ bool post_pvoutput(const std::string &batch_string, std::size_t batch_count, MyS
     if (curl_result != 0)
         return false;
 
-    const auto query_date = fmt::format(R"(SELECT DATE_FORMAT(dd1.DateTime,'%Y%m%d'), DATE_FORMAT(dd1.DateTime,'%H:%i'), ROUND((dd1.ETotalToday-dd2.EtotalToday)*1000), dd1.CurrentPower, dd1.DateTime FROM DayData as dd1 join DayData as dd2 on dd2.DateTime=DATE_FORMAT(dd1.DateTime,'%Y-%m-%d 00:00:00') WHERE dd1.DateTime>=Date_Sub(CURDATE(),INTERVAL 13 DAY) and dd1.PVOutput IS NULL and dd1.CurrentPower>0 ORDER BY dd1.DateTime ASC limit {})", batch_count);
-    auto result_to_update = mysql_connection.ExecuteQuery(query_date, debug);
-
-    MYSQL_ROW row;
-    while ((row = mysql_fetch_row(result_to_update.res)))  //Need to update these
-    {
-        const auto query_update = fmt::format("UPDATE DayData set PVOutput=NOW() WHERE DateTime=\"{}\"", row[4]);
-        mysql_connection.ExecuteQuery(query_update, debug);
-    }
+    for (const auto &key : keys)  //Need to update these
+        storage.MarkPVOutput(key);
 
     return true;
 }
@@ -1419,9 +1641,13 @@ int main(int argc, char **argv)
     int error = 0;
     int max_output;
     unsigned char tzhex[2] = {0};
-    MYSQL_ROW row;
-    ArchDataList archdatalist{};
-    LiveDataList livedatalist{};
+    SampleCatalog catalog;
+    ArchiveBatch archive_batch;
+    LiveBatch live_batch;
+    std::unique_ptr<Storage> database;
+    std::optional<StorageWriter> storage_writer;
+    std::optional<SeriesStore> series_store;
+    std::optional<SeriesRing> series_ring;
 
     char sunrise_time[6], sunset_time[6];
 
@@ -1449,14 +1675,36 @@ int main(int argc, char **argv)
     //  exit(-1);
     // set switches used through the program
     SetSwitches(&conf, &flag);
-    if ((install == 1) && (flag.mysql == 1)) {
-        install_mysql_tables(&conf, &flag, SCHEMA);
+    // the history is read without touching the database
+    if (flag.query == 1)
+        exit(query_series(&conf, &flag));
+    // one connection serves the whole run, the archive writer opens its own
+    if (flag.storage == 1) {
+        try {
+            database = OpenStorage(conf, flag.debug, install != 1);
+        } catch (const std::runtime_error &e) {
+            fmt::print(stderr, "Error! Could not open the database: {}\n", e.what());
+            // with a write-ahead log the inverter is still read, its batches are stored once the database is back
+            if ((strlen(conf.WalDir) == 0) || (install == 1) || (update == 1) || (flag.explain == 1))
+                exit(-1);
+        }
+    }
+    if ((install == 1) && database) {
+        database->Install();
+        exit(0);
+    }
+    if ((update == 1) && database) {
+        database->Update();
         exit(0);
     }
-    if ((update == 1) && (flag.mysql == 1)) {
-        update_mysql_tables(&conf, &flag);
+    if ((flag.explain == 1) && database) {
+        database->Explain();
         exit(0);
     }
+    if ((flag.months == 1) && database)
+        exit(print_months(&conf, *database));
+    if (strlen(conf.ArchiveFile) > 0)
+        exit(decode_archive_file(&conf, &flag));
     // Get Return Value lookup from file
     InitReturnKeys(&conf);
     // Set value for inverter type
@@ -1465,31 +1713,33 @@ int main(int argc, char **argv)
     // Get Local Timezone offset in seconds
     get_timezone_in_seconds(&flag, tzhex);
     // Location based information to avoid querying Inverter in the dark
-    if ((flag.location == 1) && (flag.mysql == 1)) {
+    if ((flag.location == 1) && database) {
         if (flag.debug == 1) fmt::print("Before todays Almanac\n");
-        if (!todays_almanac(&conf, flag.debug)) {
+        if (!database->HasAlmanac()) {
             sprintf(sunrise_time, "%s", sunrise(&conf, flag.debug));
             sprintf(sunset_time, "%s", sunset(&conf));
             if (flag.verbose == 1) fmt::print("sunrise={} sunset={}\n", sunrise_time, sunset_time);
-            update_almanac(&conf, sunrise_time, sunset_time, flag.debug);
+            database->StoreAlmanac(sunrise_time, sunset_time);
         }
     }
 
-    if (flag.mysql == 1) {
+    if (database) {
         if (flag.debug == 1) fmt::print("Before Check Schema\n");
-        if (check_schema(&conf, &flag, SCHEMA) != 1)
+        if (!database->CheckSchema())
             exit(-1);
+        database->Maintain();
     }
 
+    const auto auto_dates = flag.daterange == 0;
     if (flag.daterange == 0) {  //auto set the dates
         if (flag.debug == 1) fmt::print("auto_set_dates\n");
-        auto_set_dates(&conf, &flag);
+        auto_set_dates(&conf, &flag, database.get());
     }
 
     if (flag.verbose == 1)
         fmt::print("QUERY RANGE    from {} to {}\n", conf.datefrom, conf.dateto);
 
-    if ((flag.daterange == 1) && ((flag.location = 0) || (flag.mysql == 0) || no_dark == 1 || is_light(&conf, &flag))) {
+    if ((flag.daterange == 1) && ((flag.location = 0) || !database || no_dark == 1 || database->IsLight())) {
         if (flag.file == 1)
             fp = fopen(conf.File, "r");
         else
@@ -1499,7 +1749,31 @@ int main(int argc, char **argv)
         //Connect to Inverter
         BTConnection bt_conn{conf.BTAddress};
 
-        SessionData session_data{archdatalist, livedatalist, bt_conn, conf, flag, &unit, fp};
+        // database writes run on their own thread while the transfer continues
+        if (flag.storage == 1) {
+            try {
+                storage_writer.emplace(conf, catalog, flag.debug, needs_bulk_load(&conf));
+            } catch (const std::runtime_error &e) {
+                fmt::print(stderr, "Error! Could not open the database: {}\n", e.what());
+                exit(-1);
+            }
+        }
+
+        // the local history is kept even when the database is down
+        if ((strlen(conf.SeriesDir) > 0) && (flag.test == 0)) {
+            try {
+                series_store.emplace(conf.SeriesDir);
+            } catch (const std::runtime_error &e) {
+                fmt::print(stderr, "Error! Could not open the history: {}\n", e.what());
+            }
+        }
+
+        if (conf.ring_hours > 0)
+            series_ring.emplace(static_cast<time_t>(conf.ring_hours) * 3600);
+
+        SessionData session_data{archive_batch, live_batch, catalog, bt_conn, conf, flag, &unit, fp};
+        session_data.storageWriter = storage_writer ? &*storage_writer : nullptr;
+        session_data.seriesStore = series_store ? &*series_store : nullptr;
 
         InverterCommand("init", session_data);
         InverterCommand("login", session_data);
@@ -1515,91 +1789,128 @@ int main(int argc, char **argv)
         InverterCommand("maxACPowerTotal", session_data);
         InverterCommand("ACPowerTotal", session_data);
         InverterCommand("DeviceStatus", session_data);
+        if (database && auto_dates)
+            set_inverter_dates(*database, &conf, &flag, unit);
         InverterCommand("getrangedata", session_data);
+        if (database && (conf.gap_scan_days > 0))
+            find_daydata_gaps(*database, &conf, &flag, unit, session_data.archiveGaps);
+        RefetchArchiveGaps(session_data);
+        if (database)
+            sync_month_archive(*database, &flag, unit, session_data);
         InverterCommand("logoff", session_data);
-    }
+        if (series_store)
+            series_store->Append(live_batch, catalog);
+        if (series_ring) {
+            series_ring->Append(live_batch);
+            if (flag.verbose == 1)
+                fmt::print("{} live values in {} bytes of memory\n", series_ring->samples(), series_ring->bytes());
+        }
 
-    if ((flag.mysql == 1) && (error == 0)) {
-        /* Connect to database */
-        auto mysql_connection = MySQLConnection(conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase);
-        for (const auto &data : archdatalist)  //Start at 1 as the first record is a dummy
-        {
-            const auto query = fmt::format("INSERT INTO DayData ( DateTime, Inverter, Serial, CurrentPower, EtotalToday ) VALUES ( FROM_UNIXTIME({}),\'{}\',{},{:.0f}, {:.3f} ) ON DUPLICATE KEY UPDATE DateTime=Datetime, Inverter=VALUES(Inverter), Serial=VALUES(Serial), CurrentPower=VALUES(CurrentPower), EtotalToday=VALUES(EtotalToday)",
-                                           data.date, data.inverter, data.serial, data.current_value, data.accum_value);
-            mysql_connection.ExecuteQuery(query, flag.debug);
+        if (storage_writer) {
+            // the history and the ring above keep every sample
+            if (flag.post == 1)
+                storage_writer->PushLive(aggregate_live(&conf, &flag, live_batch, catalog));
+            storage_writer->Finish();
+            if (flag.verbose == 1) {
+                const auto &stats = storage_writer->stats();
+                fmt::print("stored {} records in {} batches, queue depth {}, {} stalls waiting {} ms\n", storage_writer->written(), stats.batches, stats.max_depth, stats.stalls,
+                           std::chrono::duration_cast<std::chrono::milliseconds>(stats.stalled).count());
+                if (storage_writer->unstored() > 0)
+                    fmt::print("{} bytes wait in {} for the database\n", storage_writer->unstored(), conf.WalDir);
+                fmt::print("storage queries\n");
+                storage_writer->query_stats().Print(stdout);
+            }
         }
+    }
+
+    if (database && (error == 0)) {
+        // the bluetooth transfer may have taken long enough for the server to drop us
+        database->Ping();
+        // archive and live records have already been stored by storage_writer
 
         if (flag.post == 1) {
 
-            //Update Mysql with live data
-            live_mysql(conf, flag.debug, livedatalist);
             printf("\nbefore update to PVOutput");
             getchar();
             {
                 unsigned long long inverter_serial = (unit[0].Serial[0] << 24) + (unit[0].Serial[1] << 16) + (unit[0].Serial[2] << 8) + unit[0].Serial[3];
-                const auto query = fmt::format(R"(SELECT Value FROM LiveData WHERE Inverter = '{}' and Serial='{}' and Description='Max Phase 1' ORDER BY DateTime DESC LIMIT 1)", unit[0].Inverter, inverter_serial);
-                if (auto result = mysql_connection.ExecuteQuery(query, flag.debug); mysql_num_rows(result.res) == 1) {
-                    if ((row = mysql_fetch_row(result.res))) {
-                        max_output = atoi(row[0]) * 1.2;
-                    }
+                // read during this run, otherwise the database has the last known value
+                std::optional<double> max_phase;
+                const auto source = catalog.FindSource(unit[0].Inverter, inverter_serial);
+                const auto metric = catalog.FindMetric("Max Phase 1");
+                if (series_ring && source && metric) {
+                    if (const auto latest = series_ring->Latest(*source, *metric))
+                        max_phase = latest->value;
                 }
+                if (!max_phase)
+                    max_phase = database->LatestLive(unit[0].Inverter, inverter_serial, "Max Phase 1");
+                if (max_phase)
+                    max_output = static_cast<int>(*max_phase) * 1.2;
             }
 
-            const auto query = fmt::format(R"(SELECT DATE_FORMAT(dd1.DateTime,'%Y%m%d'), DATE_FORMAT(dd1.DateTime,'%H:%i'), ROUND((dd1.ETotalToday-dd2.EtotalToday)*1000), if( dd1.CurrentPower < {0}, dd1.CurrentPower, {0} ), dd1.DateTime FROM DayData as dd1 join DayData as dd2 on dd2.DateTime=DATE_FORMAT(dd1.DateTime,'%Y-%m-%d 00:00:00') WHERE dd1.DateTime>=Date_Sub(CURDATE(),INTERVAL 13 DAY) and dd1.PVOutput IS NULL and dd1.CurrentPower>0 ORDER BY dd1.DateTime ASC)", max_output);
-
-            auto result = mysql_connection.ExecuteQuery(query, flag.debug);
-            if (mysql_num_rows(result.res) == 1) {
-                if ((row = mysql_fetch_row(result.res)))  //Need to update these
+            // pending records are read a batch at a time, each batch is posted and marked before the next read
+            std::vector<PVOutputRecord> pending;
+            DayDataKey cursor;
+            auto read_pending = [&]() {
+                pending = database->PendingPVOutput(max_output, cursor, PVOUTPUT_BATCH);
+                if (!pending.empty())
+                    cursor = pending.back().key;
+            };
+
+            read_pending();
+            if (pending.size() == 1) {
+                const auto &record = pending.front();
+                const auto compurl = fmt::format("{}?d={}&t={}&v1={}&v2={}&key={}&sid={}", conf.PVOutputURL, record.date, record.time, record.energy, record.power, conf.PVOutputKey, conf.PVOutputSid);
+                if (flag.debug == 1)
+                    fmt::print("url = {}\n", compurl);
                 {
-                    const auto compurl = fmt::format("{}?d={}&t={}&v1={}&v2={}&key={}&sid={}", conf.PVOutputURL, row[0], row[1], row[2], row[3], conf.PVOutputKey, conf.PVOutputSid);
-                    if (flag.debug == 1)
-                        fmt::print("url = {}\n", compurl);
-                    {
-                        CURL *curl = curl_easy_init();
-                        if (curl) {
-                            curl_easy_setopt(curl, CURLOPT_URL, compurl.c_str());
-                            curl_easy_setopt(curl, CURLOPT_FAILONERROR, compurl.c_str());
-                            CURLcode curl_result = curl_easy_perform(curl);
-                            if (flag.debug == 1)
-                                fmt::print("result = {}\n", curl_result);
-                            curl_easy_cleanup(curl);
-                            if (curl_result == 0) {
-                                const auto query_update = fmt::format("UPDATE DayData  set PVOutput=NOW() WHERE DateTime=\"{}\"", row[4]);
-                                mysql_connection.ExecuteQuery(query_update, flag.debug);
-                            }
-                        }
+                    CURL *curl = curl_easy_init();
+                    if (curl) {
+                        curl_easy_setopt(curl, CURLOPT_URL, compurl.c_str());
+                        curl_easy_setopt(curl, CURLOPT_FAILONERROR, compurl.c_str());
+                        CURLcode curl_result = curl_easy_perform(curl);
+                        if (flag.debug == 1)
+                            fmt::print("result = {}\n", curl_result);
+                        curl_easy_cleanup(curl);
+                        if (curl_result == 0)
+                            database->MarkPVOutput(record.key);
                     }
                 }
             } else {
-                std::string batch_string{};
-                std::size_t batch_count{0};
-                while ((row = mysql_fetch_row(result.res)))  //Need to update these
-                {
-                    sleep(2);
-                    if (!batch_string.empty())
-                        batch_string.append(";");
-
-                    batch_string.append(fmt::format("{},{},{},{}", row[0], row[1], row[2], row[3]));
-                    ++batch_count;
-                    if (batch_count == 30) {
-                        auto success = post_pvoutput(batch_string, batch_count, mysql_connection, conf.PVOutputKey, conf.PVOutputSid, flag.debug);
-                        if (!success)
-                            break;
-
-                        batch_count = 0;
-                        batch_string.clear();
+                while (!pending.empty()) {
+                    std::string batch_string{};
+                    std::vector<DayDataKey> keys;
+                    for (const auto &record : pending) {
+                        sleep(2);
+                        if (!batch_string.empty())
+                            batch_string.append(";");
+
+                        batch_string.append(fmt::format("{},{},{},{}", record.date, record.time, record.energy, record.power));
+                        keys.push_back(record.key);
                     }
-                }
-                if (batch_count > 0) {
-                    post_pvoutput(batch_string, batch_count, mysql_connection, conf.PVOutputKey, conf.PVOutputSid, flag.debug);
+
+                    auto success = post_pvoutput(batch_string, keys, *database, conf.PVOutputKey, conf.PVOutputSid, flag.debug);
+                    if (!success || pending.size() < PVOUTPUT_BATCH)
+                        break;
+
+                    read_pending();
                 }
             }
         }
     }
 
-    if ((flag.repost == 1) && (error == 0)) {
+    if ((flag.repost == 1) && database && (error == 0)) {
         fmt::print("\nrepost\n");  //getchar();
-        sma_repost(&conf, &flag);
+        sma_repost(*database, &conf, &flag);
+    }
+
+    // old live values are thinned out last, after the poll and the uploads
+    if (database && (flag.test == 0))
+        database->CompactLive(time(nullptr));
+
+    if (database && (flag.verbose == 1) && !database->query_stats().empty()) {
+        fmt::print("queries\n");
+        database->query_stats().Print(stdout);
     }
 
     return 0;
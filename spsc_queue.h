@@ -0,0 +1,72 @@
+#ifndef SMA_BLUETOOTH_SPSC_QUEUE_H
+#define SMA_BLUETOOTH_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/*
+ * Lock free ring buffer between exactly one producer and one consumer
+ * thread. Neither side ever blocks, callers decide how to wait when the
+ * queue is full or empty. The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(std::size_t capacity) : m_capacity(RoundUp(capacity)), m_slots(std::make_unique<T[]>(m_capacity)) {}
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // producer side, value is only moved from if there was room
+    bool TryPush(T &value)
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == m_capacity)
+            return false;
+
+        m_slots[tail & (m_capacity - 1)] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side
+    bool TryPop(T &value)
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+
+        auto &slot = m_slots[head & (m_capacity - 1)];
+        value = std::move(slot);
+        slot = T{};
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // producer side, no more elements will be pushed
+    void Close() { m_closed.store(true, std::memory_order_release); }
+    [[nodiscard]] bool closed() const { return m_closed.load(std::memory_order_acquire); }
+
+    [[nodiscard]] std::size_t size() const { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire); }
+    [[nodiscard]] std::size_t capacity() const { return m_capacity; }
+
+private:
+    static std::size_t RoundUp(std::size_t capacity)
+    {
+        std::size_t rounded = 1;
+        while (rounded < capacity)
+            rounded <<= 1;
+        return rounded;
+    }
+
+    const std::size_t m_capacity;
+    std::unique_ptr<T[]> m_slots;
+    // head and tail on their own cache lines so the two threads do not share one
+    alignas(64) std::atomic<std::size_t> m_head{0};
+    alignas(64) std::atomic<std::size_t> m_tail{0};
+    std::atomic<bool> m_closed{false};
+};
+
+#endif  //SMA_BLUETOOTH_SPSC_QUEUE_H
@@ -0,0 +1,764 @@
+#include "sqlite_storage.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+// PRAGMA user_version of the tables created below
+static constexpr int SQLITE_USER_VERSION = 4;
+
+// times are unix timestamps like the inverter reports them, the queries convert to local time
+static constexpr const char *SQLITE_TABLES =
+    "CREATE TABLE IF NOT EXISTS Almanac ( date TEXT NOT NULL PRIMARY KEY, sunrise TEXT, sunset TEXT ); \
+     CREATE TABLE IF NOT EXISTS DayData ( DateTime INTEGER NOT NULL, Inverter TEXT NOT NULL, Serial INTEGER NOT NULL, \
+         CurrentPower INTEGER, ETotalToday REAL, Voltage REAL, PVOutput INTEGER, PRIMARY KEY ( DateTime, Inverter, Serial ) ) WITHOUT ROWID; \
+     CREATE INDEX IF NOT EXISTS PVOutputPending ON DayData ( PVOutput, DateTime ); \
+     CREATE INDEX IF NOT EXISTS SerialDateTime ON DayData ( Serial, DateTime ); \
+     CREATE TABLE IF NOT EXISTS DayEnergy ( Date TEXT NOT NULL, Inverter TEXT NOT NULL, Serial INTEGER NOT NULL, \
+         EStart REAL, EEnd REAL, PeakPower INTEGER, PeakTime INTEGER, PRIMARY KEY ( Inverter, Serial, Date ) ) WITHOUT ROWID; \
+     CREATE INDEX IF NOT EXISTS DayEnergyDate ON DayEnergy ( Date ); \
+     CREATE TABLE IF NOT EXISTS MonthEnergy ( Month TEXT NOT NULL, Inverter TEXT NOT NULL, Serial INTEGER NOT NULL, \
+         Energy REAL, Days INTEGER, PeakPower INTEGER, PeakTime INTEGER, PRIMARY KEY ( Inverter, Serial, Month ) ) WITHOUT ROWID; \
+     CREATE TABLE IF NOT EXISTS MonthData ( Date TEXT NOT NULL, Inverter TEXT NOT NULL, Serial INTEGER NOT NULL, \
+         ETotal REAL, EDay REAL, PRIMARY KEY ( Inverter, Serial, Date ) ) WITHOUT ROWID; \
+     CREATE TABLE IF NOT EXISTS Inverters ( id INTEGER PRIMARY KEY, Inverter TEXT NOT NULL, Serial INTEGER NOT NULL, UNIQUE ( Inverter, Serial ) ); \
+     CREATE TABLE IF NOT EXISTS Metric ( id INTEGER PRIMARY KEY, Description TEXT NOT NULL UNIQUE, Units TEXT, \
+         Decimals INTEGER NOT NULL DEFAULT 0, Kind INTEGER NOT NULL DEFAULT 0 ); \
+     CREATE TABLE IF NOT EXISTS MetricText ( id INTEGER PRIMARY KEY, Text TEXT NOT NULL UNIQUE ); \
+     CREATE TABLE IF NOT EXISTS LiveValue ( InverterId INTEGER NOT NULL, MetricId INTEGER NOT NULL, DateTime INTEGER NOT NULL, \
+         Value REAL NOT NULL, Mean REAL, Min REAL, Max REAL, PRIMARY KEY ( InverterId, MetricId, DateTime ) ) WITHOUT ROWID; \
+     CREATE TABLE IF NOT EXISTS SyncState ( Inverter TEXT NOT NULL, Serial INTEGER NOT NULL, LastArchive INTEGER, LastLive INTEGER, LastUpload INTEGER, \
+         PRIMARY KEY ( Inverter, Serial ) ) WITHOUT ROWID; \
+     CREATE TABLE IF NOT EXISTS settings ( value TEXT NOT NULL PRIMARY KEY, data TEXT NOT NULL ); \
+     CREATE VIEW IF NOT EXISTS LiveData AS SELECT datetime(lv.DateTime, 'unixepoch', 'localtime') AS DateTime, inv.Inverter, inv.Serial, m.Description, \
+         CASE m.Kind WHEN 1 THEN t.Text WHEN 2 THEN datetime(lv.Value, 'unixepoch', 'localtime') ELSE round(lv.Value, m.Decimals) END AS Value, m.Units, \
+         round(lv.Mean, m.Decimals) AS Mean, round(lv.Min, m.Decimals) AS Min, round(lv.Max, m.Decimals) AS Max \
+         FROM LiveValue AS lv JOIN Inverters AS inv ON inv.id=lv.InverterId JOIN Metric AS m ON m.id=lv.MetricId \
+         LEFT JOIN MetricText AS t ON m.Kind=1 AND t.id=lv.Value;";
+
+static constexpr const char *SQLITE_SYNC_STATES =
+    "SELECT Inverter, Serial, ifnull(datetime(LastArchive, 'unixepoch', 'localtime'), ''), ifnull(datetime(LastLive, 'unixepoch', 'localtime'), ''), \
+     ifnull(datetime(LastUpload, 'unixepoch', 'localtime'), '') FROM SyncState";
+static constexpr const char *SQLITE_DAYDATA_SLOTS = "SELECT DateTime FROM DayData WHERE Serial=? AND DateTime BETWEEN ? AND ? ORDER BY DateTime ASC";
+static constexpr const char *SQLITE_PVOUTPUT_PENDING =
+    "SELECT strftime('%Y%m%d', dd.DateTime, 'unixepoch', 'localtime'), strftime('%H:%M', dd.DateTime, 'unixepoch', 'localtime'), \
+     CAST(round((dd.ETotalToday-de.EStart)*1000) AS INTEGER), min(dd.CurrentPower, ?), dd.DateTime, dd.Inverter, dd.Serial \
+     FROM DayData AS dd JOIN DayEnergy AS de ON de.Inverter=dd.Inverter AND de.Serial=dd.Serial AND de.Date=date(dd.DateTime, 'unixepoch', 'localtime') \
+     WHERE dd.DateTime>=CAST(strftime('%s', date('now', 'localtime', '-13 days'), 'utc') AS INTEGER) AND ( dd.DateTime, dd.Inverter, dd.Serial )>( ?, ?, ? ) \
+     AND dd.PVOutput IS NULL AND dd.CurrentPower>0 ORDER BY dd.DateTime ASC, dd.Inverter ASC, dd.Serial ASC LIMIT ?";
+static constexpr const char *SQLITE_FINISHED_DAYS =
+    "SELECT strftime('%Y%m%d', Date), round(sum(EEnd-EStart)*1000) FROM DayEnergy WHERE Date < date('now', 'localtime') AND strftime('%Y%m%d', Date) < ? \
+     GROUP BY Date ORDER BY Date DESC LIMIT ?";
+static constexpr const char *SQLITE_LATEST_LIVE =
+    "SELECT inv.Inverter, inv.Serial, m.Description, m.Kind, m.Decimals, lv.Value, t.Text FROM LiveValue AS lv \
+     JOIN ( SELECT InverterId, MetricId, MAX(DateTime) AS DateTime FROM LiveValue GROUP BY InverterId, MetricId ) AS latest USING ( InverterId, MetricId, DateTime ) \
+     JOIN Inverters AS inv ON inv.id=lv.InverterId JOIN Metric AS m ON m.id=lv.MetricId LEFT JOIN MetricText AS t ON m.Kind=1 AND t.id=lv.Value";
+static constexpr const char *SQLITE_LATEST_METRIC =
+    "SELECT lv.Value FROM LiveValue AS lv JOIN Inverters AS inv ON inv.id=lv.InverterId JOIN Metric AS m ON m.id=lv.MetricId \
+     WHERE inv.Inverter=? AND inv.Serial=? AND m.Description=? ORDER BY lv.DateTime DESC LIMIT 1";
+// the IN lists let a day of every series be read through the primary key
+static constexpr const char *SQLITE_LIVE_DAY =
+    "SELECT lv.InverterId, lv.MetricId, m.Kind, lv.DateTime, lv.Value, lv.Mean, lv.Min, lv.Max FROM LiveValue AS lv JOIN Metric AS m ON m.id=lv.MetricId \
+     WHERE lv.InverterId IN ( SELECT id FROM Inverters ) AND lv.MetricId IN ( SELECT id FROM Metric ) AND lv.DateTime >= ? AND lv.DateTime < ? \
+     ORDER BY lv.InverterId, lv.MetricId, lv.DateTime";
+static constexpr const char *SQLITE_MONTH_TOTALS =
+    "SELECT strftime('%Y-%m', Month), Inverter, Serial, Energy, Days, PeakPower, ifnull(datetime(PeakTime, 'unixepoch', 'localtime'), '') FROM MonthEnergy \
+     WHERE Month BETWEEN ? AND ? ORDER BY Month, Inverter, Serial";
+static constexpr const char *SQLITE_MONTH_WATERMARK = "SELECT MAX(Date) || ' 00:00:00' FROM MonthData WHERE Inverter=? AND Serial=?";
+static constexpr const char *SQLITE_TODAYS_ALMANAC = "SELECT 1 FROM Almanac WHERE date=date('now', 'localtime')";
+static constexpr const char *SQLITE_IS_LIGHT =
+    "SELECT CAST(strftime('%s', sunrise, 'utc') AS INTEGER) < CAST(strftime('%s', 'now') AS INTEGER), \
+     ifnull(( SELECT MAX(DateTime) FROM DayData ) > CAST(strftime('%s', sunset, 'utc') AS INTEGER), 0) FROM Almanac WHERE date=date('now', 'localtime')";
+
+SQLiteStatement::SQLiteStatement(SQLiteStorage &storage, std::string query) : m_storage(storage), m_query(std::move(query))
+{
+    if (sqlite3_prepare_v2(m_storage.handle(), m_query.c_str(), static_cast<int>(m_query.size()), &m_stmt, nullptr) != SQLITE_OK) {
+        fmt::print(stderr, "{}\n", sqlite3_errmsg(m_storage.handle()));
+        sqlite3_finalize(m_stmt);
+        m_stmt = nullptr;
+    }
+}
+
+SQLiteStatement::~SQLiteStatement()
+{
+    sqlite3_finalize(m_stmt);
+}
+
+void SQLiteStatement::Bind(int index, long long value)
+{
+    Reset();
+    sqlite3_bind_int64(m_stmt, index + 1, value);
+}
+
+void SQLiteStatement::Bind(int index, double value)
+{
+    Reset();
+    sqlite3_bind_double(m_stmt, index + 1, value);
+}
+
+void SQLiteStatement::Bind(int index, std::string_view value)
+{
+    Reset();
+    sqlite3_bind_text(m_stmt, index + 1, value.data(), static_cast<int>(value.size()), SQLITE_TRANSIENT);
+}
+
+void SQLiteStatement::BindNull(int index)
+{
+    Reset();
+    sqlite3_bind_null(m_stmt, index + 1);
+}
+
+bool SQLiteStatement::Step()
+{
+    if (!m_stmt)
+        return false;
+
+    if (!m_running) {
+        if (m_storage.debug())
+            fmt::print("{}\n", m_query);
+        m_start = std::chrono::steady_clock::now();
+        m_rows = 0;
+        m_running = true;
+        m_failed = false;
+    }
+
+    const auto status = sqlite3_step(m_stmt);
+    if (status == SQLITE_ROW) {
+        ++m_rows;
+        return true;
+    }
+    if (status != SQLITE_DONE) {
+        fmt::print(stderr, "{}\n", sqlite3_errmsg(m_storage.handle()));
+        m_failed = true;
+    } else if (sqlite3_column_count(m_stmt) == 0) {
+        m_rows = sqlite3_changes(m_storage.handle());
+    }
+    Reset();
+    return false;
+}
+
+bool SQLiteStatement::Execute()
+{
+    while (Step()) {
+    }
+    return m_stmt && !m_failed;
+}
+
+void SQLiteStatement::Reset()
+{
+    if (!m_running)
+        return;
+
+    m_running = false;
+    sqlite3_reset(m_stmt);
+    m_storage.query_stats().Record(m_query, std::chrono::steady_clock::now() - m_start, m_rows);
+}
+
+std::string SQLiteStatement::Text(int index) const
+{
+    const auto *text = reinterpret_cast<const char *>(sqlite3_column_text(m_stmt, index));
+    return text ? text : "";
+}
+
+SQLiteStorage::SQLiteStorage(const ConfType &conf, bool debug) : m_debug(debug), m_retention{conf.live_raw_days, conf.live_hourly_days}
+{
+    if (sqlite3_open_v2(conf.SQLiteFile, &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+        std::string error = m_db ? sqlite3_errmsg(m_db) : "out of memory";
+        sqlite3_close(m_db);
+        throw std::runtime_error(error);
+    }
+    m_query_stats.SetSlowThreshold(std::chrono::milliseconds(conf.slow_query_ms));
+
+    // the storage thread writes while the main thread reads, wait for each other instead of failing
+    sqlite3_busy_timeout(m_db, 5000);
+    Exec("PRAGMA journal_mode=WAL");
+    Exec("PRAGMA synchronous=NORMAL");
+
+    // a failed step rolls the whole migration back, the file keeps its old version instead of a half migrated schema
+    const auto migrate = [this](const char *query) {
+        if (Exec(query))
+            return;
+        const std::string error = sqlite3_errmsg(m_db);
+        Exec("ROLLBACK");
+        m_statements.clear();
+        sqlite3_close(m_db);
+        throw std::runtime_error(fmt::format("SQLite schema migration failed: {}", error));
+    };
+
+    // zero-ops: the tables are there as soon as the file is
+    migrate("BEGIN IMMEDIATE");
+    // older files get the columns added since, missing tables and views are created below
+    const auto version = UserVersion();
+    if (version == 1)
+        migrate("ALTER TABLE LiveValue ADD COLUMN Mean REAL; ALTER TABLE LiveValue ADD COLUMN Min REAL; ALTER TABLE LiveValue ADD COLUMN Max REAL; DROP VIEW IF EXISTS LiveData");
+    if (version >= 1 && version < 3)
+        migrate("ALTER TABLE DayEnergy ADD COLUMN PeakTime INTEGER");
+    migrate(SQLITE_TABLES);
+    if (version >= 1 && version < 3) {
+        migrate("UPDATE DayEnergy SET PeakTime=( SELECT MIN(dd.DateTime) FROM DayData AS dd WHERE dd.Serial=DayEnergy.Serial AND dd.Inverter=DayEnergy.Inverter \
+              AND dd.DateTime BETWEEN CAST(strftime('%s', DayEnergy.Date, 'utc') AS INTEGER) AND CAST(strftime('%s', DayEnergy.Date, '+1 day', 'utc') AS INTEGER) - 1 \
+              AND dd.CurrentPower=DayEnergy.PeakPower ); \
+              INSERT OR REPLACE INTO MonthEnergy ( Month, Inverter, Serial, Energy, Days, PeakPower ) \
+              SELECT strftime('%Y-%m-01', Date), Inverter, Serial, sum(EEnd-EStart), count(*), max(PeakPower) FROM DayEnergy GROUP BY strftime('%Y-%m-01', Date), Inverter, Serial; \
+              UPDATE MonthEnergy SET PeakTime=( SELECT de.PeakTime FROM DayEnergy AS de WHERE de.Inverter=MonthEnergy.Inverter AND de.Serial=MonthEnergy.Serial \
+              AND de.Date BETWEEN MonthEnergy.Month AND date(MonthEnergy.Month, '+1 month', '-1 day') ORDER BY de.PeakPower DESC, de.Date ASC LIMIT 1 )");
+    }
+    if (version >= 1 && version < 4) {
+        migrate("INSERT OR IGNORE INTO SyncState ( Inverter, Serial ) SELECT DISTINCT Inverter, Serial FROM DayData; \
+              INSERT OR IGNORE INTO SyncState ( Inverter, Serial ) SELECT Inverter, Serial FROM Inverters; \
+              UPDATE SyncState SET LastArchive=( SELECT MAX(DateTime) FROM DayData AS dd WHERE dd.Inverter=SyncState.Inverter AND dd.Serial=SyncState.Serial ), \
+              LastUpload=( SELECT MAX(DateTime) FROM DayData AS dd WHERE dd.Inverter=SyncState.Inverter AND dd.Serial=SyncState.Serial AND dd.PVOutput IS NOT NULL ), \
+              LastLive=( SELECT MAX(lv.DateTime) FROM LiveValue AS lv JOIN Inverters AS inv ON inv.id=lv.InverterId WHERE inv.Inverter=SyncState.Inverter AND inv.Serial=SyncState.Serial )");
+    }
+    migrate(fmt::format("PRAGMA user_version={}", SQLITE_USER_VERSION).c_str());
+    migrate("COMMIT");
+}
+
+SQLiteStorage::~SQLiteStorage()
+{
+    // statements have to be finalized before the database can be closed
+    m_statements.clear();
+    sqlite3_close(m_db);
+}
+
+bool SQLiteStorage::Exec(const char *query)
+{
+    if (m_debug)
+        fmt::print("{}\n", query);
+
+    const auto start = std::chrono::steady_clock::now();
+    char *error = nullptr;
+    const auto status = sqlite3_exec(m_db, query, nullptr, nullptr, &error);
+    m_query_stats.Record(query, std::chrono::steady_clock::now() - start, sqlite3_changes(m_db));
+    if (status != SQLITE_OK) {
+        fmt::print(stderr, "{}\n", error ? error : sqlite3_errmsg(m_db));
+        sqlite3_free(error);
+        return false;
+    }
+
+    return true;
+}
+
+SQLiteStatement &SQLiteStorage::Prepare(const std::string &query)
+{
+    auto &statement = m_statements[query];
+    if (!statement)
+        statement = std::make_unique<SQLiteStatement>(*this, query);
+
+    return *statement;
+}
+
+void SQLiteStorage::Install()
+{
+    // the constructor already created everything
+    fmt::print("SQLite database ready, schema {}\n", SQLITE_USER_VERSION);
+}
+
+int SQLiteStorage::UserVersion()
+{
+    auto &query = Prepare("PRAGMA user_version");
+    const auto version = query.Step() ? static_cast<int>(query.Integer(0)) : 0;
+    query.Reset();
+    return version;
+}
+
+bool SQLiteStorage::CheckSchema()
+{
+    const auto version = UserVersion();
+    if (version != SQLITE_USER_VERSION) {
+        fmt::print("SQLite schema {} is not supported, expected {}\n", version, SQLITE_USER_VERSION);
+        return false;
+    }
+    return true;
+}
+
+void SQLiteStorage::Explain()
+{
+    const std::pair<const char *, const char *> queries[] = {
+        {"sync state", SQLITE_SYNC_STATES},
+        {"DayData slots", SQLITE_DAYDATA_SLOTS},
+        {"PVOutput pending", SQLITE_PVOUTPUT_PENDING},
+        {"latest LiveValue", SQLITE_LATEST_LIVE},
+        {"latest metric", SQLITE_LATEST_METRIC},
+        {"MonthData watermark", SQLITE_MONTH_WATERMARK},
+        {"todays Almanac", SQLITE_TODAYS_ALMANAC},
+        {"is light", SQLITE_IS_LIGHT},
+        {"repost days", SQLITE_FINISHED_DAYS},
+        {"month totals", SQLITE_MONTH_TOTALS},
+        {"live day", SQLITE_LIVE_DAY},
+    };
+
+    for (const auto &[name, query] : queries) {
+        fmt::print("\n{}\n{}\n", name, query);
+
+        // unbound parameters are NULL, the plan does not depend on them
+        SQLiteStatement plan(*this, std::string("EXPLAIN QUERY PLAN ") + query);
+        while (plan.Step()) {
+            const auto detail = plan.Text(3);
+            fmt::print("{}\n", detail);
+            if (detail.rfind("SCAN ", 0) == 0)
+                fmt::print("Warning: full scan of {}\n", detail.substr(5));
+        }
+    }
+}
+
+bool SQLiteStorage::HasAlmanac()
+{
+    auto &query = Prepare(SQLITE_TODAYS_ALMANAC);
+    const auto found = query.Step();
+    query.Reset();
+    return found;
+}
+
+void SQLiteStorage::StoreAlmanac(const char *sunrise, const char *sunset)
+{
+    auto &insert = Prepare("INSERT OR REPLACE INTO Almanac ( date, sunrise, sunset ) VALUES ( date('now', 'localtime'), date('now', 'localtime') || ' ' || ?, date('now', 'localtime') || ' ' || ? )");
+    insert.Bind(0, sunrise);
+    insert.Bind(1, sunset);
+    insert.Execute();
+}
+
+bool SQLiteStorage::IsLight()
+{
+    auto &query = Prepare(SQLITE_IS_LIGHT);
+    auto light = true;
+    if (query.Step())
+        light = query.Integer(0) == 1 && query.Integer(1) == 0;
+    query.Reset();
+    return light;
+}
+
+std::vector<SyncState> SQLiteStorage::SyncStates()
+{
+    auto &query = Prepare(SQLITE_SYNC_STATES);
+    std::vector<SyncState> states;
+    while (query.Step())
+        states.push_back({query.Text(0), static_cast<unsigned long long>(query.Integer(1)), query.Text(2), query.Text(3), query.Text(4)});
+    return states;
+}
+
+bool SQLiteStorage::UpdateSyncState(const char *column, const std::unordered_map<SourceId, time_t> &latest, const SampleCatalog &catalog)
+{
+    // a batch replayed late never moves the state back
+    auto &upsert = Prepare(fmt::format("INSERT INTO SyncState ( Inverter, Serial, {0} ) VALUES ( ?, ?, ? ) \
+         ON CONFLICT ( Inverter, Serial ) DO UPDATE SET {0}=max(ifnull({0}, excluded.{0}), excluded.{0})",
+                                       column));
+    auto stored_all = true;
+    for (const auto &[id, time] : latest) {
+        const auto source = catalog.GetSource(id);
+        upsert.Bind(0, catalog.GetString(source.inverter));
+        upsert.Bind(1, static_cast<long long>(source.serial));
+        upsert.Bind(2, static_cast<long long>(time));
+        stored_all = upsert.Execute() && stored_all;
+    }
+    return stored_all;
+}
+
+TimeRangeList SQLiteStorage::DayDataGaps(unsigned long long serial, time_t from, time_t to)
+{
+    auto &query = Prepare(SQLITE_DAYDATA_SLOTS);
+    query.Bind(0, static_cast<long long>(serial));
+    query.Bind(1, static_cast<long long>(from));
+    query.Bind(2, static_cast<long long>(to));
+
+    std::vector<time_t> timestamps;
+    while (query.Step())
+        timestamps.push_back(query.Integer(0));
+
+    return FindArchiveGaps(timestamps);
+}
+
+bool SQLiteStorage::StoreDayData(const ArchiveBatch &batch, const SampleCatalog &catalog)
+{
+    auto &insert = Prepare("INSERT INTO DayData ( DateTime, Inverter, Serial, CurrentPower, ETotalToday ) VALUES ( ?, ?, ?, ?, ? ) \
+         ON CONFLICT ( DateTime, Inverter, Serial ) DO UPDATE SET CurrentPower=excluded.CurrentPower, ETotalToday=excluded.ETotalToday");
+    // the energy counter only grows, so the smallest value is the start of the day
+    auto &day_energy = Prepare("INSERT INTO DayEnergy ( Date, Inverter, Serial, EStart, EEnd, PeakPower, PeakTime ) VALUES ( date(?, 'unixepoch', 'localtime'), ?, ?, ?, ?, ?, ? ) \
+         ON CONFLICT ( Inverter, Serial, Date ) DO UPDATE SET EStart=min(ifnull(EStart, excluded.EStart), excluded.EStart), \
+         EEnd=max(ifnull(EEnd, excluded.EEnd), excluded.EEnd), PeakPower=max(ifnull(PeakPower, excluded.PeakPower), excluded.PeakPower), \
+         PeakTime=CASE WHEN excluded.PeakPower > ifnull(PeakPower, -1) OR (excluded.PeakPower = PeakPower AND excluded.PeakTime < PeakTime) THEN excluded.PeakTime ELSE PeakTime END");
+    // a late record changes its month like any other, so the month is summed again from its days
+    auto &month_energy = Prepare("INSERT INTO MonthEnergy ( Month, Inverter, Serial, Energy, Days, PeakPower, PeakTime ) \
+         SELECT ?1, Inverter, Serial, sum(EEnd-EStart), count(*), max(PeakPower), \
+         ( SELECT PeakTime FROM DayEnergy WHERE Inverter=?2 AND Serial=?3 AND Date BETWEEN ?1 AND ?4 ORDER BY PeakPower DESC, Date ASC LIMIT 1 ) \
+         FROM DayEnergy WHERE Inverter=?2 AND Serial=?3 AND Date BETWEEN ?1 AND ?4 GROUP BY Inverter, Serial \
+         ON CONFLICT ( Inverter, Serial, Month ) DO UPDATE SET Energy=excluded.Energy, Days=excluded.Days, PeakPower=excluded.PeakPower, PeakTime=excluded.PeakTime");
+
+    auto stored_all = Exec("BEGIN IMMEDIATE");
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto source = catalog.GetSource(batch.sources[i]);
+        insert.Bind(0, static_cast<long long>(batch.times[i]));
+        insert.Bind(1, catalog.GetString(source.inverter));
+        insert.Bind(2, static_cast<long long>(source.serial));
+        insert.Bind(3, static_cast<long long>(std::llround(batch.current[i])));
+        insert.Bind(4, std::round(batch.energy[i] * 1000) / 1000);
+        stored_all = insert.Execute() && stored_all;
+    }
+    const auto days = SummariseDays(batch);
+    for (const auto &day : days) {
+        const auto source = catalog.GetSource(day.source);
+        day_energy.Bind(0, static_cast<long long>(day.time));
+        day_energy.Bind(1, catalog.GetString(source.inverter));
+        day_energy.Bind(2, static_cast<long long>(source.serial));
+        day_energy.Bind(3, std::round(day.start * 1000) / 1000);
+        day_energy.Bind(4, std::round(day.end * 1000) / 1000);
+        day_energy.Bind(5, static_cast<long long>(std::llround(day.peak)));
+        day_energy.Bind(6, static_cast<long long>(day.peak_time));
+        stored_all = day_energy.Execute() && stored_all;
+    }
+    for (const auto &month : SummariseMonths(days)) {
+        const auto source = catalog.GetSource(month.source);
+        month_energy.Bind(0, month.first);
+        month_energy.Bind(1, catalog.GetString(source.inverter));
+        month_energy.Bind(2, static_cast<long long>(source.serial));
+        month_energy.Bind(3, month.last);
+        stored_all = month_energy.Execute() && stored_all;
+    }
+    // the sync state only moves once the whole batch is stored
+    if (stored_all)
+        stored_all = UpdateSyncState("LastArchive", LatestTimes(batch), catalog);
+    if (!stored_all) {
+        Exec("ROLLBACK");
+        return false;
+    }
+    return Exec("COMMIT");
+}
+
+std::vector<PVOutputRecord> SQLiteStorage::PendingPVOutput(int max_power, const DayDataKey &after, std::size_t limit)
+{
+    auto &query = Prepare(SQLITE_PVOUTPUT_PENDING);
+    query.Bind(0, static_cast<long long>(max_power));
+    query.Bind(1, after.date_time.empty() ? 0LL : std::stoll(after.date_time));
+    query.Bind(2, after.inverter);
+    query.Bind(3, static_cast<long long>(after.serial));
+    query.Bind(4, static_cast<long long>(limit));
+
+    std::vector<PVOutputRecord> pending;
+    while (query.Step())
+        pending.push_back({query.Text(0), query.Text(1), query.Text(2), query.Text(3), {query.Text(4), query.Text(5), static_cast<unsigned long long>(query.Integer(6))}});
+
+    return pending;
+}
+
+void SQLiteStorage::MarkPVOutput(const DayDataKey &key)
+{
+    auto &update = Prepare("UPDATE DayData SET PVOutput=CAST(strftime('%s', 'now') AS INTEGER) WHERE DateTime=? AND Inverter=? AND Serial=?");
+    auto &sync_update = Prepare("UPDATE SyncState SET LastUpload=max(ifnull(LastUpload, ?1), ?1) WHERE Inverter=?2 AND Serial=?3");
+    if (!Exec("BEGIN IMMEDIATE"))
+        return;
+    for (auto *statement : {&update, &sync_update}) {
+        statement->Bind(0, std::stoll(key.date_time));
+        statement->Bind(1, key.inverter);
+        statement->Bind(2, static_cast<long long>(key.serial));
+    }
+    if (!update.Execute() || !sync_update.Execute() || !Exec("COMMIT"))
+        Exec("ROLLBACK");
+}
+
+std::vector<std::pair<std::string, float>> SQLiteStorage::FinishedDays(const std::string &before, std::size_t limit)
+{
+    auto &query = Prepare(SQLITE_FINISHED_DAYS);
+    query.Bind(0, before);
+    query.Bind(1, static_cast<long long>(limit));
+
+    std::vector<std::pair<std::string, float>> days;
+    while (query.Step())
+        days.emplace_back(query.Text(0), static_cast<float>(query.Real(1)));
+
+    return days;
+}
+
+std::vector<MonthTotal> SQLiteStorage::MonthTotals(const std::string &from, const std::string &to)
+{
+    auto &query = Prepare(SQLITE_MONTH_TOTALS);
+    query.Bind(0, from);
+    query.Bind(1, to);
+
+    std::vector<MonthTotal> months;
+    while (query.Step()) {
+        months.push_back({query.Text(0), query.Text(1), static_cast<unsigned long long>(query.Integer(2)), query.Real(3), static_cast<int>(query.Integer(4)),
+                          static_cast<int>(query.Integer(5)), query.Text(6)});
+    }
+    return months;
+}
+
+bool SQLiteStorage::StoreMonthData(const ArchiveBatch &batch, const SampleCatalog &catalog)
+{
+    auto &insert = Prepare("INSERT INTO MonthData ( Date, Inverter, Serial, ETotal, EDay ) VALUES ( date(?, 'unixepoch', 'localtime'), ?, ?, ?, ? ) \
+         ON CONFLICT ( Inverter, Serial, Date ) DO UPDATE SET ETotal=excluded.ETotal, EDay=excluded.EDay");
+
+    auto stored_all = Exec("BEGIN IMMEDIATE");
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto source = catalog.GetSource(batch.sources[i]);
+        insert.Bind(0, static_cast<long long>(batch.times[i]));
+        insert.Bind(1, catalog.GetString(source.inverter));
+        insert.Bind(2, static_cast<long long>(source.serial));
+        insert.Bind(3, std::round(batch.energy[i] * 1000) / 1000);
+        insert.Bind(4, std::round(batch.current[i] * 1000.0) / 1000);
+        stored_all = insert.Execute() && stored_all;
+    }
+    if (!stored_all) {
+        Exec("ROLLBACK");
+        return false;
+    }
+    return Exec("COMMIT");
+}
+
+std::string SQLiteStorage::MonthDataWatermark(const char *inverter, unsigned long long serial)
+{
+    auto &query = Prepare(SQLITE_MONTH_WATERMARK);
+    query.Bind(0, inverter);
+    query.Bind(1, static_cast<long long>(serial));
+
+    std::string watermark;
+    if (query.Step())
+        watermark = query.Text(0);
+    query.Reset();
+    return watermark;
+}
+
+bool SQLiteStorage::StoreLive(const LiveBatch &batch, const SampleCatalog &catalog, LiveValueCache &cache)
+{
+    auto &inverter_insert = Prepare("INSERT OR IGNORE INTO Inverters ( Inverter, Serial ) VALUES ( ?, ? )");
+    auto &inverter_select = Prepare("SELECT id FROM Inverters WHERE Inverter=? AND Serial=?");
+    auto &metric_upsert = Prepare("INSERT INTO Metric ( Description, Units, Decimals, Kind ) VALUES ( ?, ?, ?, ? ) \
+         ON CONFLICT ( Description ) DO UPDATE SET Units=excluded.Units, Decimals=excluded.Decimals, Kind=excluded.Kind");
+    auto &metric_select = Prepare("SELECT id FROM Metric WHERE Description=?");
+    auto &text_insert = Prepare("INSERT OR IGNORE INTO MetricText ( Text ) VALUES ( ? )");
+    auto &text_select = Prepare("SELECT id FROM MetricText WHERE Text=?");
+    auto &insert = Prepare("INSERT INTO LiveValue ( DateTime, InverterId, MetricId, Value, Mean, Min, Max ) VALUES ( ?, ?, ?, ?, ?, ?, ? ) \
+         ON CONFLICT ( InverterId, MetricId, DateTime ) DO UPDATE SET Value=excluded.Value, Mean=excluded.Mean, Min=excluded.Min, Max=excluded.Max");
+
+    const auto select_id = [](SQLiteStatement &select) {
+        const auto id = select.Step() ? select.Integer(0) : 0;
+        select.Reset();
+        return id;
+    };
+
+    // dimension rows are looked up once per batch
+    std::unordered_map<SourceId, long long> inverter_ids;
+    std::unordered_map<MetricId, long long> metric_ids;
+    std::unordered_map<StringId, long long> text_ids;
+
+    auto cached = cache;
+    auto stored_all = Exec("BEGIN IMMEDIATE");
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        const auto source = catalog.GetSource(batch.sources[i]);
+        const auto metric = catalog.GetMetric(batch.metrics[i]);
+        const auto &inverter = catalog.GetString(source.inverter);
+        const auto &description = catalog.GetString(metric.description);
+        const auto value = FormatLiveValue(catalog, metric, batch.values[i]);
+
+        // windows are stored even when their last value did not change
+        auto live_data = true;
+        if (!batch.Windowed(i) && (metric.persistent || (metric.kind == MetricKind::Number && batch.values[i] == 0)))
+            live_data = cache.Changed(inverter, source.serial, description, value);
+        if (!live_data)
+            continue;
+
+        auto [inverter_id, new_inverter] = inverter_ids.try_emplace(batch.sources[i], 0);
+        if (new_inverter) {
+            inverter_insert.Bind(0, inverter);
+            inverter_insert.Bind(1, static_cast<long long>(source.serial));
+            inverter_insert.Execute();
+            inverter_select.Bind(0, inverter);
+            inverter_select.Bind(1, static_cast<long long>(source.serial));
+            inverter_id->second = select_id(inverter_select);
+        }
+        auto [metric_id, new_metric] = metric_ids.try_emplace(batch.metrics[i], 0);
+        if (new_metric) {
+            metric_upsert.Bind(0, description);
+            metric_upsert.Bind(1, catalog.GetString(metric.units));
+            metric_upsert.Bind(2, static_cast<long long>(metric.decimals));
+            metric_upsert.Bind(3, static_cast<long long>(metric.kind));
+            metric_upsert.Execute();
+            metric_select.Bind(0, description);
+            metric_id->second = select_id(metric_select);
+        }
+
+        // text values are stored as the id of their MetricText row
+        auto stored = batch.values[i];
+        if (metric.kind == MetricKind::Text) {
+            auto [text_id, new_text] = text_ids.try_emplace(static_cast<StringId>(batch.values[i]), 0);
+            if (new_text) {
+                text_insert.Bind(0, value);
+                text_insert.Execute();
+                text_select.Bind(0, value);
+                text_id->second = select_id(text_select);
+            }
+            stored = static_cast<double>(text_id->second);
+        }
+
+        insert.Bind(0, static_cast<long long>(batch.times[i]));
+        insert.Bind(1, inverter_id->second);
+        insert.Bind(2, metric_id->second);
+        insert.Bind(3, stored);
+        if (batch.Windowed(i)) {
+            insert.Bind(4, batch.means[i]);
+            insert.Bind(5, batch.minimums[i]);
+            insert.Bind(6, batch.maximums[i]);
+        } else {
+            for (int column = 4; column < 7; ++column)
+                insert.BindNull(column);
+        }
+        if (insert.Execute())
+            cache.Update(inverter, source.serial, description, value);
+        else
+            stored_all = false;
+    }
+    if (stored_all)
+        stored_all = UpdateSyncState("LastLive", LatestTimes(batch), catalog);
+    if (stored_all && Exec("COMMIT"))
+        return true;
+    // the values of a rolled back batch are not stored, the cache must not skip them next time
+    Exec("ROLLBACK");
+    cache = std::move(cached);
+    return false;
+}
+
+void SQLiteStorage::PrimeLiveCache(LiveValueCache &cache)
+{
+    auto &query = Prepare(SQLITE_LATEST_LIVE);
+    while (query.Step()) {
+        const auto kind = static_cast<MetricKind>(query.Integer(3));
+        const auto value = kind == MetricKind::Text ? query.Text(6) : FormatLiveValue(kind, static_cast<int>(query.Integer(4)), query.Real(5));
+        cache.Update(query.Text(0), static_cast<unsigned long long>(query.Integer(1)), query.Text(2), value);
+    }
+
+    cache.MarkPrimed();
+}
+
+std::optional<double> SQLiteStorage::LatestLive(const char *inverter, unsigned long long serial, const char *description)
+{
+    auto &query = Prepare(SQLITE_LATEST_METRIC);
+    query.Bind(0, inverter);
+    query.Bind(1, static_cast<long long>(serial));
+    query.Bind(2, description);
+
+    std::optional<double> value;
+    if (query.Step())
+        value = query.Real(0);
+    query.Reset();
+    return value;
+}
+
+std::optional<time_t> SQLiteStorage::LiveCompactedTo(const char *stage)
+{
+    auto &query = Prepare("SELECT data FROM settings WHERE value=?");
+    query.Bind(0, stage);
+    if (query.Step()) {
+        const auto day = static_cast<time_t>(std::stoll(query.Text(0)));
+        query.Reset();
+        return day;
+    }
+
+    // a stage that never ran starts with the oldest day
+    auto &oldest = Prepare("SELECT MIN(DateTime) FROM LiveValue");
+    std::optional<time_t> day;
+    if (oldest.Step() && !oldest.IsNull(0))
+        day = StartOfDay(static_cast<time_t>(oldest.Integer(0)));
+    oldest.Reset();
+    return day;
+}
+
+bool SQLiteStorage::CompactLiveDay(const char *stage, time_t day, LiveSeriesValues *previous)
+{
+    const auto next = NextDay(day);
+    const auto number = [](SQLiteStatement &query, int index) { return query.IsNull(index) ? NAN : query.Real(index); };
+    const auto bind_number = [](SQLiteStatement &query, int index, double value) {
+        if (std::isnan(value))
+            query.BindNull(index);
+        else
+            query.Bind(index, value);
+    };
+
+    auto stored_all = Exec("BEGIN IMMEDIATE");
+    auto &live_day = Prepare(SQLITE_LIVE_DAY);
+    live_day.Bind(0, static_cast<long long>(day));
+    live_day.Bind(1, static_cast<long long>(next));
+    std::vector<LiveRow> rows;
+    while (live_day.Step()) {
+        rows.push_back({live_day.Integer(0), live_day.Integer(1), static_cast<MetricKind>(live_day.Integer(2)), static_cast<time_t>(live_day.Integer(3)), live_day.Real(4),
+                        number(live_day, 5), number(live_day, 6), number(live_day, 7)});
+    }
+
+    if (previous) {
+        // the value an old series had before the day, the first day of a run has not seen it yet
+        auto &before = Prepare("SELECT Value FROM LiveValue WHERE InverterId=? AND MetricId=? AND DateTime < ? ORDER BY DateTime DESC LIMIT 1");
+        for (const auto &row : rows) {
+            if (previous->count({row.inverter, row.metric}) > 0)
+                continue;
+            before.Bind(0, row.inverter);
+            before.Bind(1, row.metric);
+            before.Bind(2, static_cast<long long>(day));
+            if (before.Step())
+                previous->emplace(std::make_pair(row.inverter, row.metric), before.Real(0));
+            before.Reset();
+        }
+
+        auto &remove = Prepare("DELETE FROM LiveValue WHERE InverterId=? AND MetricId=? AND DateTime=?");
+        for (const auto &row : RepeatedRows(rows, *previous)) {
+            remove.Bind(0, row.inverter);
+            remove.Bind(1, row.metric);
+            remove.Bind(2, static_cast<long long>(row.time));
+            stored_all = remove.Execute() && stored_all;
+        }
+    } else if (const auto hours = CompactHours(rows); hours.size() < rows.size()) {
+        auto &remove = Prepare("DELETE FROM LiveValue WHERE InverterId IN ( SELECT id FROM Inverters ) AND MetricId IN ( SELECT id FROM Metric ) AND DateTime >= ? AND DateTime < ?");
+        remove.Bind(0, static_cast<long long>(day));
+        remove.Bind(1, static_cast<long long>(next));
+        stored_all = remove.Execute() && stored_all;
+
+        auto &insert = Prepare("INSERT INTO LiveValue ( InverterId, MetricId, DateTime, Value, Mean, Min, Max ) VALUES ( ?, ?, ?, ?, ?, ?, ? )");
+        for (const auto &hour : hours) {
+            insert.Bind(0, hour.inverter);
+            insert.Bind(1, hour.metric);
+            insert.Bind(2, static_cast<long long>(hour.time));
+            insert.Bind(3, hour.value);
+            bind_number(insert, 4, hour.mean);
+            bind_number(insert, 5, hour.minimum);
+            bind_number(insert, 6, hour.maximum);
+            stored_all = insert.Execute() && stored_all;
+        }
+    }
+
+    auto &done = Prepare("INSERT INTO settings ( value, data ) VALUES ( ?, ? ) ON CONFLICT ( value ) DO UPDATE SET data=excluded.data");
+    done.Bind(0, stage);
+    done.Bind(1, std::to_string(next));
+    stored_all = done.Execute() && stored_all;
+
+    // a day that failed is left as it was and tried again by the next run
+    if (!stored_all) {
+        Exec("ROLLBACK");
+        return false;
+    }
+    return Exec("COMMIT");
+}
+
+void SQLiteStorage::CompactLive(time_t now)
+{
+    if (!m_retention.enabled())
+        return;
+
+    const auto deadline = time(nullptr) + LIVE_COMPACT_SECONDS;
+    const auto hourly_before = m_retention.HourlyBefore(now);
+    auto hourly = LiveCompactedTo("live_hourly");
+    for (; hourly && *hourly < hourly_before && time(nullptr) < deadline; *hourly = NextDay(*hourly)) {
+        if (!CompactLiveDay("live_hourly", *hourly, nullptr))
+            return;
+    }
+
+    // only days that are hourly already
+    if (m_retention.hourly_days <= 0 || !hourly)
+        return;
+    const auto changes_before = std::min(m_retention.ChangesBefore(now), *hourly);
+    LiveSeriesValues previous;
+    auto changes = LiveCompactedTo("live_changes");
+    for (; changes && *changes < changes_before && time(nullptr) < deadline; *changes = NextDay(*changes)) {
+        if (!CompactLiveDay("live_changes", *changes, &previous))
+            return;
+    }
+}
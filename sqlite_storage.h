@@ -0,0 +1,117 @@
+#ifndef SMA_BLUETOOTH_SQLITE_STORAGE_H
+#define SMA_BLUETOOTH_SQLITE_STORAGE_H
+
+#include <sqlite3.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "live_retention.h"
+#include "storage.h"
+
+class SQLiteStorage;
+
+/*
+ * Prepared SQLite statement. Parameters are bound by position starting at
+ * 0 like MySQLStatement, Step runs it and moves to the next result row.
+ */
+class SQLiteStatement
+{
+public:
+    SQLiteStatement(SQLiteStorage &storage, std::string query);
+    ~SQLiteStatement();
+    SQLiteStatement(const SQLiteStatement &) = delete;
+    SQLiteStatement &operator=(const SQLiteStatement &) = delete;
+
+    [[nodiscard]] bool valid() const { return m_stmt != nullptr; }
+    void Bind(int index, long long value);
+    void Bind(int index, double value);
+    void Bind(int index, std::string_view value);
+    void BindNull(int index);
+    // true while there is a result row, the statement is reset once it is done
+    bool Step();
+    // run to completion, false on an error
+    bool Execute();
+    // stop before the last row was read
+    void Reset();
+    [[nodiscard]] bool IsNull(int index) const { return sqlite3_column_type(m_stmt, index) == SQLITE_NULL; }
+    [[nodiscard]] long long Integer(int index) const { return sqlite3_column_int64(m_stmt, index); }
+    [[nodiscard]] double Real(int index) const { return sqlite3_column_double(m_stmt, index); }
+    [[nodiscard]] std::string Text(int index) const;
+
+private:
+    SQLiteStorage &m_storage;
+    sqlite3_stmt *m_stmt{nullptr};
+    std::string m_query;
+    std::chrono::steady_clock::time_point m_start{};
+    unsigned long long m_rows{0};
+    bool m_running{false};
+    bool m_failed{false};
+};
+
+/*
+ * Storage in a local SQLite file for sites without a MySQL server. The
+ * tables are created when the file is opened, times are unix timestamps
+ * and dates are local YYYY-MM-DD. The file runs in WAL mode so the
+ * storage thread can write while the main thread reads, every batch is
+ * written in one transaction.
+ */
+class SQLiteStorage : public Storage
+{
+public:
+    SQLiteStorage(const ConfType &conf, bool debug);
+    ~SQLiteStorage() override;
+
+    void Install() override;
+    void Update() override {}
+    bool CheckSchema() override;
+    void Explain() override;
+
+    bool HasAlmanac() override;
+    void StoreAlmanac(const char *sunrise, const char *sunset) override;
+    bool IsLight() override;
+
+    std::vector<SyncState> SyncStates() override;
+    TimeRangeList DayDataGaps(unsigned long long serial, time_t from, time_t to) override;
+    bool StoreDayData(const ArchiveBatch &batch, const SampleCatalog &catalog) override;
+    std::vector<PVOutputRecord> PendingPVOutput(int max_power, const DayDataKey &after, std::size_t limit) override;
+    void MarkPVOutput(const DayDataKey &key) override;
+    std::vector<std::pair<std::string, float>> FinishedDays(const std::string &before, std::size_t limit) override;
+    std::vector<MonthTotal> MonthTotals(const std::string &from, const std::string &to) override;
+
+    bool StoreMonthData(const ArchiveBatch &batch, const SampleCatalog &catalog) override;
+    std::string MonthDataWatermark(const char *inverter, unsigned long long serial) override;
+
+    bool StoreLive(const LiveBatch &batch, const SampleCatalog &catalog, LiveValueCache &cache) override;
+    void PrimeLiveCache(LiveValueCache &cache) override;
+    std::optional<double> LatestLive(const char *inverter, unsigned long long serial, const char *description) override;
+    void CompactLive(time_t now) override;
+
+    QueryStats &query_stats() override { return m_query_stats; }
+
+    [[nodiscard]] sqlite3 *handle() const { return m_db; }
+    [[nodiscard]] bool debug() const { return m_debug; }
+
+private:
+    // prepared once and reused for every later call with the same text
+    SQLiteStatement &Prepare(const std::string &query);
+    bool Exec(const char *query);
+    int UserVersion();
+    // column is LastArchive or LastLive, inside the transaction of the batch
+    bool UpdateSyncState(const char *column, const std::unordered_map<SourceId, time_t> &latest, const SampleCatalog &catalog);
+    // first day a compaction stage has not done yet
+    std::optional<time_t> LiveCompactedTo(const char *stage);
+    // a day of LiveValue reduced to hours, or to changes when previous is given, in one transaction
+    bool CompactLiveDay(const char *stage, time_t day, LiveSeriesValues *previous);
+
+    bool m_debug;
+    LiveRetention m_retention;
+    sqlite3 *m_db{nullptr};
+    QueryStats m_query_stats;
+    std::unordered_map<std::string, std::unique_ptr<SQLiteStatement>> m_statements;
+};
+
+#endif  //SMA_BLUETOOTH_SQLITE_STORAGE_H
@@ -0,0 +1,14 @@
+#include "storage.h"
+
+#include <cstring>
+
+#include "mysql_storage.h"
+#include "sqlite_storage.h"
+
+std::unique_ptr<Storage> OpenStorage(const ConfType &conf, bool debug, bool select_database)
+{
+    if (strlen(conf.SQLiteFile) > 0)
+        return std::make_unique<SQLiteStorage>(conf, debug);
+
+    return std::make_unique<MySQLStorage>(conf, debug, select_database);
+}
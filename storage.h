@@ -0,0 +1,110 @@
+#ifndef SMA_BLUETOOTH_STORAGE_H
+#define SMA_BLUETOOTH_STORAGE_H
+
+#include <cstddef>
+#include <ctime>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "archive_gaps.h"
+#include "live_cache.h"
+#include "query_stats.h"
+#include "sample_batch.h"
+#include "sma_struct.h"
+
+// how far an inverter has been synchronised, times as YYYY-MM-DD HH:MM:SS, empty if never
+struct SyncState {
+    std::string inverter;
+    unsigned long long serial;
+    std::string last_archive;  // newest DayData record
+    std::string last_live;     // newest live poll
+    std::string last_upload;   // newest DayData record sent to PVOutput
+};
+
+// primary key of a DayData record, as the backend returns it
+struct DayDataKey {
+    std::string date_time;
+    std::string inverter;
+    unsigned long long serial{0};
+};
+
+// a DayData record waiting to be sent to PVOutput, formatted for the API
+struct PVOutputRecord {
+    std::string date;    // YYYYMMDD
+    std::string time;    // HH:MM
+    std::string energy;  // Wh generated so far that day
+    std::string power;   // W
+    DayDataKey key;      // for MarkPVOutput and the next PendingPVOutput
+};
+
+/*
+ * Everything the tool keeps in a database: DayData with its DayEnergy and
+ * MonthEnergy rollups, updated with every batch, MonthData, LiveData, the
+ * Almanac and the schema version. Each thread opens its own Storage.
+ * Errors are reported by the backend and the affected data is skipped,
+ * the same as a failed query always was.
+ */
+class Storage
+{
+public:
+    virtual ~Storage() = default;
+
+    // create the database and its tables
+    virtual void Install() = 0;
+    virtual void Update() = 0;
+    // false after printing a hint if the schema is not the current one
+    virtual bool CheckSchema() = 0;
+    // housekeeping before a run
+    virtual void Maintain() {}
+    // print how the built-in queries are executed
+    virtual void Explain() = 0;
+    // make sure the database can be used again after a long pause
+    virtual void Ping() {}
+
+    virtual bool HasAlmanac() = 0;
+    // sunrise and sunset of today as HH:MM
+    virtual void StoreAlmanac(const char *sunrise, const char *sunset) = 0;
+    // after sunrise and no DayData recorded after sunset yet
+    virtual bool IsLight() = 0;
+
+    // every inverter stored so far. The Store functions and MarkPVOutput move
+    // it forward in the transaction of the rows, once all of them are stored
+    virtual std::vector<SyncState> SyncStates() = 0;
+    virtual TimeRangeList DayDataGaps(unsigned long long serial, time_t from, time_t to) = 0;
+    // the Store functions return false if part of the batch could not be stored
+    virtual bool StoreDayData(const ArchiveBatch &batch, const SampleCatalog &catalog) = 0;
+    // the fastest way to store a large backlog
+    virtual bool StoreDayDataBulk(const ArchiveBatch &batch, const SampleCatalog &catalog) { return StoreDayData(batch, catalog); }
+    // up to limit records in key order after the key after, an empty after.date_time means from the start
+    virtual std::vector<PVOutputRecord> PendingPVOutput(int max_power, const DayDataKey &after, std::size_t limit) = 0;
+    virtual void MarkPVOutput(const DayDataKey &key) = 0;
+    // energy in Wh generated by all inverters on up to limit finished days before a YYYYMMDD day, newest first
+    virtual std::vector<std::pair<std::string, float>> FinishedDays(const std::string &before, std::size_t limit) = 0;
+    // rollup rows of the months from from to to, YYYY-MM-DD
+    virtual std::vector<MonthTotal> MonthTotals(const std::string &from, const std::string &to) = 0;
+
+    virtual bool StoreMonthData(const ArchiveBatch &batch, const SampleCatalog &catalog) = 0;
+    // last day stored for an inverter as YYYY-MM-DD 00:00:00, empty if there is none
+    virtual std::string MonthDataWatermark(const char *inverter, unsigned long long serial) = 0;
+
+    virtual bool StoreLive(const LiveBatch &batch, const SampleCatalog &catalog, LiveValueCache &cache) = 0;
+    virtual void PrimeLiveCache(LiveValueCache &cache) = 0;
+    virtual std::optional<double> LatestLive(const char *inverter, unsigned long long serial, const char *description) = 0;
+    // thin out old LiveValue rows by the retention in the config, see LiveRetention
+    virtual void CompactLive(time_t now) = 0;
+
+    // time spent in every query of this storage
+    [[nodiscard]] virtual QueryStats &query_stats() = 0;
+};
+
+/*
+ * SQLite when SQLiteFile is set, MySQL otherwise. select_database false
+ * connects to a MySQL server without using the database, for Install.
+ * Throws std::runtime_error if the database can not be opened.
+ */
+std::unique_ptr<Storage> OpenStorage(const ConfType &conf, bool debug, bool select_database = true);
+
+#endif  //SMA_BLUETOOTH_STORAGE_H
@@ -0,0 +1,269 @@
+#include "storage_writer.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "sma_mysql.h"
+
+// records per LOAD DATA, about a year of one inverter
+static constexpr std::size_t BULK_LOAD_ROWS = 100000;
+// pause before the database is tried again after it failed
+static constexpr std::chrono::seconds STORE_RETRY{30};
+
+StorageWriter::StorageWriter(const ConfType &conf, const SampleCatalog &catalog, bool debug, bool bulk_load, std::size_t capacity)
+    : m_conf(conf), m_catalog(catalog), m_batch_rows(conf.daydata_batch_rows > 0 ? conf.daydata_batch_rows : 1), m_debug(debug), m_bulk_load(bulk_load), m_queue(capacity)
+{
+    if (strlen(conf.WalDir) > 0) {
+        m_log.emplace(conf.WalDir);
+        m_forwarded = m_log->acknowledged();
+        OpenDatabase();
+    } else {
+        m_storage = OpenStorage(conf, debug);
+    }
+    m_thread = std::thread(&StorageWriter::Run, this);
+}
+
+StorageWriter::~StorageWriter()
+{
+    Finish();
+}
+
+void StorageWriter::PushDayArchive(ArchiveBatch batch)
+{
+    StorageBatch item;
+    item.kind = StorageBatch::Kind::DayArchive;
+    item.archive = std::move(batch);
+    Push(std::move(item));
+}
+
+void StorageWriter::PushMonthArchive(ArchiveBatch batch)
+{
+    StorageBatch item;
+    item.kind = StorageBatch::Kind::MonthArchive;
+    item.archive = std::move(batch);
+    Push(std::move(item));
+}
+
+void StorageWriter::PushLive(LiveBatch batch)
+{
+    StorageBatch item;
+    item.kind = StorageBatch::Kind::Live;
+    item.live = std::move(batch);
+    Push(std::move(item));
+}
+
+void StorageWriter::Push(StorageBatch batch)
+{
+    if (m_queue.closed())
+        return;
+
+    if (!m_queue.TryPush(batch)) {
+        ++m_stats.stalls;
+        const auto start = std::chrono::steady_clock::now();
+        while (!m_queue.TryPush(batch))
+            Wait(m_push_waiting, [this]() { return m_queue.size() < m_queue.capacity(); });
+        m_stats.stalled += std::chrono::steady_clock::now() - start;
+    }
+    Wake(m_pop_waiting);
+
+    ++m_stats.batches;
+    m_stats.max_depth = std::max(m_stats.max_depth, m_queue.size());
+}
+
+bool StorageWriter::Pop(StorageBatch &batch)
+{
+    while (!m_queue.TryPop(batch)) {
+        // anything pushed before Close is still delivered
+        if (m_queue.closed())
+            return m_queue.TryPop(batch);
+        Wait(m_pop_waiting, [this]() { return m_queue.size() > 0 || m_queue.closed(); });
+    }
+    Wake(m_push_waiting);
+
+    return true;
+}
+
+template <typename Ready>
+void StorageWriter::Wait(std::atomic<bool> &waiting, Ready ready)
+{
+    std::unique_lock<std::mutex> lock(m_wake_mutex);
+    waiting.store(true, std::memory_order_relaxed);
+    // pairs with the fence in Wake: either ready() sees the other side's change or Wake sees waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_wake.wait(lock, ready);
+    waiting.store(false, std::memory_order_relaxed);
+}
+
+void StorageWriter::Wake(const std::atomic<bool> &waiting)
+{
+    // the lock is only taken when the other side sleeps, a busy queue stays lock free
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!waiting.load(std::memory_order_relaxed))
+        return;
+
+    std::lock_guard<std::mutex> lock(m_wake_mutex);
+    m_wake.notify_all();
+}
+
+void StorageWriter::Finish()
+{
+    m_queue.Close();
+    Wake(m_pop_waiting);
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+bool StorageWriter::Store(StorageBatch &batch, const SampleCatalog &catalog, bool collect_bulk)
+{
+    auto stored = true;
+    switch (batch.kind) {
+    case StorageBatch::Kind::DayArchive:
+        if (m_bulk_load && collect_bulk) {
+            m_bulk.Append(batch.archive);
+            if (m_bulk.size() >= BULK_LOAD_ROWS)
+                stored = StoreBulk(catalog);
+            break;
+        }
+        stored = m_storage->StoreDayData(batch.archive, catalog);
+        if (stored)
+            m_written += batch.archive.size();
+        break;
+    case StorageBatch::Kind::MonthArchive:
+        stored = m_storage->StoreMonthData(batch.archive, catalog);
+        if (stored)
+            m_written += batch.archive.size();
+        break;
+    case StorageBatch::Kind::Live:
+        if (!m_live_cache.primed() && (strlen(m_conf.LiveCacheFile) == 0 || !m_live_cache.Load(m_conf.LiveCacheFile)))
+            m_storage->PrimeLiveCache(m_live_cache);
+        stored = m_storage->StoreLive(batch.live, catalog, m_live_cache);
+        if (strlen(m_conf.LiveCacheFile) > 0 && !m_live_cache.Save(m_conf.LiveCacheFile))
+            fmt::print(stderr, "Error! Could not write {}\n", m_conf.LiveCacheFile);
+        if (stored)
+            m_written += batch.live.size();
+        break;
+    case StorageBatch::Kind::None:
+        break;
+    }
+
+    return stored;
+}
+
+bool StorageWriter::StoreBulk(const SampleCatalog &catalog)
+{
+    if (m_bulk.empty())
+        return true;
+
+    const auto stored = m_storage->StoreDayDataBulk(m_bulk, catalog);
+    if (stored)
+        m_written += m_bulk.size();
+    m_bulk.clear();
+    return stored;
+}
+
+bool StorageWriter::OpenDatabase()
+{
+    if (m_storage)
+        return true;
+    if (std::chrono::steady_clock::now() < m_retry_at)
+        return false;
+
+    try {
+        m_storage = OpenStorage(m_conf, m_debug);
+        return true;
+    } catch (const std::runtime_error &e) {
+        fmt::print(stderr, "Error! Could not open the database: {}, batches wait in {}\n", e.what(), m_conf.WalDir);
+        m_retry_at = std::chrono::steady_clock::now() + STORE_RETRY;
+        return false;
+    }
+}
+
+void StorageWriter::Forward()
+/* Store the batches of the log not stored yet, oldest first */
+{
+    if (std::chrono::steady_clock::now() < m_retry_at || !OpenDatabase())
+        return;
+
+    m_log->Replay(m_forwarded, m_replay_catalog, [this](StorageBatch &batch, LogPosition position) {
+        if (!Store(batch, m_replay_catalog)) {
+            // everything after the last acknowledgement is read back again later
+            fmt::print(stderr, "Error! Could not store a batch, retrying in {} s\n", STORE_RETRY.count());
+            m_bulk.clear();
+            m_forwarded = m_log->acknowledged();
+            m_retry_at = std::chrono::steady_clock::now() + STORE_RETRY;
+            return false;
+        }
+
+        m_forwarded = position;
+        // collected bulk records are only safe once they were loaded
+        if (m_bulk.empty())
+            m_log->Acknowledge(position);
+        return true;
+    });
+}
+
+void StorageWriter::Run()
+{
+    mysql_thread_init();
+
+    // batches earlier runs could not store go first
+    if (m_log)
+        Forward();
+
+    StorageBatch batch;
+    StorageBatch next;
+    bool have_next = false;
+    while (have_next || Pop(batch)) {
+        if (have_next) {
+            batch = std::move(next);
+            have_next = false;
+        }
+
+        // merge archive batches already waiting so each INSERT carries up to DayDataBatchRows records
+        if (batch.kind == StorageBatch::Kind::DayArchive) {
+            while (batch.archive.size() < m_batch_rows && m_queue.TryPop(next)) {
+                if (next.kind != StorageBatch::Kind::DayArchive) {
+                    have_next = true;
+                    break;
+                }
+                batch.archive.Append(next.archive);
+            }
+            Wake(m_push_waiting);
+        }
+
+        if (!m_log) {
+            Store(batch, m_catalog);
+            continue;
+        }
+
+        if (!m_log->Append(batch, m_catalog)) {
+            fmt::print(stderr, "Error! Could not write to {}: {}\n", m_conf.WalDir, strerror(errno));
+            // m_bulk holds ids of m_replay_catalog, this batch is stored on its own
+            if (OpenDatabase())
+                Store(batch, m_catalog, false);
+            continue;
+        }
+        // one fsync for every batch that arrived together, then the database gets them
+        if (!have_next && m_queue.size() == 0) {
+            if (!m_log->Sync())
+                fmt::print(stderr, "Error! Could not sync {}: {}\n", m_conf.WalDir, strerror(errno));
+            Forward();
+        }
+    }
+
+    if (m_log) {
+        m_log->Sync();
+        // a failed database is tried once more before the run ends
+        m_retry_at = {};
+        Forward();
+        if (m_storage && !m_bulk.empty() && StoreBulk(m_replay_catalog))
+            m_log->Acknowledge(m_forwarded);
+    } else {
+        StoreBulk(m_catalog);
+    }
+
+    mysql_thread_end();
+}
@@ -0,0 +1,100 @@
+#ifndef SMA_BLUETOOTH_STORAGE_WRITER_H
+#define SMA_BLUETOOTH_STORAGE_WRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "batch_log.h"
+#include "live_cache.h"
+#include "sample_batch.h"
+#include "sma_struct.h"
+#include "spsc_queue.h"
+#include "storage.h"
+
+// producer side view of how often the database held up the inverter session
+struct StorageWriterStats {
+    std::size_t batches{0};
+    std::size_t max_depth{0};  // most batches waiting at once
+    std::size_t stalls{0};     // pushes that found the queue full
+    std::chrono::steady_clock::duration stalled{};
+};
+
+/*
+ * Does all database writes on its own thread and Storage so a slow
+ * database never delays the bluetooth protocol. Batches are handed over
+ * through a lock free queue; when it is full the inverter thread waits,
+ * which is counted in stats(). A side only sleeps on a condition variable
+ * when the queue is full or empty, the other one just checks a flag. Finish stores everything queued before
+ * it returns, the destructor calls it. In bulk load mode day archive
+ * records are collected and stored with StoreDayDataBulk.
+ *
+ * With a WalDir every batch goes through a BatchLog first and is stored
+ * from there, so batches the database could not take, in this run or an
+ * earlier one, are stored once it is back. Without one the constructor
+ * throws std::runtime_error if the database can not be opened.
+ */
+class StorageWriter
+{
+public:
+    StorageWriter(const ConfType &conf, const SampleCatalog &catalog, bool debug, bool bulk_load = false, std::size_t capacity = 64);
+    ~StorageWriter();
+    StorageWriter(const StorageWriter &) = delete;
+    StorageWriter &operator=(const StorageWriter &) = delete;
+
+    void PushDayArchive(ArchiveBatch batch);
+    void PushMonthArchive(ArchiveBatch batch);
+    void PushLive(LiveBatch batch);
+    // wait until every queued batch has been stored
+    void Finish();
+
+    // records stored so far
+    [[nodiscard]] std::size_t written() const { return m_written; }
+    [[nodiscard]] const StorageWriterStats &stats() const { return m_stats; }
+    // only read after Finish, the storage thread updates them
+    [[nodiscard]] const QueryStats &query_stats() const { return m_storage ? m_storage->query_stats() : m_no_query_stats; }
+    // bytes of the log still waiting for the database
+    [[nodiscard]] std::uint64_t unstored() const { return m_log ? m_log->pending() : 0; }
+
+private:
+    void Push(StorageBatch batch);
+    bool Pop(StorageBatch &batch);
+    template <typename Ready>
+    void Wait(std::atomic<bool> &waiting, Ready ready);
+    void Wake(const std::atomic<bool> &waiting);
+    // day archives are only collected into m_bulk with the catalog m_bulk is flushed with
+    bool Store(StorageBatch &batch, const SampleCatalog &catalog, bool collect_bulk = true);
+    bool StoreBulk(const SampleCatalog &catalog);
+    bool OpenDatabase();
+    void Forward();
+    void Run();
+
+    ConfType m_conf;
+    std::unique_ptr<Storage> m_storage;
+    QueryStats m_no_query_stats;
+    std::optional<BatchLog> m_log;
+    SampleCatalog m_replay_catalog;  // ids of batches read back from m_log
+    LogPosition m_forwarded;         // end of the last batch read back from m_log
+    std::chrono::steady_clock::time_point m_retry_at{};
+    const SampleCatalog &m_catalog;
+    LiveValueCache m_live_cache;
+    std::size_t m_batch_rows;
+    bool m_debug;
+    bool m_bulk_load;
+    ArchiveBatch m_bulk;
+    SpscQueue<StorageBatch> m_queue;
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake;
+    std::atomic<bool> m_push_waiting{false};  // the queue was full
+    std::atomic<bool> m_pop_waiting{false};   // the queue was empty
+    StorageWriterStats m_stats;
+    std::atomic<std::size_t> m_written{0};
+    std::thread m_thread;
+};
+
+#endif  //SMA_BLUETOOTH_STORAGE_WRITER_H